@@ -0,0 +1,188 @@
+/*
+  SD stream benchmark for the Suuret Muinaiset players (Teensy 4.0 + audio shield).
+  Measures how many WAV streams the card sustains next to the track, with the nodes and the
+  read scheduling of the firmware: AudioPlaySdStream and wavFillLowest() from wavCtrl.h (a link
+  to ../teensy_code/wavCtrl.h, copy the file here if your system does not keep links), one
+  WAV_READ_BYTES read every FILL_MS at most, the audio interrupt held off during each access.
+  The track plays through AudioPlaySdWav, reading the card from the audio interrupt as in the
+  installation, and everything is mixed to the output.
+
+  Copy BENCH_FILE and BENCH_TRACK to the card, open the serial monitor. Each run plays 1 to
+  MAX_STREAMS streams of BENCH_FILE (each from a different place in the file) for RUN_SECONDS
+  and prints, per run:
+    Underruns   audio blocks the streams played as silence, their ring empty
+    KB/s        read rate needed by the streams and reached
+    Max Read    longest time the audio interrupt was held off by a read
+    Late        reads longer than one audio block (2.9 ms), each one delays the track player
+    CPU Max     AudioProcessorUsageMax(), audio interrupt load
+    Track Lag   how far the track position fell behind the wall clock
+  The count before the first run with underruns is the number of streams the card sustains.
+*/
+
+#include <Audio.h>
+#include <SPI.h>
+#include <SD.h>
+#include "wavCtrl.h"
+
+#define BENCH_FILE "BED1.WAV"     // streamed, 16 bit PCM at 44.1 kHz, mono or stereo
+#define BENCH_TRACK "LONG.WAV"    // played by AudioPlaySdWav during the runs, "" for none
+#define MAX_STREAMS 8
+#define RUN_SECONDS 10
+#define FILL_MS 2                 // as STREAM_FILL_MS
+#define BLOCK_US 2902             // one audio block of 128 samples at 44.1 kHz
+
+//AUDIO
+AudioPlaySdWav wavPlayer;
+AudioPlaySdStream streams[MAX_STREAMS];
+AudioMixer4 streamMixA;
+AudioMixer4 streamMixB;
+AudioMixer4 outputMix;
+AudioOutputI2S audioOutput;
+AudioControlSGTL5000 sgtl5000;
+
+AudioConnection patchCord1(streams[0], 0, streamMixA, 0);
+AudioConnection patchCord2(streams[1], 0, streamMixA, 1);
+AudioConnection patchCord3(streams[2], 0, streamMixA, 2);
+AudioConnection patchCord4(streams[3], 0, streamMixA, 3);
+AudioConnection patchCord5(streams[4], 0, streamMixB, 0);
+AudioConnection patchCord6(streams[5], 0, streamMixB, 1);
+AudioConnection patchCord7(streams[6], 0, streamMixB, 2);
+AudioConnection patchCord8(streams[7], 0, streamMixB, 3);
+AudioConnection patchCord9(wavPlayer, 0, outputMix, 0);
+AudioConnection patchCord10(streamMixA, 0, outputMix, 1);
+AudioConnection patchCord11(streamMixB, 0, outputMix, 2);
+AudioConnection patchCord12(outputMix, 0, audioOutput, 0);
+AudioConnection patchCord13(outputMix, 0, audioOutput, 1);
+
+//SD CARD
+const int SDCARD_CS_PIN = 10;
+const int SDCARD_MOSI_PIN = 11;
+const int SDCARD_SCK_PIN = 13;
+
+DMAMEM int16_t rings[MAX_STREAMS][WAV_BUFFER_SAMPLES];
+uint8_t scratch[WAV_READ_BYTES] __attribute__((aligned(4)));
+uint32_t fileFrames = 0;
+int channels = 1;
+
+//helper function checking the test file, the streams start at different places in it
+bool checkFile() {
+  File file = SD.open(BENCH_FILE);
+  if (!file) return false;
+  WavInfo wav;
+  bool valid = wavReadHeader(file, wav);
+  file.close();
+  fileFrames = valid ? wavFrames(wav) : 0;
+  channels = wav.channels;
+  return valid;
+}
+
+//plays count streams for RUN_SECONDS, prints one line of results
+uint32_t runStreams(int count) {
+  for (int i = 0; i < count; i++) {
+    streams[i].open(BENCH_FILE, rings[i], (uint64_t)fileFrames * i / count);
+  }
+
+  //every stream buffered and playing before the clock starts
+  int got;
+  uint32_t readUs;
+  bool allPlaying = false;
+  while (!allPlaying) {
+    if (wavFillLowest(streams, count, scratch, got, readUs) < 0 || got < 0) break;
+    allPlaying = true;
+    for (int i = 0; i < count; i++) allPlaying = allPlaying && streams[i].isPlaying();
+  }
+
+  if (strlen(BENCH_TRACK) > 0 && !wavPlayer.isPlaying()) wavPlayer.play(BENCH_TRACK);
+  delay(50);  //the player reads its header from the audio interrupt
+  for (int i = 0; i < count; i++) streams[i].underruns = 0;
+  AudioProcessorUsageMaxReset();
+
+  uint32_t reads = 0;
+  uint32_t late = 0;
+  uint32_t errors = 0;
+  uint32_t maxReadUs = 0;
+  uint64_t bytes = 0;
+  uint32_t trackStartMs = wavPlayer.positionMillis();
+  uint32_t startMs = millis();
+  elapsedMillis fillTimer;
+
+  while (millis() - startMs < RUN_SECONDS * 1000UL) {
+    if (fillTimer < FILL_MS) continue;
+    fillTimer = 0;
+    if (wavFillLowest(streams, count, scratch, got, readUs) < 0) continue;
+    if (got < 0) {
+      errors++;
+      continue;
+    }
+    reads++;
+    bytes += got;
+    if (readUs > maxReadUs) maxReadUs = readUs;
+    if (readUs > BLOCK_US) late++;
+  }
+
+  uint32_t elapsedMs = millis() - startMs;
+  int32_t trackLagMs = -1;
+  if (wavPlayer.isPlaying() && wavPlayer.positionMillis() >= trackStartMs) {
+    trackLagMs = (int32_t)elapsedMs - (int32_t)(wavPlayer.positionMillis() - trackStartMs);
+  }
+
+  uint32_t underruns = errors;
+  for (int i = 0; i < count; i++) {
+    underruns += streams[i].underruns;
+    streams[i].close();
+  }
+
+  Serial.printf("%7d %9lu %9lu %9lu %8lu us %6lu %6.1f %%", count, (unsigned long)underruns,
+                (unsigned long)(44100UL * 2 * channels * count / 1024), (unsigned long)(bytes / 1024 / RUN_SECONDS),
+                (unsigned long)maxReadUs, (unsigned long)late, AudioProcessorUsageMax());
+  if (trackLagMs >= 0) {
+    Serial.printf(" %6ld ms\n", (long)trackLagMs);
+  } else {
+    Serial.println("   ended");
+  }
+  return underruns;
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial && millis() < 5000) {}
+
+  AudioMemory(32);
+  sgtl5000.enable();
+  sgtl5000.volume(0.3);
+  outputMix.gain(0, 0.5f);
+  outputMix.gain(1, 0.25f);
+  outputMix.gain(2, 0.25f);
+
+  SPI.setMOSI(SDCARD_MOSI_PIN);
+  SPI.setSCK(SDCARD_SCK_PIN);
+  if (!SD.begin(SDCARD_CS_PIN)) {
+    Serial.println("Unable to access the SD card");
+    return;
+  }
+  if (!checkFile()) {
+    Serial.println(BENCH_FILE " missing, or not 16 bit 44.1 kHz PCM");
+    return;
+  }
+
+  Serial.printf("\n-- SD STREAM BENCHMARK --\n%s, %s, %d s per run, buffer %lu ms, reads of %d bytes every %d ms at most\n",
+                BENCH_FILE, channels == 1 ? "mono" : "stereo", RUN_SECONDS,
+                (unsigned long)(WAV_BUFFER_SAMPLES * 1000UL / 44100), WAV_READ_BYTES, FILL_MS);
+  if (strlen(BENCH_TRACK) > 0 && wavPlayer.play(BENCH_TRACK)) {
+    Serial.println("Track " BENCH_TRACK " playing from the audio interrupt");
+  } else {
+    Serial.println("No track playing");
+  }
+  Serial.println("Streams Underruns KB/s Need KB/s Read    Max Read   Late CPU Max Track Lag");
+
+  int sustained = 0;
+  for (int count = 1; count <= MAX_STREAMS; count++) {
+    if (runStreams(count) > 0) break;
+    sustained = count;
+  }
+  wavPlayer.stop();
+  Serial.printf("Sustained %d streams without underruns\n", sustained);
+}
+
+void loop() {
+}
@@ -0,0 +1 @@
+../teensy_code/wavCtrl.h
\ No newline at end of file
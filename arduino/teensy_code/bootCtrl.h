@@ -0,0 +1,98 @@
+/**
+ * bootCtrl.h - Boot Timeline Library
+ *
+ * Records when each boot stage ends (ms since reset) so the time the installation stays
+ * dark after a reboot can be measured and printed in the system report. Also brings the
+ * audio codec up from a one-shot task instead of blocking setup(): its power-up ramp then
+ * overlaps with the first schedule check and the relay sequence, and a codec failure is
+ * retried every CODEC_RETRY_MS without stopping light, serial or the schedule.
+ */
+
+#ifndef BOOTCTRL_H
+#define BOOTCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern float audioVolume;
+extern AudioControlSGTL5000 sgtl5000;
+
+#define BOOT_MAX_STAGES 20
+#define CODEC_RETRY_MS 100        // delay between codec enable attempts
+#define BOOT_LINK_GRACE 1000      // ms for the followers to finish setup before LONG sends the first command
+
+struct BootStage {
+  const char* name;
+  uint32_t ms;                    // millis() at the end of the stage
+};
+
+BootStage bootStages[BOOT_MAX_STAGES];
+int bootStageCount = 0;
+
+bool codecReady = false;
+uint32_t codecFailures = 0;
+int codecTask = TASK_NONE;
+
+/**
+ * Records the end of a boot stage, later calls with the same name are ignored
+ * @param name Stage name, a string literal
+ */
+void bootMark(const char* name) {
+  if (bootStageCount >= BOOT_MAX_STAGES) return;
+  for (int i = 0; i < bootStageCount; i++) {
+    if (bootStages[i].name == name) return;
+  }
+  bootStages[bootStageCount].name = name;
+  bootStages[bootStageCount].ms = millis();
+  bootStageCount++;
+}
+
+/**
+ * Enables the audio codec, re-armed every CODEC_RETRY_MS until it answers
+ * Run by the "codec" one-shot task
+ */
+void codecUpdate() {
+  if (sgtl5000.enable()) {
+    gainBegin(audioVolume);
+    dapBegin();
+    codecReady = true;
+    bootMark("codec");
+    Serial.println("Audio codec enabled");
+    return;
+  }
+
+  codecFailures++;
+  Serial.println("ERROR: Audio codec failed to enable");
+  displayBinaryCode(13); // Error indication
+  taskRunIn(codecTask, CODEC_RETRY_MS);
+}
+
+/**
+ * Registers the codec task and starts it right away, to be called once from setup
+ */
+void setupCodec() {
+  codecTask = taskAdd("codec", codecUpdate, ONE_SHOT, 2);
+  taskRunIn(codecTask, 0);
+}
+
+/**
+ * Prints the boot timeline to Serial, time of each stage end and its duration
+ */
+void bootReport() {
+  Serial.println("\n-- BOOT TIMELINE --");
+  Serial.println("stage            at ms  took ms");
+
+  uint32_t previousMs = 0;
+  for (int i = 0; i < bootStageCount; i++) {
+    Serial.printf("%-15s %6lu %8lu\n",
+                  bootStages[i].name,
+                  (unsigned long)bootStages[i].ms,
+                  (unsigned long)(bootStages[i].ms - previousMs));
+    previousMs = bootStages[i].ms;
+  }
+
+  Serial.print("Codec Failures ");
+  Serial.println(codecFailures);
+}
+
+#endif // BOOTCTRL_H
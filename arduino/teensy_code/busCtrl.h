@@ -0,0 +1,265 @@
+/**
+ * busCtrl.h - Redundant Serial Bus Library
+ *
+ * The units are linked by two UARTs: Serial3 (pins 14/15) and Serial1 (pins 0/1) on a second
+ * cable, Serial2 is out as its pins 7/8 carry the I2S data of the audio shield. Everything
+ * sent through busOut goes out on every port that is up, and both ports are read. The copy
+ * that arrives second is dropped: a frame or command received on one port that matches one
+ * received on the other port within BUS_DUP_MS (plus its time on the wire) is a duplicate.
+ * The same frame repeated on one port is never dropped.
+ *
+ * A port whose health degrades is taken down and the traffic continues on the other one:
+ * on LONG when half of the pings sent over it (see linkCtrl.h) are lost and clearly more than
+ * over the other port (a follower that is off loses pings on both), on followers when
+ * nothing arrives on it for BUS_SILENT_MS while the other port still receives. Pings keep
+ * probing a port that is down, it comes back up once healthy. Both ports are never down.
+ */
+
+#ifndef BUSCTRL_H
+#define BUSCTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+void crashLog(const char* format, ...);
+uint16_t crc16(const uint8_t* data, size_t length);
+
+#define BUS_BAUD 9600
+#define BUS_PORTS 2
+#define BUS_DUP_MS 200            // skew tolerated between the two copies of a frame
+#define BUS_DUP_LOG 8             // frames remembered for the duplicate check
+#define BUS_SILENT_MS 6000        // followers: port silent this long is down
+#define BUS_MIN_PINGS 8           // LONG: pings needed to judge a port
+#define BUS_DEGRADED_LOSS 50      // LONG: loss (%) over the last pings that takes a port down
+#define BUS_DEGRADED_GAP 30       // LONG: and how much worse than the other port it must be
+#define BUS_TX_BUFFER 96          // extra TX buffer per port, a frame is queued without waiting
+
+struct BusPort {
+  HardwareSerial* serial;
+  const char* name;
+  uint8_t txPin;
+  bool up;                    // carries the traffic
+  uint32_t lastRxMs;
+  uint32_t pingWindow;        // LONG: one bit per ping over this port, set if lost, newest in bit 0
+  uint8_t pings;              // LONG: pings in the window
+  uint32_t txBytes;
+  uint32_t rxBytes;
+  uint32_t rxFrames;          // frames and commands received
+  uint32_t duplicates;        // of which dropped as a copy of the other port
+  uint32_t errors;            // frames cut by the timeout or by a full buffer
+  uint32_t downs;             // times the port was taken down
+};
+
+// a frame recently received, to drop its copy from the other port
+struct BusRecent {
+  uint16_t crc;
+  uint16_t length;
+  uint8_t port;
+  uint32_t ms;
+};
+
+BusPort busPorts[BUS_PORTS] = {
+  { &Serial3, "Serial3", 15, true },
+  { &Serial1, "Serial1", 1, true }
+};
+BusRecent busRecent[BUS_DUP_LOG];
+uint8_t busRecentHead = 0;
+uint8_t busTxBuffers[BUS_PORTS][BUS_TX_BUFFER];
+
+// Print writing to every port that is up
+class BusOutput : public Print {
+public:
+  size_t write(uint8_t c) override {
+    for (int i = 0; i < BUS_PORTS; i++) {
+      if (!busPorts[i].up) continue;
+      busPorts[i].serial->write(c);
+      busPorts[i].txBytes++;
+    }
+    return 1;
+  }
+  using Print::write;
+};
+
+BusOutput busOut;
+
+/**
+ * @return Serial port of a bus port, to answer on the port a frame came from
+ */
+HardwareSerial& busSerial(int port) {
+  return *busPorts[port].serial;
+}
+
+/**
+ * Sends a line on one port only, for pings and their answers
+ * @param port Port to use, up or down
+ * @param line Line without its ending
+ */
+void busSend(int port, const char* line) {
+  busPorts[port].txBytes += busPorts[port].serial->println(line);
+}
+
+/**
+ * Starts both ports, to be called at the top of setup
+ */
+void busBegin() {
+  for (int i = 0; i < BUS_PORTS; i++) {
+    busPorts[i].serial->begin(BUS_BAUD);
+  }
+}
+
+/*
+ * helper function letting followers share the return line: TX only ever pulls it low
+ */
+void busOpenDrain() {
+  if (PLAYER_ID == 0) return;
+  for (int i = 0; i < BUS_PORTS; i++) {
+    busPorts[i].serial->setTX(busPorts[i].txPin, true);
+  }
+}
+
+/**
+ * Configures the ports once the player ID is known, to be called once from setup
+ */
+void setupBus() {
+  busOpenDrain();
+  for (int i = 0; i < BUS_PORTS; i++) {
+    busPorts[i].serial->addMemoryForWrite(busTxBuffers[i], BUS_TX_BUFFER);
+  }
+}
+
+/**
+ * Counts a frame or command read from a port
+ * @param port Port it came from
+ * @param length Bytes read
+ * @param complete False if it was cut by the timeout or a full buffer
+ */
+void busReceived(int port, size_t length, bool complete) {
+  BusPort &bus = busPorts[port];
+  bus.rxBytes += length;
+  bus.rxFrames++;
+  bus.lastRxMs = millis();
+  if (!complete) bus.errors++;
+}
+
+/**
+ * Checks whether a frame is the copy of one received on the other port, remembers it if not
+ * @param port Port it came from
+ * @param data Frame or command
+ * @param length Bytes
+ * @return True if it is a duplicate to drop
+ */
+bool busDuplicate(int port, const char* data, size_t length) {
+  uint16_t crc = crc16((const uint8_t*)data, length);
+  uint32_t now = millis();
+  uint32_t windowMs = BUS_DUP_MS + length * 2;  // the copies may be read one frame apart
+
+  for (int i = 0; i < BUS_DUP_LOG; i++) {
+    BusRecent &recent = busRecent[i];
+    if (recent.length == length && recent.crc == crc && recent.port != port &&
+        now - recent.ms <= windowMs) {
+      recent.length = 0;  //a copy matches once
+      busPorts[port].duplicates++;
+      return true;
+    }
+  }
+
+  BusRecent &recent = busRecent[busRecentHead];
+  recent.crc = crc;
+  recent.length = length;
+  recent.port = port;
+  recent.ms = now;
+  busRecentHead = (busRecentHead + 1) % BUS_DUP_LOG;
+  return false;
+}
+
+/**
+ * Records the outcome of a ping sent over a port, LONG only
+ * @param port Port used
+ * @param lost True if it was not answered in time
+ */
+void busPingResult(int port, bool lost) {
+  BusPort &bus = busPorts[port];
+  bus.pingWindow = (bus.pingWindow << 1) | (lost ? 1 : 0);
+  if (bus.pings < 32) bus.pings++;
+}
+
+/**
+ * @return Share of the last pings over a port that were lost (%), -1 if too few pings, LONG only
+ */
+int busLossPercent(int port) {
+  const BusPort &bus = busPorts[port];
+  if (bus.pings < BUS_MIN_PINGS) return -1;
+  uint32_t mask = bus.pings < 32 ? (1UL << bus.pings) - 1 : 0xFFFFFFFF;
+  return __builtin_popcount(bus.pingWindow & mask) * 100 / bus.pings;
+}
+
+/*
+ * helper function judging the health of a port
+ */
+bool busDegraded(int port) {
+  uint32_t now = millis();
+  const BusPort &bus = busPorts[port];
+  const BusPort &other = busPorts[1 - port];
+
+  if (PLAYER_ID == 0) {
+    int loss = busLossPercent(port);
+    int otherLoss = busLossPercent(1 - port);
+    return loss >= BUS_DEGRADED_LOSS && otherLoss >= 0 && loss - otherLoss >= BUS_DEGRADED_GAP;
+  }
+
+  return now - bus.lastRxMs > BUS_SILENT_MS && now - other.lastRxMs <= BUS_SILENT_MS;
+}
+
+/**
+ * Takes degraded ports down and healthy ones back up, keeps at least one port up
+ * Called once per second from statusUpdates()
+ */
+void busCheckHealth() {
+  bool degraded[BUS_PORTS];
+  bool allDegraded = true;
+  for (int i = 0; i < BUS_PORTS; i++) {
+    degraded[i] = busDegraded(i);
+    allDegraded = allDegraded && degraded[i];
+  }
+
+  for (int i = 0; i < BUS_PORTS; i++) {
+    BusPort &bus = busPorts[i];
+    bool up = allDegraded || !degraded[i];
+    if (up == bus.up) continue;
+
+    bus.up = up;
+    if (!up) bus.downs++;
+    Serial.print("Bus port ");
+    Serial.print(bus.name);
+    Serial.println(up ? " back up" : " degraded, traffic moved to the other port");
+    crashLog("%s %s", bus.name, up ? "up" : "down");
+  }
+}
+
+/**
+ * Prints per-port state and counters to Serial
+ */
+void busReport() {
+  Serial.println("\n-- BUS PORTS --");
+  Serial.println("port     state  txBytes  rxBytes  frames  dups  errors  downs  lastRx  pingLoss");
+  for (int i = 0; i < BUS_PORTS; i++) {
+    const BusPort &bus = busPorts[i];
+    Serial.printf("%-8s %-5s %8lu %8lu %7lu %5lu %7lu %6lu ",
+                  bus.name, bus.up ? "UP" : "DOWN",
+                  (unsigned long)bus.txBytes, (unsigned long)bus.rxBytes,
+                  (unsigned long)bus.rxFrames, (unsigned long)bus.duplicates,
+                  (unsigned long)bus.errors, (unsigned long)bus.downs);
+    if (bus.rxFrames > 0) {
+      Serial.printf("%6lus", (unsigned long)((millis() - bus.lastRxMs) / 1000));
+    } else {
+      Serial.print("  never");
+    }
+    if (PLAYER_ID == 0 && busLossPercent(i) >= 0) {
+      Serial.printf("  %7d%%\n", busLossPercent(i));
+    } else {
+      Serial.println("         -");
+    }
+  }
+}
+
+#endif // BUSCTRL_H
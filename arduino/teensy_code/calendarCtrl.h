@@ -0,0 +1,329 @@
+/**
+ * calendarCtrl.h - Show Calendar Library
+ *
+ * Operating hours loaded from SCHEDULE.BIN on the SD card: weekly windows (several per
+ * day, per weekday), date exceptions (closed days or replacement windows) and an action
+ * per window. The calendar is compiled into a sorted event table covering the next
+ * CAL_DAYS days, so the next transition is always calendarEvents[calendarCursor].
+ * Without a valid file, START_HOUR to END_HOUR every day is used, as before.
+ *
+ * The file is produced from a text description by tools/mkschedule.py.
+ */
+
+#ifndef CALENDARCTRL_H
+#define CALENDARCTRL_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include <RTClib.h>
+
+extern const int START_HOUR;
+extern const int END_HOUR;
+extern const char days[][12];
+
+#define CAL_FILE_NAME "SCHEDULE.BIN"
+#define CAL_MAGIC "SMSC"
+#define CAL_VERSION 1
+#define CAL_MAX_WINDOWS 16
+#define CAL_MAX_EXCEPTIONS 32
+#define CAL_DAYS 8                  // compiled horizon, recompiled after CAL_DAYS - 1 days
+#define CAL_MAX_EVENTS 96
+#define CAL_MAX_BOUNDARIES ((CAL_DAYS * CAL_MAX_WINDOWS + CAL_MAX_EXCEPTIONS) * 2 + CAL_DAYS + 1)
+
+// Window actions, also the system mode between events
+enum CalendarAction : uint8_t {
+  CAL_SLEEP = 0,    // closed (exceptions only for windows)
+  CAL_SHOW,         // awake, track looped
+  CAL_AWAKE,        // awake, no automatic playback
+  CAL_REBOOT,       // weekly reboot (event only)
+  CAL_REBUILD       // end of the compiled horizon (event only)
+};
+
+const char* const calendarActionNames[] = { "SLEEP", "SHOW", "AWAKE", "REBOOT", "REBUILD" };
+
+// File records, little endian and packed as written by tools/mkschedule.py
+struct __attribute__((packed)) CalendarHeader {
+  char magic[4];
+  uint8_t version;
+  uint8_t windowCount;
+  uint8_t exceptionCount;
+  uint8_t reserved;
+};
+
+struct __attribute__((packed)) CalendarWindow {
+  uint8_t dayMask;      // bit 0 Sunday ... bit 6 Saturday
+  uint8_t action;       // CalendarAction
+  uint16_t startMin;    // minute of the day
+  uint16_t endMin;      // minute of the day, up to 1440
+};
+
+struct __attribute__((packed)) CalendarException {
+  uint16_t year;
+  uint8_t month;
+  uint8_t day;
+  uint8_t action;       // CAL_SLEEP closes the day, otherwise a window replacing the weekly ones
+  uint8_t reserved;
+  uint16_t startMin;
+  uint16_t endMin;
+};
+
+struct CalendarEvent {
+  uint32_t time;        // unix time
+  uint8_t action;       // CalendarAction
+};
+
+CalendarWindow calendarWindows[CAL_MAX_WINDOWS];
+CalendarException calendarExceptions[CAL_MAX_EXCEPTIONS];
+uint8_t calendarWindowCount = 0;
+uint8_t calendarExceptionCount = 0;
+bool calendarFromFile = false;
+
+CalendarEvent calendarEvents[CAL_MAX_EVENTS];
+uint8_t calendarEventCount = 0;
+uint8_t calendarCursor = 0;         // next event to fire
+uint8_t calendarMode = CAL_SLEEP;   // mode in force since the last event
+uint32_t calendarOpenMinutes = 0;   // open time in the next 7 days, at compile time
+
+/*
+ * helper function to fall back to the compiled-in START_HOUR / END_HOUR window every day
+ */
+void calendarUseDefault() {
+  calendarWindows[0].dayMask = 0x7F;
+  calendarWindows[0].action = CAL_SHOW;
+  calendarWindows[0].startMin = START_HOUR * 60;
+  calendarWindows[0].endMin = END_HOUR * 60;
+  calendarWindowCount = 1;
+  calendarExceptionCount = 0;
+  calendarFromFile = false;
+}
+
+/**
+ * Loads SCHEDULE.BIN from the SD card, falls back to START_HOUR / END_HOUR if missing or invalid
+ * @return True if the file was loaded
+ */
+bool calendarLoad() {
+  static uint8_t fileBuffer[sizeof(CalendarHeader) + CAL_MAX_WINDOWS * sizeof(CalendarWindow) +
+                            CAL_MAX_EXCEPTIONS * sizeof(CalendarException) + 2];
+
+  calendarUseDefault();
+
+  File file = SD.open(CAL_FILE_NAME);
+  if (!file) {
+    Serial.println("No " CAL_FILE_NAME ", using START_HOUR / END_HOUR every day");
+    return false;
+  }
+  int length = file.read(fileBuffer, sizeof(fileBuffer));
+  file.close();
+
+  CalendarHeader header;
+  if (length < (int)sizeof(header) + 2) {
+    Serial.println(CAL_FILE_NAME " too short, using default hours");
+    return false;
+  }
+  memcpy(&header, fileBuffer, sizeof(header));
+
+  int expected = sizeof(header) + header.windowCount * sizeof(CalendarWindow) +
+                 header.exceptionCount * sizeof(CalendarException) + 2;
+  uint16_t crc = fileBuffer[length - 2] | (fileBuffer[length - 1] << 8);
+
+  if (memcmp(header.magic, CAL_MAGIC, 4) != 0 || header.version != CAL_VERSION ||
+      header.windowCount > CAL_MAX_WINDOWS || header.exceptionCount > CAL_MAX_EXCEPTIONS ||
+      length != expected || crc != crc16(fileBuffer, length - 2)) {
+    Serial.println(CAL_FILE_NAME " invalid, using default hours");
+    return false;
+  }
+
+  const uint8_t* cursor = fileBuffer + sizeof(header);
+  memcpy(calendarWindows, cursor, header.windowCount * sizeof(CalendarWindow));
+  cursor += header.windowCount * sizeof(CalendarWindow);
+  memcpy(calendarExceptions, cursor, header.exceptionCount * sizeof(CalendarException));
+
+  calendarWindowCount = header.windowCount;
+  calendarExceptionCount = header.exceptionCount;
+  calendarFromFile = true;
+
+  Serial.print(CAL_FILE_NAME " loaded, ");
+  Serial.print(calendarWindowCount);
+  Serial.print(" weekly windows, ");
+  Serial.print(calendarExceptionCount);
+  Serial.println(" exceptions");
+  return true;
+}
+
+/*
+ * helper function appending an event to the table, the last slot is kept for a rebuild event
+ * @return false if the table is full, a rebuild event was added at that time instead
+ */
+bool calendarAddEvent(uint32_t time, uint8_t action) {
+  if (calendarEventCount < CAL_MAX_EVENTS - 1) {
+    calendarEvents[calendarEventCount++] = { time, action };
+    return true;
+  }
+  calendarEvents[calendarEventCount++] = { time, CAL_REBUILD };
+  return false;
+}
+
+// Sweep boundary used while compiling: a window start (+1), end (-1) or a marker event
+struct CalendarBoundary {
+  uint32_t time;
+  int8_t delta;
+  uint8_t action;
+};
+
+/*
+ * helper function checking a window opens the system for a non-empty time within the day
+ */
+bool calendarIsWindow(uint8_t action, uint16_t startMin, uint16_t endMin) {
+  return (action == CAL_SHOW || action == CAL_AWAKE) && startMin < endMin && endMin <= 1440;
+}
+
+/*
+ * helper function collecting the boundaries of one day, exceptions replace the weekly windows
+ * @return updated boundary count
+ */
+int calendarAddDay(CalendarBoundary* boundaries, int count, const DateTime &day) {
+  uint32_t dayStart = day.unixtime();
+  bool hasException = false;
+
+  for (int i = 0; i < calendarExceptionCount; i++) {
+    const CalendarException &exception = calendarExceptions[i];
+    if (exception.year != day.year() || exception.month != day.month() || exception.day != day.day()) continue;
+
+    hasException = true;
+    if (!calendarIsWindow(exception.action, exception.startMin, exception.endMin)) continue;
+    boundaries[count++] = { (uint32_t)(dayStart + exception.startMin * 60UL), 1, exception.action };
+    boundaries[count++] = { (uint32_t)(dayStart + exception.endMin * 60UL), -1, exception.action };
+  }
+  if (hasException) return count;
+
+  for (int i = 0; i < calendarWindowCount; i++) {
+    const CalendarWindow &window = calendarWindows[i];
+    if (!(window.dayMask & (1 << day.dayOfTheWeek()))) continue;
+    if (!calendarIsWindow(window.action, window.startMin, window.endMin)) continue;
+    boundaries[count++] = { (uint32_t)(dayStart + window.startMin * 60UL), 1, window.action };
+    boundaries[count++] = { (uint32_t)(dayStart + window.endMin * 60UL), -1, window.action };
+  }
+  return count;
+}
+
+/**
+ * Compiles the calendar into the sorted event table, from today 00:00 for CAL_DAYS days
+ * Sets calendarMode to the mode in force at now and calendarCursor to the first event after now
+ * Overlapping or back-to-back windows are merged, SHOW wins over AWAKE
+ * @param now Current RTC time
+ */
+void calendarCompile(const DateTime &now) {
+  static CalendarBoundary boundaries[CAL_MAX_BOUNDARIES];
+  int count = 0;
+
+  DateTime midnight(now.year(), now.month(), now.day(), 0, 0, 0);
+  for (int d = 0; d < CAL_DAYS; d++) {
+    DateTime day = midnight + TimeSpan(d, 0, 0, 0);
+    count = calendarAddDay(boundaries, count, day);
+
+    //software reboot every sunday midnight / monday 00:00
+    if (day.dayOfTheWeek() == 0) {
+      boundaries[count++] = { day.unixtime(), 0, CAL_REBOOT };
+    }
+  }
+  uint32_t horizon = (midnight + TimeSpan(CAL_DAYS - 1, 0, 0, 0)).unixtime();
+  boundaries[count++] = { horizon, 0, CAL_REBUILD };
+
+  //insertion sort by time, starts before ends so back-to-back windows merge
+  for (int i = 1; i < count; i++) {
+    CalendarBoundary key = boundaries[i];
+    int j = i - 1;
+    while (j >= 0 && (boundaries[j].time > key.time ||
+                      (boundaries[j].time == key.time && boundaries[j].delta < key.delta))) {
+      boundaries[j + 1] = boundaries[j];
+      j--;
+    }
+    boundaries[j + 1] = key;
+  }
+
+  //sweep: count open windows per action, emit an event each time the mode changes
+  int open[3] = { 0, 0, 0 };
+  uint8_t mode = CAL_SLEEP;
+  uint32_t modeSince = midnight.unixtime();
+  uint32_t weekEnd = now.unixtime() + 7 * 86400UL;
+  calendarEventCount = 0;
+  calendarOpenMinutes = 0;
+  calendarMode = CAL_SLEEP;
+
+  for (int i = 0; i < count; i++) {
+    const CalendarBoundary &boundary = boundaries[i];
+
+    if (boundary.delta == 0) {
+      //marker events are kept as they are
+      if (boundary.time > now.unixtime() && !calendarAddEvent(boundary.time, boundary.action)) break;
+      if (boundary.action == CAL_REBUILD) break;
+      continue;
+    }
+
+    open[boundary.action] += boundary.delta;
+    //apply every boundary at the same time before deciding on the mode
+    if (i + 1 < count && boundaries[i + 1].time == boundary.time && boundaries[i + 1].delta != 0) continue;
+
+    uint8_t newMode = open[CAL_SHOW] > 0 ? CAL_SHOW : (open[CAL_AWAKE] > 0 ? CAL_AWAKE : CAL_SLEEP);
+    if (newMode == mode) continue;
+
+    //open time within the next 7 days, for the report
+    if (mode != CAL_SLEEP) {
+      uint32_t from = max(modeSince, now.unixtime());
+      uint32_t to = min(boundary.time, weekEnd);
+      if (to > from) calendarOpenMinutes += (to - from) / 60;
+    }
+    mode = newMode;
+    modeSince = boundary.time;
+
+    if (boundary.time <= now.unixtime()) {
+      calendarMode = mode;
+    } else if (!calendarAddEvent(boundary.time, mode)) {
+      //table full, compile again from here
+      break;
+    }
+  }
+
+  //still open at the end of the compiled horizon
+  if (mode != CAL_SLEEP && weekEnd > max(modeSince, now.unixtime())) {
+    calendarOpenMinutes += (weekEnd - max(modeSince, now.unixtime())) / 60;
+  }
+
+  calendarCursor = 0;
+}
+
+/**
+ * @return The next event to fire, O(1)
+ */
+const CalendarEvent& calendarNext() {
+  return calendarEvents[calendarCursor];
+}
+
+/**
+ * Prints the calendar source, current mode and upcoming events to Serial
+ */
+void calendarReport() {
+  Serial.println("\n-- CALENDAR --");
+  Serial.print("Source ");
+  Serial.println(calendarFromFile ? CAL_FILE_NAME : "START_HOUR / END_HOUR");
+  Serial.print("Weekly Windows ");
+  Serial.println(calendarWindowCount);
+  Serial.print("Exceptions ");
+  Serial.println(calendarExceptionCount);
+  Serial.print("Current Mode ");
+  Serial.println(calendarActionNames[calendarMode]);
+  Serial.print("Open Next 7 Days ");
+  Serial.print(calendarOpenMinutes / 60.0f);
+  Serial.print(" h, closed ");
+  Serial.print(168.0f - calendarOpenMinutes / 60.0f);
+  Serial.println(" h");
+
+  for (int i = calendarCursor; i < calendarEventCount && i < calendarCursor + 6; i++) {
+    DateTime time(calendarEvents[i].time);
+    Serial.printf("  %04u/%02u/%02u (%s) %02u:%02u %s\n", time.year(), time.month(), time.day(),
+                  days[time.dayOfTheWeek()], time.hour(), time.minute(),
+                  calendarActionNames[calendarEvents[i].action]);
+  }
+}
+
+#endif // CALENDARCTRL_H
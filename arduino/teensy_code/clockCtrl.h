@@ -0,0 +1,350 @@
+/**
+ * clockCtrl.h - Distributed Wall Clock Library
+ *
+ * Gives every unit the time of day without an RTC read. LONG anchors its millis() on a
+ * DS3231 second edge (found by polling the RTC every CLOCK_EDGE_POLL_MS, re-done every
+ * CLOCK_ANCHOR_MS) and broadcasts the anchor, ":C|LEADERMS|UNIX|ANCHORMS", every
+ * CLOCK_BROADCAST_MS. Followers ping LONG (":Q|ID|SEQ", answered with
+ * ":R|ID|SEQ|RXMS|TXMS|UNIX|ANCHORMS", LONG's millis() when the ping arrived and when the
+ * reply left) and compute the offset NTP style from the round trip, less the time the two
+ * frames take on the 9600 baud line. The offset is disciplined: small errors are slewed in
+ * and feed a drift estimate, large ones step the clock.
+ *
+ * clockLeaderMillis() is LONG's millis() as seen by this unit, clockUnix() the time of day.
+ */
+
+#ifndef CLOCKCTRL_H
+#define CLOCKCTRL_H
+
+#include <Arduino.h>
+#include <RTClib.h>
+
+extern int PLAYER_ID;
+DateTime rtcNow();
+bool rtcProbe();
+void linkHeard(int playerId);
+void failoverLeaderHeard();
+
+#define CLOCK_EDGE_POLL_MS 10         // RTC poll period while looking for a second edge
+#define CLOCK_EDGE_MAX_MS 1500        // no edge within this time, the RTC is not counting
+#define CLOCK_ANCHOR_MS 600000        // LONG re-anchors on the RTC every 10 min
+#define CLOCK_BROADCAST_MS 60000      // anchor broadcast period on LONG
+#define CLOCK_PING_FAST_MS 2000       // follower ping period until the first sync
+#define CLOCK_PING_MS 30000           // follower ping period once synced
+#define CLOCK_SLOT_MS 700             // follower n pings n * CLOCK_SLOT_MS after its period
+#define CLOCK_MAX_RTT_MS 200          // slower round trips are not used
+#define CLOCK_STEP_MS 50              // larger errors step the clock instead of slewing
+#define CLOCK_SLEW_DIV 4              // share of a small error corrected per sync
+#define CLOCK_MAX_DRIFT_PPM 500
+#define CLOCK_BYTE_US 1042            // one byte at 9600 baud, 8N1
+
+bool clockValid = false;              // anchor known and, on followers, offset measured
+bool clockSynced = false;             // followers: offset measured at least once
+uint32_t clockAnchorUnix = 0;         // RTC second of the anchor
+uint32_t clockAnchorMs = 0;           // leader millis() at that second edge
+
+int32_t clockOffsetMs = 0;            // leader millis - local millis at clockSyncMs
+uint32_t clockSyncMs = 0;             // local millis() of the last correction
+float clockDriftPpm = 0;              // leader clock rate relative to ours
+
+uint16_t clockPingSeq = 0;
+uint32_t clockPingSentMs = 0;
+uint32_t clockPingBytes = 0;          // length of the ping on the wire
+bool clockPingPending = false;
+
+uint32_t clockSyncs = 0;              // corrections applied
+uint32_t clockSteps = 0;              // of which stepped
+uint32_t clockRejected = 0;           // replies too slow or out of sequence
+uint32_t clockLastRttMs = 0;
+uint32_t clockMinRttMs = UINT32_MAX;
+int32_t clockLastErrorMs = 0;         // error found at the last sync
+
+int clockTask = TASK_NONE;
+uint32_t clockEdgeStartMs = 0;        // LONG: start of the current edge search
+uint32_t clockEdgeSecond = 0;         // LONG: RTC second when the search started
+uint32_t clockBroadcastMs = 0;        // LONG: millis() of the last broadcast
+
+/*
+ * helper function estimating LONG's millis() at a local millis() value, followers only
+ */
+uint32_t clockLeaderAt(uint32_t localMs) {
+  int32_t elapsed = (int32_t)(localMs - clockSyncMs);
+  return localMs + clockOffsetMs + (int32_t)(elapsed * clockDriftPpm / 1000000.0f);
+}
+
+/**
+ * @return LONG's millis() as estimated by this unit
+ */
+uint32_t clockLeaderMillis() {
+  if (PLAYER_ID == 0) return millis();
+  return clockLeaderAt(millis());
+}
+
+/**
+ * @return Unix time in ms, 0 until the clock is valid
+ */
+uint64_t clockNowMs() {
+  if (!clockValid) return 0;
+  return (uint64_t)clockAnchorUnix * 1000 + (int32_t)(clockLeaderMillis() - clockAnchorMs);
+}
+
+/**
+ * @return Unix time in seconds, 0 until the clock is valid
+ */
+uint32_t clockUnix() {
+  return clockNowMs() / 1000;
+}
+
+/**
+ * @return Current date and time without an I2C read, check clockValid first
+ */
+DateTime clockDateTime() {
+  return DateTime(clockUnix());
+}
+
+/*
+ * helper function sending the anchor, LONG only
+ */
+void clockBroadcast() {
+  char frame[48];
+  snprintf(frame, sizeof(frame), ":C|%lu|%lu|%lu", (unsigned long)millis(),
+           (unsigned long)clockAnchorUnix, (unsigned long)clockAnchorMs);
+  busOut.println(frame);
+  clockBroadcastMs = millis();
+}
+
+/*
+ * helper function looking for an RTC second edge, re-armed every CLOCK_EDGE_POLL_MS
+ * until found, LONG only
+ */
+void clockAnchorUpdate() {
+  //no RTC, no time to give: the clock stays invalid and LONG answers pings without an anchor
+  if (!rtcProbe()) {
+    taskRunIn(clockTask, CLOCK_BROADCAST_MS);
+    return;
+  }
+  uint32_t second = rtcNow().unixtime();
+
+  if (clockEdgeStartMs == 0) {
+    clockEdgeStartMs = millis();
+    clockEdgeSecond = second;
+    taskRunIn(clockTask, CLOCK_EDGE_POLL_MS);
+    return;
+  }
+
+  bool edge = second != clockEdgeSecond;
+  if (!edge && millis() - clockEdgeStartMs < CLOCK_EDGE_MAX_MS) {
+    taskRunIn(clockTask, CLOCK_EDGE_POLL_MS);
+    return;
+  }
+
+  //anchored within one poll period of the edge, or to the second read if the RTC is stuck
+  clockLastErrorMs = clockValid ? (int32_t)(clockNowMs() - (uint64_t)second * 1000) : 0;
+  clockAnchorUnix = second;
+  clockAnchorMs = millis();
+  clockValid = true;
+  clockSyncs++;
+  clockEdgeStartMs = 0;
+  if (!edge) {
+    Serial.println("RTC second did not change, clock anchored without an edge");
+  }
+
+  clockBroadcast();
+  taskRunIn(clockTask, CLOCK_ANCHOR_MS);
+}
+
+/*
+ * helper function sending a ping to LONG, follower only
+ */
+void clockPing() {
+  //no address yet, asked again until LONG gives one
+  if (PLAYER_ID >= FLEET_SIZE) {
+    taskRunIn(clockTask, CLOCK_PING_FAST_MS);
+    return;
+  }
+
+  clockPingSeq++;
+  clockPingPending = true;
+  clockPingSentMs = millis();
+
+  char frame[24];
+  snprintf(frame, sizeof(frame), ":Q|%d|%u", PLAYER_ID, clockPingSeq);
+  busOut.println(frame);
+  clockPingBytes = strlen(frame) + 2;
+
+  uint32_t period = clockSynced ? CLOCK_PING_MS : CLOCK_PING_FAST_MS;
+  taskRunIn(clockTask, period + PLAYER_ID * CLOCK_SLOT_MS);
+}
+
+/**
+ * Re-anchors on the RTC on LONG, pings LONG on followers
+ * Run by the "clock" one-shot task
+ */
+void clockUpdate() {
+  if (PLAYER_ID == 0) {
+    clockAnchorUpdate();
+  } else {
+    clockPing();
+  }
+}
+
+/**
+ * Sends the anchor when due, LONG only
+ * Called once per second from statusUpdates()
+ */
+void clockTick() {
+  if (PLAYER_ID == 0 && clockValid && millis() - clockBroadcastMs >= CLOCK_BROADCAST_MS) {
+    clockBroadcast();
+  }
+}
+
+/*
+ * helper function applying a measured offset with the discipline rules
+ * @measured: leader millis() - local millis() at nowMs
+ */
+void clockCorrect(int32_t measured, uint32_t nowMs) {
+  if (!clockSynced) {
+    clockOffsetMs = measured;
+    clockSyncMs = nowMs;
+    clockSynced = true;
+    clockLastErrorMs = 0;
+    clockSyncs++;
+    return;
+  }
+
+  int32_t predicted = (int32_t)(clockLeaderAt(nowMs) - nowMs);
+  int32_t error = measured - predicted;
+  uint32_t interval = nowMs - clockSyncMs;
+  clockLastErrorMs = error;
+
+  if (abs(error) > CLOCK_STEP_MS) {
+    clockOffsetMs = measured;
+    clockDriftPpm = 0;
+    clockSteps++;
+  } else {
+    clockOffsetMs = predicted + error / CLOCK_SLEW_DIV;
+    //the error left over an interval is the drift we did not account for
+    if (interval > 0) {
+      clockDriftPpm += (error * 1000000.0f / interval) / CLOCK_SLEW_DIV;
+      clockDriftPpm = constrain(clockDriftPpm, -(float)CLOCK_MAX_DRIFT_PPM, (float)CLOCK_MAX_DRIFT_PPM);
+    }
+  }
+  clockSyncMs = nowMs;
+  clockSyncs++;
+}
+
+/**
+ * Handles a clock frame received on the bus, quietly, LONG answers pings, followers take
+ * replies and broadcasts
+ * @param frame Frame without the leading ':'
+ * @return True if the frame was a clock frame
+ */
+bool clockReceive(char* frame) {
+  uint32_t nowMs = millis();   //the frame was read up to its last byte, which just arrived
+  int playerId;
+  unsigned seq;
+  unsigned long rxMs, txMs, anchorUnix = 0, anchorMs = 0;
+
+  if (strncmp(frame, "Q|", 2) == 0) {
+    if (PLAYER_ID != 0 || sscanf(frame, "Q|%d|%u", &playerId, &seq) != 2) return true;
+    linkHeard(playerId);
+    char reply[64];
+    snprintf(reply, sizeof(reply), ":R|%d|%u|%lu|%lu|%lu|%lu", playerId, seq, (unsigned long)nowMs,
+             (unsigned long)millis(), (unsigned long)clockAnchorUnix, (unsigned long)clockAnchorMs);
+    busOut.println(reply);
+    return true;
+  }
+
+  //frame length on the wire: ':' and the line ending
+  uint32_t frameTxMs = (strlen(frame) + 3) * CLOCK_BYTE_US / 1000;
+
+  if (strncmp(frame, "R|", 2) == 0) {
+    if (PLAYER_ID == 0) return true;
+    int fields = sscanf(frame, "R|%d|%u|%lu|%lu|%lu|%lu", &playerId, &seq, &rxMs, &txMs, &anchorUnix, &anchorMs);
+    if (fields != 6 || playerId != PLAYER_ID) return true;  //answer to the other follower
+
+    //round trip without LONG's turnaround and the time both frames take on the wire
+    uint32_t pingTxMs = clockPingBytes * CLOCK_BYTE_US / 1000;
+    int32_t rtt = (int32_t)(nowMs - clockPingSentMs) - (int32_t)(txMs - rxMs);
+    if (!clockPingPending || seq != clockPingSeq || rtt < 0 || rtt > CLOCK_MAX_RTT_MS) {
+      clockRejected++;
+      return true;
+    }
+    clockPingPending = false;
+    clockLastRttMs = rtt;
+    if ((uint32_t)rtt < clockMinRttMs) clockMinRttMs = rtt;
+
+    //offset = ((rx - sent - pingTx) - (now - tx - replyTx)) / 2, the remaining latency is split evenly
+    int32_t outbound = (int32_t)(rxMs - clockPingSentMs - pingTxMs);
+    int32_t inbound = (int32_t)(nowMs - txMs - frameTxMs);
+    clockCorrect((outbound - inbound) / 2, nowMs);
+  } else if (strncmp(frame, "C|", 2) == 0) {
+    if (PLAYER_ID == 0 || sscanf(frame, "C|%lu|%lu|%lu", &txMs, &anchorUnix, &anchorMs) != 3) return true;
+    //one way only, used until the first ping answer
+    if (!clockSynced) {
+      clockCorrect((int32_t)(txMs + frameTxMs - nowMs), nowMs);
+    }
+  } else {
+    return false;
+  }
+
+  failoverLeaderHeard();
+  if (anchorUnix > 0) {
+    clockAnchorUnix = anchorUnix;
+    clockAnchorMs = anchorMs;
+    clockValid = clockSynced;
+  }
+  return true;
+}
+
+/**
+ * Registers the clock task, to be called once from setup after the RTC setup
+ */
+void setupClock() {
+  clockTask = taskAdd("clock", clockUpdate, ONE_SHOT, 3, 50);
+  taskRunIn(clockTask, PLAYER_ID == 0 ? 0 : CLOCK_PING_FAST_MS + PLAYER_ID * CLOCK_SLOT_MS);
+}
+
+/**
+ * Prints the clock state to Serial
+ */
+void clockReport() {
+  Serial.println("\n-- CLOCK --");
+  Serial.print("Time ");
+  if (clockValid) {
+    DateTime now = clockDateTime();
+    Serial.printf("%04u/%02u/%02u %02u:%02u:%02u\n", now.year(), now.month(), now.day(),
+                  now.hour(), now.minute(), now.second());
+  } else {
+    Serial.println("NOT SYNCED");
+  }
+  Serial.print("Anchor ");
+  Serial.print(clockAnchorUnix);
+  Serial.print(" at leader ms ");
+  Serial.println(clockAnchorMs);
+  Serial.print("Syncs ");
+  Serial.print(clockSyncs);
+  Serial.print(", Steps ");
+  Serial.print(clockSteps);
+  Serial.print(", Rejected ");
+  Serial.println(clockRejected);
+  Serial.print("Last Error ");
+  Serial.print(clockLastErrorMs);
+  Serial.println(" ms");
+
+  if (PLAYER_ID == 0) return;
+
+  Serial.print("Leader Offset ");
+  Serial.print(clockOffsetMs);
+  Serial.println(" ms");
+  Serial.print("Drift ");
+  Serial.print(clockDriftPpm, 1);
+  Serial.println(" ppm");
+  Serial.print("Round Trip ");
+  Serial.print(clockLastRttMs);
+  Serial.print(" ms, min ");
+  Serial.print(clockMinRttMs == UINT32_MAX ? 0 : clockMinRttMs);
+  Serial.println(" ms");
+}
+
+#endif // CLOCKCTRL_H
@@ -0,0 +1,358 @@
+/**
+ * configCtrl.h - Per-Unit Configuration Library
+ *
+ * Reads CONFIG.INI from the SD card into the Settings struct, so a site can be tuned
+ * without reflashing the boards. The file holds KEY=VALUE lines, optionally grouped
+ * in sections: keys before any section or in [ALL] apply to every player, keys in [LONG],
+ * [SMALL] or [SEASHELL] (or [0] to [10], the unit address) only to that player. Later lines
+ * win, so player sections usually come after [ALL]. ';' or '#' start a comment up to the end
+ * of the line.
+ *
+ *     [ALL]
+ *     UPDATE_RATE=20
+ *     PEAK_MODE=true
+ *     [SEASHELL]
+ *     SS_STR=SHELL2.WAV
+ *     REL_SW_DELAY=800
+ *     [5]
+ *     TRACK=BIRDS.WAV
+ *     PEQ1=peak,120,-6,2.0
+ *     BED1=WIND.WAV             ; ambient bed looped under the track, "none" for no bed
+ *
+ * TRACK in a unit section names the track of that unit and is kept for every unit, so the
+ * file on LONG can hold the tracks of the whole installation: LONG hands them out with the
+ * addresses. A unit plays, in order of preference, the TRACK of its own file, the one sent by
+ * LONG, LO_STR / SM_STR / SS_STR for addresses 0 to 2, or UNITn.WAV.
+ *
+ * The parser works line by line in a fixed buffer without allocating. It fills a staged
+ * copy starting from the compiled defaults, which only replaces the live settings if the
+ * whole file is valid: a bad file at boot keeps the defaults, a bad or missing file on
+ * ":reload" keeps the running settings. The file is read in CONFIG_READ_BYTES chunks with
+ * the audio interrupt held off, as the track player reads the same card from it.
+ */
+
+#ifndef CONFIGCTRL_H
+#define CONFIGCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+#include <SD.h>
+
+#define CONFIG_FILE_NAME "CONFIG.INI"
+#define CONFIG_LINE_SIZE 64
+#define CONFIG_READ_BYTES 512     // one sector per SD access
+#define CONFIG_NAME_SIZE 13       // 8.3 file name and terminator
+#define CONFIG_BEDS 2             // ambient beds per unit (BED1, BED2), see streamCtrl.h
+
+struct Settings {
+  uint32_t updateRate;            // ms between status code updates (UPDATE_RATE)
+  uint32_t pwmFreq;               // ms between light frames (PWM_FREQ)
+  uint32_t relSwDelay;            // ms between relay switches (REL_SW_DELAY)
+  uint32_t startupDelay;          // ms the relays stay off before a scheduled reboot (STARTUP_DELAY)
+  char smFile[CONFIG_NAME_SIZE];  // SMALL track (SM_STR)
+  char ssFile[CONFIG_NAME_SIZE];  // SEASHELL track (SS_STR)
+  char loFile[CONFIG_NAME_SIZE];  // LONG track (LO_STR)
+  bool peakMode;                  // light from peak (true) or RMS (false) (PEAK_MODE)
+  char tracks[FLEET_SIZE][CONFIG_NAME_SIZE];  // track per unit address, empty if not set (TRACK)
+  char beds[CONFIG_BEDS][CONFIG_NAME_SIZE];   // ambient beds under the track, empty if not set (BED1, BED2)
+  DapProfile dap;                 // codec audio processor (PEQ1-PEQ7, TONE, AVC, SURROUND), see dapCtrl.h
+};
+
+extern int PLAYER_ID;
+extern char FILE_NAME[];
+extern bool idleActive;
+extern const Settings DEFAULT_SETTINGS;
+extern Settings settings;
+
+const char* const configSectionNames[] = { "LONG", "SMALL", "SEASHELL" };
+
+// periodic tasks retimed when the settings change or started early, assigned in setupTasks()
+int pwmTask = TASK_NONE;
+int lightTask = TASK_NONE;
+int playbackTask = TASK_NONE;
+
+bool configFromFile = false;
+char configLeaderTrack[CONFIG_NAME_SIZE] = "";  // followers: track LONG sent with the address
+uint32_t configLoads = 0;         // successful loads, boot included
+uint32_t configRejected = 0;      // files refused because of errors
+
+/**
+ * @return TRACK set for a unit address in the current settings, empty if none
+ */
+const char* configUnitTrack(int address) {
+  return settings.tracks[address];
+}
+
+/**
+ * @return Track file name of this player in the current settings
+ */
+const char* configTrackName() {
+  static char unitFile[CONFIG_NAME_SIZE];
+  if (PLAYER_ID >= 0 && PLAYER_ID < FLEET_SIZE && settings.tracks[PLAYER_ID][0] != '\0') {
+    return settings.tracks[PLAYER_ID];
+  }
+  if (PLAYER_ID != 0 && configLeaderTrack[0] != '\0') return configLeaderTrack;
+  if (PLAYER_ID == 1) return settings.smFile;
+  if (PLAYER_ID == 2) return settings.ssFile;
+  if (PLAYER_ID == 0) return settings.loFile;
+  snprintf(unitFile, sizeof(unitFile), "UNIT%d.WAV", PLAYER_ID);
+  return unitFile;
+}
+
+/*
+ * helper function to strip leading and trailing blanks in place
+ */
+char* configTrim(char* text) {
+  while (*text == ' ' || *text == '\t') text++;
+  char* end = text + strlen(text);
+  while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  *end = '\0';
+  return text;
+}
+
+/*
+ * helper function to parse a duration in ms within bounds
+ */
+bool configParseMs(const char* value, uint32_t minMs, uint32_t maxMs, uint32_t &out) {
+  char* end;
+  unsigned long parsed = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || parsed < minMs || parsed > maxMs) return false;
+  out = parsed;
+  return true;
+}
+
+/*
+ * helper function to copy an 8.3 file name
+ */
+bool configParseName(const char* value, char* out) {
+  size_t length = strlen(value);
+  if (length == 0 || length >= CONFIG_NAME_SIZE) return false;
+  memcpy(out, value, length + 1);
+  return true;
+}
+
+#define CONFIG_ALL -1              // section for every player
+#define CONFIG_UNKNOWN -2          // section for no player
+
+/*
+ * helper function to tell which unit a [section] is for
+ * @return Unit address, CONFIG_ALL or CONFIG_UNKNOWN
+ */
+int configSectionUnit(const char* name) {
+  if (strcasecmp(name, "ALL") == 0) return CONFIG_ALL;
+  for (int i = 0; i < (int)(sizeof(configSectionNames) / sizeof(configSectionNames[0])); i++) {
+    if (strcasecmp(name, configSectionNames[i]) == 0) return i;
+  }
+  char* end;
+  long address = strtol(name, &end, 10);
+  if (end == name || *end != '\0' || address < 0 || address >= FLEET_SIZE) return CONFIG_UNKNOWN;
+  return address;
+}
+
+/*
+ * helper function to apply one KEY=VALUE pair to the staged settings
+ * @return False if the key is unknown or the value invalid
+ */
+bool configParseKey(const char* key, const char* value, Settings &staged) {
+  if (strcasecmp(key, "UPDATE_RATE") == 0) return configParseMs(value, 1, 1000, staged.updateRate);
+  if (strcasecmp(key, "PWM_FREQ") == 0) return configParseMs(value, 1, 1000, staged.pwmFreq);
+  if (strcasecmp(key, "REL_SW_DELAY") == 0) return configParseMs(value, 0, 10000, staged.relSwDelay);
+  if (strcasecmp(key, "STARTUP_DELAY") == 0) return configParseMs(value, 100, 600000, staged.startupDelay);
+  if (strcasecmp(key, "SM_STR") == 0) return configParseName(value, staged.smFile);
+  if (strcasecmp(key, "SS_STR") == 0) return configParseName(value, staged.ssFile);
+  if (strcasecmp(key, "LO_STR") == 0) return configParseName(value, staged.loFile);
+  if (strncasecmp(key, "BED", 3) == 0 && strlen(key) == 4 && key[3] >= '1' && key[3] < '1' + CONFIG_BEDS) {
+    char* bed = staged.beds[key[3] - '1'];
+    if (strcasecmp(value, "none") == 0) {
+      bed[0] = '\0';
+      return true;
+    }
+    return configParseName(value, bed);
+  }
+  if (strcasecmp(key, "PEAK_MODE") == 0) {
+    if (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0 || strcasecmp(value, "peak") == 0) {
+      staged.peakMode = true;
+    } else if (strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0 || strcasecmp(value, "rms") == 0) {
+      staged.peakMode = false;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  return dapParseKey(key, value, staged.dap);
+}
+
+/*
+ * helper function to parse one line, updates the section state
+ * @return False on a syntax error, unknown key or invalid value
+ */
+bool configParseLine(char* line, int &section, Settings &staged) {
+  char* comment = strpbrk(line, ";#");
+  if (comment != NULL) *comment = '\0';
+  char* text = configTrim(line);
+  if (*text == '\0') return true;
+
+  if (*text == '[') {
+    char* close = strchr(text, ']');
+    if (close == NULL) return false;
+    *close = '\0';
+    section = configSectionUnit(configTrim(text + 1));
+    return true;
+  }
+
+  char* equal = strchr(text, '=');
+  if (equal == NULL) return false;
+  *equal = '\0';
+  char* key = configTrim(text);
+  char* value = configTrim(equal + 1);
+
+  //tracks of every unit are kept, LONG hands them out
+  if (strcasecmp(key, "TRACK") == 0) {
+    return section >= 0 && configParseName(value, staged.tracks[section]);
+  }
+
+  //keys of other players are still checked so a typo is caught on every unit
+  Settings ignored;
+  bool inSection = section == CONFIG_ALL || section == PLAYER_ID;
+  return configParseKey(key, value, inSection ? staged : ignored);
+}
+
+/**
+ * Makes the given settings live: retimes the light and PWM tasks and picks the track name
+ * A track already playing keeps going, the new name is used from the next play
+ * @param next Settings to apply
+ */
+void configApply(const Settings &next) {
+  settings = next;
+  taskSetPeriod(pwmTask, settings.pwmFreq);
+  taskSetPeriod(lightTask, settings.updateRate);
+  strcpy(FILE_NAME, configTrackName());
+  dapSet(settings.dap);
+}
+
+/*
+ * helper functions around an SD access: the audio interrupt is held off, as the track player
+ * reads the card from it, except in low power idle where it is already off and must stay so
+ */
+void configSdBegin() {
+  if (!idleActive) AudioNoInterrupts();
+}
+
+void configSdEnd() {
+  if (!idleActive) AudioInterrupts();
+}
+
+/**
+ * Parses CONFIG.INI into a staged copy of the defaults and applies it if valid
+ * Called once from setup after the SD card is up, and by the ":reload" message
+ * @return True if the file was found and applied
+ */
+bool configLoad() {
+  static char line[CONFIG_LINE_SIZE];
+  static uint8_t chunk[CONFIG_READ_BYTES];
+  Settings staged = DEFAULT_SETTINGS;
+  int section = CONFIG_ALL;  //keys before any section apply to all players
+  int errors = 0;
+
+  configSdBegin();
+  File file = SD.open(CONFIG_FILE_NAME);
+  configSdEnd();
+  if (!file) {
+    //a file removed since the last load is treated as a bad one
+    if (configFromFile) {
+      Serial.println("No " CONFIG_FILE_NAME ", keeping current settings");
+      return false;
+    }
+    Serial.println("No " CONFIG_FILE_NAME ", using default settings");
+    configApply(DEFAULT_SETTINGS);
+    return false;
+  }
+
+  int lineNumber = 1;
+  int length = 0;
+  bool truncated = false;
+  int chunkLength = 0;
+  int chunkUsed = 0;
+  while (true) {
+    if (chunkUsed == chunkLength) {
+      configSdBegin();
+      chunkLength = file.read(chunk, sizeof(chunk));
+      configSdEnd();
+      chunkUsed = 0;
+    }
+    int c = chunkLength > 0 ? chunk[chunkUsed++] : -1;
+    if (c < 0 || c == '\n') {
+      line[length] = '\0';
+      if (truncated || !configParseLine(line, section, staged)) {
+        Serial.print(CONFIG_FILE_NAME " error line ");
+        Serial.println(lineNumber);
+        errors++;
+      }
+      if (c < 0) break;
+      lineNumber++;
+      length = 0;
+      truncated = false;
+    } else if (length < CONFIG_LINE_SIZE - 1) {
+      line[length++] = (char)c;
+    } else {
+      truncated = true;
+    }
+  }
+  configSdBegin();
+  file.close();
+  configSdEnd();
+
+  if (errors > 0) {
+    configRejected++;
+    crashLog("config rejected, %d errors", errors);
+    Serial.print(CONFIG_FILE_NAME " rejected, ");
+    Serial.print(errors);
+    Serial.println(configFromFile ? " errors, keeping current settings" : " errors, using default settings");
+    return false;
+  }
+
+  configApply(staged);
+  configFromFile = true;
+  configLoads++;
+
+  Serial.print(CONFIG_FILE_NAME " loaded, track ");
+  Serial.println(FILE_NAME);
+  return true;
+}
+
+/**
+ * Prints the settings source and values to Serial
+ */
+void configReport() {
+  Serial.println("\n-- CONFIGURATION --");
+  Serial.print("Source ");
+  Serial.println(configFromFile ? CONFIG_FILE_NAME : "DEFAULTS");
+  Serial.print("Loads ");
+  Serial.println(configLoads);
+  Serial.print("Rejected Files ");
+  Serial.println(configRejected);
+  Serial.print("Update Rate ");
+  Serial.print(settings.updateRate);
+  Serial.println(" ms");
+  Serial.print("Relay Switch Delay ");
+  Serial.print(settings.relSwDelay);
+  Serial.println(" ms");
+  Serial.print("Track Files ");
+  Serial.print(settings.loFile);
+  Serial.print(" / ");
+  Serial.print(settings.smFile);
+  Serial.print(" / ");
+  Serial.println(settings.ssFile);
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    if (settings.tracks[i][0] == '\0') continue;
+    Serial.printf("Track Of Unit %d %s\n", i, settings.tracks[i]);
+  }
+  Serial.print("This Unit Plays ");
+  Serial.println(configTrackName());
+  for (int i = 0; i < CONFIG_BEDS; i++) {
+    if (settings.beds[i][0] == '\0') continue;
+    Serial.printf("Bed %d %s\n", i + 1, settings.beds[i]);
+  }
+}
+
+#endif // CONFIGCTRL_H
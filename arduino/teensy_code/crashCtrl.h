@@ -0,0 +1,273 @@
+/**
+ * crashCtrl.h - Crash and Reset Forensics Library
+ *
+ * Keeps a small log in DMAMEM, which a reset does not clear: the last CRASH_LOG_LINES event
+ * lines, the uptime and the number of resets since power-on. At boot the hardware reset
+ * cause (SRC_SRSR), the previous uptime and the address of a crash (from CrashReport) are
+ * turned into a summary. Followers send it in their status frame, LONG keeps the summaries
+ * of the whole fleet and prints them in the system report, so crashes of units nobody is
+ * plugged into are not lost.
+ */
+
+#ifndef CRASHCTRL_H
+#define CRASHCTRL_H
+
+#include <Arduino.h>
+#include <stdarg.h>
+
+extern int PLAYER_ID;
+bool enumPresent(int address);
+
+#define CRASH_LOG_MAGIC 0x43524C47    // "CRLG"
+#define CRASH_LOG_LINES 16
+#define CRASH_LINE_SIZE 48
+#define CRASH_TEXT_SIZE 768           // CrashReport text kept for the report
+
+enum ResetCause : uint8_t {
+  RESET_POWER_ON = 0,   // power applied or reset pin
+  RESET_SOFTWARE,       // scheduled reboot (SCB_AIRCR) or CPU lockup
+  RESET_FAULT,          // automatic reboot after a fault, see CrashReport
+  RESET_WATCHDOG,       // WDT1 or WDT3
+  RESET_BUTTON,         // power on/off button
+  RESET_TEMPERATURE,    // die temperature panic
+  RESET_OTHER,
+  RESET_CAUSE_COUNT
+};
+
+const char* const resetCauseNames[] = { "POWER ON", "SOFTWARE", "FAULT", "WATCHDOG", "BUTTON", "TEMPERATURE", "OTHER" };
+
+// survives a reset in DMAMEM, reset at power-on
+struct CrashLog {
+  uint32_t magic;
+  uint32_t resets;                      // resets since power-on
+  uint32_t uptimeMs;                    // refreshed every second, uptime at the reset
+  uint16_t head;                        // next line written
+  uint16_t count;
+  char lines[CRASH_LOG_LINES][CRASH_LINE_SIZE];
+};
+
+// what LONG knows about the last reset of each unit
+struct CrashSummary {
+  bool known;
+  uint32_t resets;        // resets since power-on
+  uint8_t cause;          // ResetCause
+  uint8_t watchdog;       // WdtReason of a watchdog reset
+  uint32_t crashAddress;  // code address of the crash, 0 if none
+  uint32_t uptimeS;       // uptime before the reset
+  uint32_t seenMs;        // millis() on LONG when received
+};
+
+DMAMEM CrashLog crashLogData;
+CrashSummary crashLocal;
+CrashSummary crashFleet[FLEET_SIZE];
+char crashText[CRASH_TEXT_SIZE];      // CrashReport of the previous run, empty if none
+
+// collects the CrashReport text, which can only be printed
+class CrashCapture : public Print {
+public:
+  size_t length = 0;
+  size_t write(uint8_t c) override {
+    if (length < CRASH_TEXT_SIZE - 1) {
+      crashText[length++] = c;
+      crashText[length] = '\0';
+    }
+    return 1;
+  }
+};
+
+/**
+ * Adds a line to the log kept across resets, prefixed with the time of day once the clock
+ * is synced, the uptime in seconds before
+ * @param format printf style format
+ */
+void crashLog(const char* format, ...) {
+  char* line = crashLogData.lines[crashLogData.head];
+  int used;
+  if (clockValid) {
+    DateTime now = clockDateTime();
+    used = snprintf(line, CRASH_LINE_SIZE, "%02u:%02u:%02u ", now.hour(), now.minute(), now.second());
+  } else {
+    used = snprintf(line, CRASH_LINE_SIZE, "%lu ", (unsigned long)(millis() / 1000));
+  }
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + used, CRASH_LINE_SIZE - used, format, args);
+  va_end(args);
+
+  crashLogData.head = (crashLogData.head + 1) % CRASH_LOG_LINES;
+  if (crashLogData.count < CRASH_LOG_LINES) crashLogData.count++;
+  arm_dcache_flush(&crashLogData, sizeof(crashLogData));
+}
+
+/*
+ * helper function decoding the hardware reset cause
+ */
+ResetCause crashResetCause(uint32_t srsr) {
+  if (srsr & (SRC_SRSR_WDOG_RST_B | SRC_SRSR_WDOG3_RST_B)) return RESET_WATCHDOG;
+  if (srsr & SRC_SRSR_TEMPSENSE_RST_B) return RESET_TEMPERATURE;
+  if (srsr & SRC_SRSR_LOCKUP_SYSRESETREQ) {
+    return (SRC_GPR5 == 0x0BAD00F1) ? RESET_FAULT : RESET_SOFTWARE;
+  }
+  if (srsr & SRC_SRSR_IPP_USER_RESET_B) return RESET_BUTTON;
+  if (srsr & SRC_SRSR_IPP_RESET_B) return RESET_POWER_ON;
+  return RESET_OTHER;
+}
+
+/**
+ * Prints the lines logged before the reset to Serial, oldest first
+ */
+void crashPrintLog() {
+  int first = (crashLogData.head + CRASH_LOG_LINES - crashLogData.count) % CRASH_LOG_LINES;
+  for (int i = 0; i < crashLogData.count; i++) {
+    Serial.print("  ");
+    Serial.println(crashLogData.lines[(first + i) % CRASH_LOG_LINES]);
+  }
+}
+
+/**
+ * Reads the reset cause, the log left in DMAMEM and the CrashReport, to be called early in setup
+ * @param watchdogReason WdtReason found in the watchdog record, for watchdog resets
+ */
+void crashBoot(uint8_t watchdogReason) {
+  ResetCause cause = crashResetCause(SRC_SRSR);
+  //the bits are sticky until written back, else the next reboot shows this cause again
+  SRC_SRSR = SRC_SRSR;
+
+  //random content after a power cut, or a layout from another firmware
+  bool valid = crashLogData.magic == CRASH_LOG_MAGIC && crashLogData.head < CRASH_LOG_LINES &&
+               crashLogData.count <= CRASH_LOG_LINES;
+  if (!valid || cause == RESET_POWER_ON) {
+    memset(&crashLogData, 0, sizeof(crashLogData));
+    crashLogData.magic = CRASH_LOG_MAGIC;
+  } else {
+    crashLogData.resets++;
+    for (int i = 0; i < CRASH_LOG_LINES; i++) {
+      crashLogData.lines[i][CRASH_LINE_SIZE - 1] = '\0';
+    }
+  }
+
+  crashLocal.known = true;
+  crashLocal.resets = crashLogData.resets;
+  crashLocal.cause = cause;
+  crashLocal.watchdog = (cause == RESET_WATCHDOG) ? watchdogReason : 0;
+  crashLocal.uptimeS = crashLogData.uptimeMs / 1000;
+  crashLocal.crashAddress = 0;
+
+  crashText[0] = '\0';
+  if (CrashReport) {
+    CrashCapture capture;
+    capture.print(CrashReport);
+    const char* address = strstr(crashText, "address 0x");
+    if (address != NULL) {
+      crashLocal.crashAddress = strtoul(address + 10, NULL, 16);
+    }
+  }
+
+  Serial.print("Reset cause ");
+  Serial.print(resetCauseNames[cause]);
+  Serial.print(", resets since power on ");
+  Serial.print(crashLocal.resets);
+  Serial.print(", previous uptime ");
+  Serial.print(crashLocal.uptimeS);
+  Serial.println(" s");
+  if (crashText[0] != '\0') {
+    Serial.print("Previous crash detected: ");
+    Serial.println(crashText);
+  } else {
+    Serial.println("No crash report available.");
+  }
+  if (cause != RESET_POWER_ON && crashLogData.count > 0) {
+    Serial.println("Last log lines before the reset:");
+    crashPrintLog();
+  }
+
+  crashLogData.uptimeMs = 0;
+  crashLog("boot %s, crash 0x%lx", resetCauseNames[cause], (unsigned long)crashLocal.crashAddress);
+
+  if (PLAYER_ID >= 0 && PLAYER_ID < FLEET_SIZE) {
+    crashFleet[PLAYER_ID] = crashLocal;
+  }
+}
+
+/**
+ * Refreshes the uptime kept across resets, called once per second
+ */
+void crashUpdate() {
+  crashLogData.uptimeMs = millis();
+  arm_dcache_flush(&crashLogData.uptimeMs, sizeof(crashLogData.uptimeMs));
+}
+
+/**
+ * Writes the summary fields of the status frame: RESETS|CAUSE|WDT|ADDR|UPTIME
+ * @param buffer Destination
+ * @param size Size of the destination
+ */
+void crashFormatSummary(char* buffer, size_t size) {
+  snprintf(buffer, size, "%lu|%u|%u|%lx|%lu",
+           (unsigned long)crashLocal.resets, crashLocal.cause, crashLocal.watchdog,
+           (unsigned long)crashLocal.crashAddress, (unsigned long)crashLocal.uptimeS);
+}
+
+/**
+ * Stores the summary received from a follower, run on LONG
+ * @param playerId Follower ID
+ * @param text Summary fields as written by crashFormatSummary()
+ */
+void crashParseSummary(int playerId, const char* text) {
+  if (playerId < 0 || playerId >= FLEET_SIZE || text == NULL) return;
+
+  unsigned long resets, address, uptime;
+  unsigned cause, watchdog;
+  if (sscanf(text, "%lu|%u|%u|%lx|%lu", &resets, &cause, &watchdog, &address, &uptime) != 5) return;
+
+  CrashSummary &summary = crashFleet[playerId];
+  //a new reset since the last status, keep a trace of it on LONG too
+  if (summary.known && (summary.resets != resets || summary.uptimeS != uptime)) {
+    crashLog("unit %d reset %s", playerId, resetCauseNames[cause % RESET_CAUSE_COUNT]);
+  }
+  summary.known = true;
+  summary.resets = resets;
+  summary.cause = cause % RESET_CAUSE_COUNT;
+  summary.watchdog = watchdog;
+  summary.crashAddress = address;
+  summary.uptimeS = uptime;
+  summary.seenMs = millis();
+}
+
+/**
+ * Prints the reset summary, the log and on LONG the fleet summaries to Serial
+ */
+void crashReport() {
+  Serial.println("\n-- RESETS AND CRASHES --");
+  Serial.print("Last Reset ");
+  Serial.println(resetCauseNames[crashLocal.cause]);
+  Serial.print("Resets Since Power On ");
+  Serial.println(crashLocal.resets);
+  Serial.print("Uptime Before Reset ");
+  Serial.print(crashLocal.uptimeS);
+  Serial.println(" s");
+  Serial.print("Crash Address 0x");
+  Serial.println(crashLocal.crashAddress, HEX);
+  Serial.println("Log");
+  crashPrintLog();
+
+  if (PLAYER_ID != 0) return;
+
+  Serial.println("Fleet");
+  Serial.println("  id resets cause        watchdog      address     uptime  seen");
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    const CrashSummary &summary = crashFleet[i];
+    if (!summary.known) {
+      if (enumPresent(i)) Serial.printf("  %d  no status received\n", i);
+      continue;
+    }
+    Serial.printf("  %d  %6lu %-12s %-13s 0x%08lx %6lus %4lus ago\n", i,
+                  (unsigned long)summary.resets, resetCauseNames[summary.cause],
+                  wdtReasonNames[summary.watchdog % WDT_REASON_COUNT],
+                  (unsigned long)summary.crashAddress, (unsigned long)summary.uptimeS,
+                  (unsigned long)((millis() - summary.seenMs) / 1000));
+  }
+}
+
+#endif // CRASHCTRL_H
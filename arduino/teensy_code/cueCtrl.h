@@ -0,0 +1,263 @@
+/**
+ * cueCtrl.h - Cue Bank Library
+ *
+ * A sound played from the SD card waits for the file to be opened, looked up in the FAT and
+ * read, too slow for a sound that answers an event. Short clips are now loaded at boot from
+ * CUE1.WAV to CUE8.WAV (16 bit PCM at 44.1 kHz, mono or stereo mixed down) into a bank in
+ * DMAMEM, in the format of AudioPlayMemory. A triggered cue starts on one of CUE_VOICES memory
+ * voices at the next audio block, mixed with the track by audioMix, the oldest voice is taken
+ * if all are busy. A clip that does not fit in what is left of the bank is skipped.
+ *
+ * ":cue n" plays cue n, typed on LONG it is passed on to every unit. The bank is loaded at
+ * once in setup, again on ":reload" and when the SD card comes back, then by the "cue" task
+ * one CUE_READ_BYTES read at a time, so the loop keeps running while the track plays. Each
+ * SD access holds off the audio interrupt, where the track player reads the same card.
+ */
+
+#ifndef CUECTRL_H
+#define CUECTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+#include <SD.h>
+
+#define CUE_MAX 8                     // CUE1.WAV to CUE8.WAV
+#define CUE_VOICES 3                  // cues playing at once, audioMix inputs 1 to 3
+#define CUE_BANK_WORDS 32768          // 128 KB, about 1.5 s of mono clips in total
+#define CUE_GAIN 0.7f                 // mixer gain of the cue voices, headroom over the track
+#define CUE_FORMAT_PCM16 0x81         // AudioPlayMemory: 16 bit PCM at 44.1 kHz
+#define CUE_READ_BYTES 2048          // read per step of a load, four sectors
+#define CUE_STEP_MS 5                 // between the steps of a reload
+#define CUE_IDLE_RETRY_MS 1000
+
+extern AudioPlayMemory cueVoices[CUE_VOICES];
+extern AudioMixer4 audioMix;
+extern bool idleActive;
+
+DMAMEM uint32_t cueBank[CUE_BANK_WORDS];
+const uint32_t* cueData[CUE_MAX];     // clip in the bank, NULL if not loaded
+uint32_t cueSamples[CUE_MAX];
+uint32_t cueBankUsed = 0;             // words
+uint32_t cueVoiceStartMs[CUE_VOICES];
+
+uint32_t cueLoaded = 0;
+int cueTask = TASK_NONE;
+
+// load in progress
+int cueLoadIndex = -1;                // clip being loaded, -1 when no load is running
+File cueFile;
+WavInfo cueWav;
+uint32_t cueLoadSamples = 0;          // samples of the clip open, 0 if none
+uint32_t cueLoadDone = 0;
+int16_t cueReadBuffer[CUE_READ_BYTES / 2];
+uint32_t cueTriggers = 0;
+uint32_t cueSteals = 0;               // voices taken from a cue still playing
+uint32_t cueMissing = 0;              // triggers of a cue not loaded
+
+/*
+ * helper function opening the next clip of a load and making room for it in the bank
+ * @return False if the clip is missing, invalid or too long, the load goes on with the next
+ */
+bool cueOpenNext(const char* name) {
+  AudioNoInterrupts();
+  cueFile = SD.open(name);
+  bool valid = cueFile && wavReadHeader(cueFile, cueWav);
+  AudioInterrupts();
+
+  uint32_t samples = valid ? wavFrames(cueWav) : 0;
+  //header word, two samples per word, whole audio blocks as the voice reads them
+  uint32_t words = 1 + (samples + AUDIO_BLOCK_SAMPLES - 1) / AUDIO_BLOCK_SAMPLES * (AUDIO_BLOCK_SAMPLES / 2);
+  if (samples == 0 || samples > 0xFFFFFF || words > CUE_BANK_WORDS - cueBankUsed) {
+    if (cueFile) {
+      AudioNoInterrupts();
+      cueFile.close();
+      AudioInterrupts();
+      Serial.print(name);
+      Serial.println(" not loaded: not 16 bit 44.1 kHz PCM, or too long for the bank");
+    }
+    return false;
+  }
+
+  uint32_t* dest = cueBank + cueBankUsed;
+  memset(dest, 0, words * 4);
+  dest[0] = ((uint32_t)CUE_FORMAT_PCM16 << 24) | samples;
+  cueLoadSamples = samples;
+  cueLoadDone = 0;
+  return true;
+}
+
+/*
+ * helper function reading the next chunk of the clip being loaded, stereo mixed down
+ * @return False once the clip is read or on a read error
+ */
+bool cueReadChunk() {
+  int16_t* out = (int16_t*)(cueBank + cueBankUsed + 1) + cueLoadDone;
+  uint32_t count = min(cueLoadSamples - cueLoadDone, (uint32_t)(CUE_READ_BYTES / (2 * cueWav.channels)));
+
+  AudioNoInterrupts();
+  int got = cueFile.read(cueReadBuffer, count * 2 * cueWav.channels);
+  AudioInterrupts();
+  if (got != (int)(count * 2 * cueWav.channels)) return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    out[i] = cueWav.channels == 1 ? cueReadBuffer[i] : (cueReadBuffer[2 * i] + cueReadBuffer[2 * i + 1]) / 2;
+  }
+  cueLoadDone += count;
+  return cueLoadDone < cueLoadSamples;
+}
+
+/*
+ * helper function starting a load of the bank, voices are stopped first
+ */
+void cueLoadBegin() {
+  for (int i = 0; i < CUE_VOICES; i++) {
+    cueVoices[i].stop();
+  }
+  if (cueLoadIndex >= 0 && cueLoadSamples > 0) {
+    AudioNoInterrupts();
+    cueFile.close();
+    AudioInterrupts();
+  }
+  for (int i = 0; i < CUE_MAX; i++) {
+    cueData[i] = NULL;
+    cueSamples[i] = 0;
+  }
+  cueBankUsed = 0;
+  cueLoaded = 0;
+  cueLoadIndex = 0;
+  cueLoadSamples = 0;
+}
+
+/**
+ * Loads one step of the bank: opens a clip or reads CUE_READ_BYTES of it, SD access with the
+ * audio interrupt held off as the track player reads the same card from it
+ * @return True while the load goes on
+ */
+bool cueLoadStep() {
+  if (cueLoadIndex < 0) return false;
+
+  if (cueLoadIndex >= CUE_MAX) {
+    cueLoadIndex = -1;
+    if (cueLoaded > 0) {
+      Serial.printf("%lu cues loaded, %lu KB of the bank used\n", (unsigned long)cueLoaded,
+                    (unsigned long)(cueBankUsed * 4 / 1024));
+    }
+    return false;
+  }
+
+  //no clip open, open the next one
+  if (cueLoadSamples == 0) {
+    char name[CONFIG_NAME_SIZE];
+    snprintf(name, sizeof(name), "CUE%d.WAV", cueLoadIndex + 1);
+    if (!cueOpenNext(name)) cueLoadIndex++;
+    return true;
+  }
+
+  if (cueReadChunk()) return true;
+
+  //clip read, or cut short by a read error and skipped
+  AudioNoInterrupts();
+  cueFile.close();
+  AudioInterrupts();
+  if (cueLoadDone == cueLoadSamples) {
+    cueData[cueLoadIndex] = cueBank + cueBankUsed;
+    cueSamples[cueLoadIndex] = cueLoadSamples;
+    cueBankUsed += 1 + (cueLoadSamples + AUDIO_BLOCK_SAMPLES - 1) / AUDIO_BLOCK_SAMPLES * (AUDIO_BLOCK_SAMPLES / 2);
+    cueLoaded++;
+  }
+  cueLoadSamples = 0;
+  cueLoadIndex++;
+  return true;
+}
+
+/**
+ * Loads CUE1.WAV to CUE8.WAV into the bank at once, to be called from setup once the SD card is up
+ */
+void cueLoad() {
+  cueLoadBegin();
+  while (cueLoadStep()) {}
+}
+
+/*
+ * helper function loading the bank step by step, run by the "cue" one-shot task
+ */
+void cueLoadUpdate() {
+  //no SD access in idle, the audio interrupt must stay off
+  if (idleActive) {
+    taskRunIn(cueTask, CUE_IDLE_RETRY_MS);
+    return;
+  }
+  if (cueLoadStep()) taskRunIn(cueTask, CUE_STEP_MS);
+}
+
+/**
+ * Loads the bank again from the "cue" task without stopping the loop, on ":reload" and when
+ * the SD card comes back; cues are played from the bank as soon as they are loaded
+ */
+void cueReload() {
+  cueLoadBegin();
+  taskRunIn(cueTask, 0);
+}
+
+/**
+ * Plays a cue from the bank, it starts at the next audio block
+ * @param cue Cue number, 1 to CUE_MAX
+ * @return False if the cue is not loaded
+ */
+bool cueTrigger(int cue) {
+  if (cue < 1 || cue > CUE_MAX || cueData[cue - 1] == NULL) {
+    cueMissing++;
+    return false;
+  }
+
+  //free voice, else the one that started first
+  int voice = 0;
+  bool free = false;
+  for (int i = 0; i < CUE_VOICES && !free; i++) {
+    if (!cueVoices[i].isPlaying()) {
+      voice = i;
+      free = true;
+    } else if ((int32_t)(cueVoiceStartMs[i] - cueVoiceStartMs[voice]) < 0) {
+      voice = i;
+    }
+  }
+  if (!free) cueSteals++;
+
+  cueVoices[voice].play((const unsigned int*)cueData[cue - 1]);
+  cueVoiceStartMs[voice] = millis();
+  cueTriggers++;
+  return true;
+}
+
+/**
+ * Sets the mixer gains of the voices and registers the reload task, to be called once from setup
+ */
+void setupCue() {
+  cueTask = taskAdd("cue", cueLoadUpdate, ONE_SHOT, 4);
+  audioMix.gain(0, 1.0f);
+  for (int i = 0; i < CUE_VOICES; i++) {
+    audioMix.gain(i + 1, CUE_GAIN);
+  }
+}
+
+/**
+ * Prints the cues in the bank and the voice use to Serial
+ */
+void cueReport() {
+  Serial.println("\n-- CUE BANK --");
+  Serial.printf("Bank %lu of %lu KB, %lu Cues\n", (unsigned long)(cueBankUsed * 4 / 1024),
+                (unsigned long)(CUE_BANK_WORDS * 4 / 1024), (unsigned long)cueLoaded);
+  for (int i = 0; i < CUE_MAX; i++) {
+    if (cueData[i] == NULL) continue;
+    Serial.printf("  CUE%d.WAV %6lu ms\n", i + 1, (unsigned long)(cueSamples[i] * 1000ULL / 44100));
+  }
+  int playing = 0;
+  for (int i = 0; i < CUE_VOICES; i++) {
+    if (cueVoices[i].isPlaying()) playing++;
+  }
+  Serial.printf("Voices Playing %d of %d\n", playing, CUE_VOICES);
+  Serial.printf("Triggers %lu, Voices Taken %lu, Not Loaded %lu\n", (unsigned long)cueTriggers,
+                (unsigned long)cueSteals, (unsigned long)cueMissing);
+}
+
+#endif // CUECTRL_H
@@ -0,0 +1,280 @@
+/**
+ * dapCtrl.h - Codec Audio Processor Library
+ *
+ * Room correction used to mean processing the WAVs again. The SGTL5000 has its own audio
+ * processor (DAP) between the I2S input and the DAC, set here from CONFIG.INI per unit at no
+ * CPU cost (see configCtrl.h):
+ *
+ *     PEQ1=peak,120,-6,2.0      ; up to 7 bands: type,frequency Hz,gain dB,Q
+ *     PEQ2=highshelf,8000,3,0.7 ; lowpass, highpass, bandpass, notch, peak, lowshelf, highshelf
+ *     TONE=3,-2                 ; bass and treble in dB, -12 to 12, used when no PEQ band is set
+ *     AVC=6,-18,0.5,4           ; auto volume: max gain 0/6/12 dB, threshold dBFS, attack and decay dB/s
+ *     SURROUND=4                ; virtual surround width 0 to 7
+ *
+ * "off" turns AVC or SURROUND off again. A unit without any of these keys bypasses the DAP.
+ * The profile is written when the codec is enabled and when the settings change.
+ */
+
+#ifndef DAPCTRL_H
+#define DAPCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern AudioControlSGTL5000 sgtl5000;
+extern bool codecReady;
+
+#define DAP_PEQ_BANDS 7               // PEQ filters of the SGTL5000
+#define DAP_TONE_MAX_DB 12.0f         // eqBands() full scale
+#define DAP_SAMPLE_RATE 44100
+
+struct DapBand {
+  bool used;
+  uint8_t type;           // FILTER_LOPASS ... FILTER_HISHELF
+  float freq;
+  float gain;             // dB
+  float q;
+};
+
+// processing asked for one unit, all zero is bypass
+struct DapProfile {
+  uint8_t bands;          // PEQ1 to PEQn in use (PEQn)
+  DapBand peq[DAP_PEQ_BANDS];
+  bool tone;              // (TONE)
+  float bass;             // dB
+  float treble;           // dB
+  bool avc;               // (AVC)
+  uint8_t avcMaxGain;     // 0, 1 or 2 for 0, 6 or 12 dB
+  float avcThreshold;     // dBFS
+  float avcAttack;        // dB/s
+  float avcDecay;         // dB/s
+  bool surround;          // (SURROUND)
+  uint8_t surroundWidth;  // 0 to 7
+};
+
+const char* const dapFilterNames[] = { "lowpass", "highpass", "bandpass", "notch", "peak", "lowshelf", "highshelf" };
+const uint8_t dapFilterTypes[] = { FILTER_LOPASS, FILTER_HIPASS, FILTER_BANDPASS, FILTER_NOTCH,
+                                   FILTER_PARAEQ, FILTER_LOSHELF, FILTER_HISHELF };
+
+DapProfile dapWanted;                 // profile of the current settings
+DapProfile dapWritten;                // profile last written to the codec
+bool dapCodecSet = false;             // dapWritten is in the codec
+uint32_t dapWrites = 0;
+
+/*
+ * helper function telling if a profile uses the DAP at all
+ */
+bool dapUsed(const DapProfile &profile) {
+  return profile.bands > 0 || profile.tone || profile.avc || profile.surround;
+}
+
+/*
+ * helper function parsing comma separated numbers, all of them and nothing else
+ */
+bool dapParseNumbers(const char* text, float* out, int count) {
+  for (int i = 0; i < count; i++) {
+    char* end;
+    out[i] = strtod(text, &end);
+    if (end == text || *end != (i == count - 1 ? '\0' : ',')) return false;
+    text = end + 1;
+  }
+  return true;
+}
+
+/**
+ * Parses one DAP key of CONFIG.INI into a profile
+ * @return False if the key is not a DAP key or the value is invalid
+ */
+bool dapParseKey(const char* key, const char* value, DapProfile &profile) {
+  if (strncasecmp(key, "PEQ", 3) == 0) {
+    int band = key[3] - '0';
+    const char* comma = strchr(value, ',');
+    float number[3];  //frequency, gain, Q
+    if (strlen(key) != 4 || band < 1 || band > DAP_PEQ_BANDS || comma == NULL ||
+        !dapParseNumbers(comma + 1, number, 3) || number[0] < 20.0f || number[0] > 20000.0f ||
+        fabsf(number[1]) > 12.0f || number[2] < 0.1f || number[2] > 10.0f) {
+      return false;
+    }
+    for (int i = 0; i < (int)sizeof(dapFilterTypes); i++) {
+      if (strncasecmp(value, dapFilterNames[i], comma - value) != 0 ||
+          dapFilterNames[i][comma - value] != '\0') {
+        continue;
+      }
+      DapBand &peq = profile.peq[band - 1];
+      peq.used = true;
+      peq.type = dapFilterTypes[i];
+      peq.freq = number[0];
+      peq.gain = number[1];
+      peq.q = number[2];
+      if (band > profile.bands) profile.bands = band;
+      return true;
+    }
+    return false;
+  }
+
+  if (strcasecmp(key, "TONE") == 0) {
+    float number[2];  //bass, treble
+    if (!dapParseNumbers(value, number, 2) || fabsf(number[0]) > DAP_TONE_MAX_DB ||
+        fabsf(number[1]) > DAP_TONE_MAX_DB) {
+      return false;
+    }
+    profile.tone = true;
+    profile.bass = number[0];
+    profile.treble = number[1];
+    return true;
+  }
+
+  if (strcasecmp(key, "AVC") == 0) {
+    if (strcasecmp(value, "off") == 0) {
+      profile.avc = false;
+      return true;
+    }
+    float number[4];  //max gain, threshold, attack, decay
+    if (!dapParseNumbers(value, number, 4) ||
+        (number[0] != 0.0f && number[0] != 6.0f && number[0] != 12.0f) || number[1] < -96.0f ||
+        number[1] > 0.0f || number[2] <= 0.0f || number[2] > 100.0f || number[3] <= 0.0f ||
+        number[3] > 100.0f) {
+      return false;
+    }
+    profile.avc = true;
+    profile.avcMaxGain = (uint8_t)(number[0] / 6.0f);
+    profile.avcThreshold = number[1];
+    profile.avcAttack = number[2];
+    profile.avcDecay = number[3];
+    return true;
+  }
+
+  if (strcasecmp(key, "SURROUND") == 0) {
+    if (strcasecmp(value, "off") == 0) {
+      profile.surround = false;
+      return true;
+    }
+    char* end;
+    long width = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || width < 0 || width > 7) return false;
+    profile.surround = true;
+    profile.surroundWidth = width;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * helper function writing a profile to the codec
+ */
+void dapWrite(const DapProfile &profile) {
+  if (!dapUsed(profile)) {
+    sgtl5000.audioProcessorDisable();
+  } else {
+    sgtl5000.audioPostProcessorEnable();
+
+    if (profile.bands > 0) {
+      sgtl5000.eqSelect(PARAMETRIC_EQUALIZER);
+      for (int i = 0; i < profile.bands; i++) {
+        const DapBand &peq = profile.peq[i];
+        int coefficients[5];
+        //bands left out in the file stay flat
+        calcBiquad(peq.used ? peq.type : FILTER_PARAEQ, peq.used ? peq.freq : 1000.0f,
+                   peq.used ? peq.gain : 0.0f, peq.used ? peq.q : 1.0f, 524288, DAP_SAMPLE_RATE, coefficients);
+        sgtl5000.eqFilter(i, coefficients);
+      }
+      sgtl5000.eqFilterCount(profile.bands);
+    } else if (profile.tone) {
+      sgtl5000.eqSelect(TONE_CONTROLS);
+      sgtl5000.eqBands(profile.bass / DAP_TONE_MAX_DB, profile.treble / DAP_TONE_MAX_DB);
+    } else {
+      sgtl5000.eqSelect(FLAT_FREQUENCY);
+    }
+
+    if (profile.avc) {
+      sgtl5000.autoVolumeControl(profile.avcMaxGain, 1, 0, profile.avcThreshold, profile.avcAttack, profile.avcDecay);
+      sgtl5000.autoVolumeEnable();
+    } else {
+      sgtl5000.autoVolumeDisable();
+    }
+
+    if (profile.surround) {
+      sgtl5000.surroundSound(profile.surroundWidth);
+      sgtl5000.surroundSoundEnable();
+    } else {
+      sgtl5000.surroundSoundDisable();
+    }
+  }
+
+  dapWritten = profile;
+  dapCodecSet = true;
+  dapWrites++;
+}
+
+/**
+ * Takes the profile of new settings, written now if the codec is up and it changed
+ * @param profile Profile of the settings made live
+ */
+void dapSet(const DapProfile &profile) {
+  dapWanted = profile;
+  if (codecReady && (!dapCodecSet || memcmp(&dapWanted, &dapWritten, sizeof(DapProfile)) != 0)) {
+    dapWrite(dapWanted);
+  }
+}
+
+/**
+ * Writes the current profile, to be called each time the codec is enabled
+ */
+void dapBegin() {
+  dapWrite(dapWanted);
+}
+
+/**
+ * Prints the profile in the codec to Serial
+ */
+void dapReport() {
+  Serial.println("\n-- AUDIO PROCESSOR --");
+  if (!dapCodecSet) {
+    Serial.println("Not written yet, waiting for the codec");
+    return;
+  }
+  const DapProfile &profile = dapWritten;
+  if (!dapUsed(profile)) {
+    Serial.println("DAP Bypassed");
+    return;
+  }
+
+  Serial.print("EQ ");
+  if (profile.bands > 0) {
+    Serial.printf("parametric, %u bands%s\n", profile.bands, profile.tone ? " (TONE ignored)" : "");
+    for (int i = 0; i < profile.bands; i++) {
+      const DapBand &peq = profile.peq[i];
+      if (!peq.used) {
+        Serial.printf("  PEQ%d flat\n", i + 1);
+        continue;
+      }
+      const char* name = "?";
+      for (int t = 0; t < (int)sizeof(dapFilterTypes); t++) {
+        if (dapFilterTypes[t] == peq.type) name = dapFilterNames[t];
+      }
+      Serial.printf("  PEQ%d %-9s %7.0f Hz %+5.1f dB  Q %.2f\n", i + 1, name, peq.freq, peq.gain, peq.q);
+    }
+  } else if (profile.tone) {
+    Serial.printf("tone, bass %+.1f dB, treble %+.1f dB\n", profile.bass, profile.treble);
+  } else {
+    Serial.println("flat");
+  }
+
+  Serial.print("Auto Volume ");
+  if (profile.avc) {
+    Serial.printf("max gain %d dB, threshold %.1f dBFS, attack %.2f dB/s, decay %.2f dB/s\n",
+                  profile.avcMaxGain * 6, profile.avcThreshold, profile.avcAttack, profile.avcDecay);
+  } else {
+    Serial.println("OFF");
+  }
+  Serial.print("Surround ");
+  if (profile.surround) {
+    Serial.printf("width %u\n", profile.surroundWidth);
+  } else {
+    Serial.println("OFF");
+  }
+  Serial.print("Profile Writes ");
+  Serial.println(dapWrites);
+}
+
+#endif // DAPCTRL_H
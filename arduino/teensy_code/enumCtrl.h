@@ -0,0 +1,313 @@
+/**
+ * enumCtrl.h - Unit Enumeration Library
+ *
+ * Followers get their address (PLAYER_ID) from LONG when they come on the bus, so an
+ * installation grows to 10 followers without wiring ID pins. A follower asks with the unique
+ * ID of its chip and the address it had before, ":J|UIDHI|UIDLO|HINT|CRC", until LONG answers
+ * ":N|UIDHI|UIDLO|ADDRESS|TRACK|CRC". LONG keeps the address of a unit it knows, gives the
+ * hint if it is free and the first free address otherwise, 0 when all are taken. The answer
+ * carries the TRACK set for that address in LONG's CONFIG.INI, "-" if none (see configCtrl.h).
+ *
+ * A follower keeps its address in EEPROM and uses it right away at the next boot, LONG
+ * confirms it. The request is repeated every ENUM_LEASE_MS, so a LONG that rebooted learns the
+ * installation again, and a LONG that just booted gives no new address for ENUM_SETTLE_MS, the
+ * time to hear the followers that already have one. Requests of followers booting together
+ * collide on the shared return line: they fail the CRC and are retried after a delay drawn
+ * from the chip ID. A board with LONG_PIN high is LONG, SMALL_PIN or SEASHELL_PIN high ask
+ * for 1 or 2.
+ */
+
+#ifndef ENUMCTRL_H
+#define ENUMCTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+extern bool sdReady;
+extern uint8_t persistAddress;
+extern char configLeaderTrack[];
+struct Settings;
+extern Settings settings;
+void persistMarkDirty();
+bool configLoad();
+void configApply(const Settings &next);
+const char* configUnitTrack(int address);
+bool linkWasHeard(int playerId);
+bool linkSilent(int playerId);
+void linkHeard(int playerId);
+
+#define FLEET_SIZE 11                 // LONG and up to 10 followers, sizes the per-unit tables of every library
+#define ENUM_NONE FLEET_SIZE          // PLAYER_ID of a follower without an address
+#define ENUM_JOIN_MS 1000             // request period until an address is given
+#define ENUM_JITTER_MS 700            // plus up to this, drawn from the chip ID
+#define ENUM_LEASE_MS 60000           // request period once addressed
+#define ENUM_SETTLE_MS 8000           // LONG: no new address this soon after boot
+#define ENUM_FRAME_SIZE 64
+#define ENUM_TRACK_SIZE 13            // 8.3 track name and terminator, read with %12[^|]
+
+// holder of an address, as known by LONG
+struct EnumUnit {
+  bool joined;
+  uint32_t uidHi;
+  uint32_t uidLo;
+  uint32_t lastRequestMs;
+  uint32_t requests;
+};
+
+EnumUnit enumUnits[FLEET_SIZE];       // LONG: indexed by address
+uint32_t enumUidHi = 0;               // unique ID of this chip
+uint32_t enumUidLo = 0;
+uint32_t enumSeed = 1;                // followers: retry delay generator
+bool enumConfirmed = false;           // followers: LONG confirmed the address
+int enumTask = TASK_NONE;
+
+uint32_t enumRequests = 0;            // requests sent (followers) or received (LONG)
+uint32_t enumAnswers = 0;             // answers received (followers) or sent (LONG)
+uint32_t enumRejected = 0;            // frames failing the CRC or the format
+uint32_t enumChanges = 0;             // followers: address changes
+
+/*
+ * helper function reading the unique ID fused in the chip
+ */
+void enumReadUid() {
+  enumUidHi = HW_OCOTP_CFG1;
+  enumUidLo = HW_OCOTP_CFG0;
+  enumSeed = (enumUidHi ^ enumUidLo) | 1;
+}
+
+/*
+ * helper function drawing the retry delay, xorshift seeded with the chip ID
+ */
+uint32_t enumJitter() {
+  enumSeed ^= enumSeed << 13;
+  enumSeed ^= enumSeed >> 17;
+  enumSeed ^= enumSeed << 5;
+  return enumSeed % ENUM_JITTER_MS;
+}
+
+/**
+ * @return Address kept from the previous run, ENUM_NONE if none, followers use it at boot
+ */
+int enumSavedAddress() {
+  if (persistAddress == 0 || persistAddress >= FLEET_SIZE) return ENUM_NONE;
+  return persistAddress;
+}
+
+/**
+ * @return True if the unit at this address joined or is heard from, LONG only (0 is LONG)
+ */
+bool enumPresent(int address) {
+  if (address < 0 || address >= FLEET_SIZE) return false;
+  if (address == 0) return true;
+  return enumUnits[address].joined || linkWasHeard(address);
+}
+
+/*
+ * helper function telling if LONG may give an address to a chip
+ * @param hinted The chip asks for this address back
+ */
+bool enumFree(int address, uint32_t uidHi, uint32_t uidLo, bool hinted) {
+  if (address <= 0 || address >= FLEET_SIZE) return false;
+  const EnumUnit &unit = enumUnits[address];
+  if (unit.joined) {
+    return (unit.uidHi == uidHi && unit.uidLo == uidLo) || linkSilent(address);
+  }
+  //heard, addressed before LONG booted: kept for the unit asking for it back
+  return hinted || !linkWasHeard(address) || linkSilent(address);
+}
+
+/*
+ * helper function choosing the address of a chip, LONG only
+ * @return Address, 0 if none is free or LONG is still settling
+ */
+int enumAssign(uint32_t uidHi, uint32_t uidLo, int hint) {
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    const EnumUnit &unit = enumUnits[i];
+    if (unit.joined && unit.uidHi == uidHi && unit.uidLo == uidLo) return i;
+  }
+  if (enumFree(hint, uidHi, uidLo, true)) return hint;
+  if (millis() < ENUM_SETTLE_MS) return 0;
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    if (enumFree(i, uidHi, uidLo, false)) return i;
+  }
+  return 0;
+}
+
+/*
+ * helper function answering a request with the address and its track, LONG only
+ */
+void enumAnswer(uint32_t uidHi, uint32_t uidLo, int address) {
+  const char* track = (address > 0 && configUnitTrack(address)[0] != '\0') ? configUnitTrack(address) : "-";
+  char frame[ENUM_FRAME_SIZE];
+  int length = snprintf(frame, sizeof(frame), "N|%08lX|%08lX|%d|%s|", (unsigned long)uidHi,
+                        (unsigned long)uidLo, address, track);
+  busOut.write(':');
+  busOut.write(frame);
+  busOut.println(crc16((const uint8_t*)frame, length), HEX);
+  enumAnswers++;
+}
+
+/*
+ * helper function taking the address given by LONG, followers only
+ */
+void enumTake(int address, const char* track) {
+  bool trackChanged = strcmp(configLeaderTrack, track) != 0;
+  strcpy(configLeaderTrack, track);
+  enumConfirmed = true;
+
+  if (address == PLAYER_ID) {
+    if (trackChanged) configApply(settings);
+    return;
+  }
+
+  Serial.print("Address ");
+  Serial.print(address);
+  Serial.println(" given by LONG");
+  crashLog("address %d -> %d", PLAYER_ID < FLEET_SIZE ? PLAYER_ID : -1, address);
+  PLAYER_ID = address;
+  persistAddress = address;
+  persistMarkDirty();
+  enumChanges++;
+
+  //the sections of CONFIG.INI for the new address apply from now on
+  if (sdReady) {
+    configLoad();
+  } else {
+    configApply(settings);
+  }
+}
+
+/**
+ * Handles an address request or answer received on the bus, quietly
+ * @param frame Frame without the leading ':'
+ * @return True if the frame was a request or an answer
+ */
+bool enumReceive(char* frame) {
+  bool request = strncmp(frame, "J|", 2) == 0;
+  if (!request && strncmp(frame, "N|", 2) != 0) return false;
+  if (request != (PLAYER_ID == 0)) return true;  //requests are for LONG, answers for followers
+
+  char* crcStart = strrchr(frame, '|');
+  if (crcStart == NULL ||
+      strtoul(crcStart + 1, NULL, 16) != crc16((const uint8_t*)frame, crcStart + 1 - frame)) {
+    enumRejected++;
+    return true;
+  }
+
+  unsigned long uidHi, uidLo;
+  int address;
+  if (request) {
+    if (sscanf(frame, "J|%lx|%lx|%d|", &uidHi, &uidLo, &address) != 3) {
+      enumRejected++;
+      return true;
+    }
+    enumRequests++;
+    int given = enumAssign(uidHi, uidLo, address);
+    if (given == 0) {
+      if (millis() < ENUM_SETTLE_MS) return true;  //asked again in a moment
+      crashLog("no address left for %08lX", uidLo);
+      enumAnswer(uidHi, uidLo, 0);
+      return true;
+    }
+
+    EnumUnit &unit = enumUnits[given];
+    if (!unit.joined || unit.uidHi != uidHi || unit.uidLo != uidLo) {
+      Serial.printf("Unit %08lX%08lX joined as %d\n", uidHi, uidLo, given);
+      crashLog("unit %08lX joined as %d", uidLo, given);
+    }
+    unit.joined = true;
+    unit.uidHi = uidHi;
+    unit.uidLo = uidLo;
+    unit.lastRequestMs = millis();
+    unit.requests++;
+    linkHeard(given);
+    enumAnswer(uidHi, uidLo, given);
+    return true;
+  }
+
+  char track[ENUM_TRACK_SIZE];
+  if (sscanf(frame, "N|%lx|%lx|%d|%12[^|]|", &uidHi, &uidLo, &address, track) != 4 ||
+      address < 0 || address >= FLEET_SIZE) {
+    enumRejected++;
+    return true;
+  }
+  if (uidHi != enumUidHi || uidLo != enumUidLo) return true;  //answer to another unit
+
+  enumAnswers++;
+  if (address == 0) {
+    Serial.println("LONG has no address left for this unit");
+    taskRunIn(enumTask, ENUM_LEASE_MS);
+    return true;
+  }
+  enumTake(address, strcmp(track, "-") == 0 ? "" : track);
+  return true;
+}
+
+/**
+ * Asks LONG for an address, or renews it, followers only
+ * Run by the "enum" one-shot task, re-armed every ENUM_JOIN_MS until answered, then every ENUM_LEASE_MS
+ */
+void enumUpdate() {
+  int hint = PLAYER_ID < FLEET_SIZE ? PLAYER_ID : 0;
+  char frame[ENUM_FRAME_SIZE];
+  int length = snprintf(frame, sizeof(frame), "J|%08lX|%08lX|%d|", (unsigned long)enumUidHi,
+                        (unsigned long)enumUidLo, hint);
+  busOut.write(':');
+  busOut.write(frame);
+  busOut.println(crc16((const uint8_t*)frame, length), HEX);
+  enumRequests++;
+
+  taskRunIn(enumTask, (enumConfirmed ? ENUM_LEASE_MS : ENUM_JOIN_MS) + enumJitter());
+}
+
+/**
+ * Reads the chip ID and registers the enum task on followers, to be called once from setup
+ */
+void setupEnum() {
+  enumReadUid();
+  if (PLAYER_ID == 0) return;
+  enumTask = taskAdd("enum", enumUpdate, ONE_SHOT, 3, 100);
+  taskRunIn(enumTask, enumJitter());
+}
+
+/**
+ * Prints the address table (LONG) or the address of this unit (followers) to Serial
+ */
+void enumReport() {
+  Serial.println("\n-- UNITS --");
+  Serial.printf("Chip ID %08lX%08lX\n", (unsigned long)enumUidHi, (unsigned long)enumUidLo);
+
+  if (PLAYER_ID != 0) {
+    Serial.print("Address ");
+    if (PLAYER_ID < FLEET_SIZE) {
+      Serial.print(PLAYER_ID);
+      Serial.println(enumConfirmed ? " (confirmed by LONG)" : " (not confirmed yet)");
+    } else {
+      Serial.println("none yet");
+    }
+    Serial.print("Track From LONG ");
+    Serial.println(configLeaderTrack[0] != '\0' ? configLeaderTrack : "-");
+    Serial.printf("Requests %lu, Answers %lu, Rejected %lu, Address Changes %lu\n",
+                  (unsigned long)enumRequests, (unsigned long)enumAnswers,
+                  (unsigned long)enumRejected, (unsigned long)enumChanges);
+    return;
+  }
+
+  Serial.println("  address chip              requests  last     track");
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    const EnumUnit &unit = enumUnits[i];
+    if (!enumPresent(i)) continue;
+    if (unit.joined) {
+      Serial.printf("  %2d      %08lX%08lX %8lu %6lus  %s\n", i,
+                    (unsigned long)unit.uidHi, (unsigned long)unit.uidLo, (unsigned long)unit.requests,
+                    (unsigned long)((millis() - unit.lastRequestMs) / 1000),
+                    configUnitTrack(i)[0] != '\0' ? configUnitTrack(i) : "-");
+    } else {
+      Serial.printf("  %2d      heard, not joined since LONG booted\n", i);
+    }
+  }
+  Serial.printf("Requests %lu, Answers %lu, Rejected %lu\n", (unsigned long)enumRequests,
+                (unsigned long)enumAnswers, (unsigned long)enumRejected);
+}
+
+#endif // ENUMCTRL_H
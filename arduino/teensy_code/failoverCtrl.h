@@ -0,0 +1,196 @@
+/**
+ * failoverCtrl.h - Leader Failover Library
+ *
+ * LONG alone runs the calendar, so a dead LONG used to leave the followers waiting for
+ * commands. A follower that hears nothing from LONG (link pings, clock frames) for
+ * FAILOVER_SILENT_MS, plus FAILOVER_STAGGER_MS per address above 1, takes over as acting
+ * leader unless an acting leader with a lower address is heard: the election is by address,
+ * lowest first, and needs no vote. The acting leader runs the calendar (its SCHEDULE.BIN or
+ * the defaults) on the clock LONG distributed last (see clockCtrl.h), restarts the track,
+ * broadcasts the desired state and announces itself with ":V|ADDR|CRC" every
+ * FAILOVER_BEAT_MS. An acting leader hearing one with a lower address steps down.
+ *
+ * As soon as LONG is heard again the acting leader hands control back: its schedule stops
+ * and it applies the state LONG broadcasts, like before. Without a valid clock there is no
+ * takeover and the unit keeps its last state. With the usual wiring the followers only hear
+ * LONG, so each of them leads itself: they still wake, play and sleep together, as they run
+ * the same calendar on the same clock.
+ */
+
+#ifndef FAILOVERCTRL_H
+#define FAILOVERCTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+extern int scheduleTask;
+
+#define FAILOVER_CHECK_MS 500         // follower check period
+#define FAILOVER_SILENT_MS 15000      // LONG silent this long, address 1 takes over
+#define FAILOVER_STAGGER_MS 3000      // each further address waits this much more
+#define FAILOVER_BEAT_MS 2000         // acting leader announcement period
+
+bool failoverActive = false;          // this follower is the acting leader
+uint32_t failoverLeaderMs = 0;        // millis() when LONG was last heard
+int failoverOtherId = 0;              // acting leader heard, 0 if none
+uint32_t failoverOtherMs = 0;         // millis() when it was last heard
+uint32_t failoverBeatMs = 0;
+uint32_t failoverSinceMs = 0;         // millis() of the last takeover
+
+uint32_t failoverTakeovers = 0;
+uint32_t failoverHandbacks = 0;
+uint32_t failoverLedMs = 0;           // total time spent leading, closed periods
+
+/**
+ * @return True on LONG and on the acting leader, which run the calendar and lead playback
+ */
+bool failoverLeading() {
+  return PLAYER_ID == 0 || failoverActive;
+}
+
+/*
+ * helper function giving the silence after which this follower takes over
+ */
+uint32_t failoverDelay() {
+  return FAILOVER_SILENT_MS + (uint32_t)(PLAYER_ID - 1) * FAILOVER_STAGGER_MS;
+}
+
+/*
+ * helper function stepping down, LONG is back or a lower address leads
+ */
+void failoverStepDown(const char* reason) {
+  failoverActive = false;
+  failoverHandbacks++;
+  failoverLedMs += millis() - failoverSinceMs;
+  taskCancel(scheduleTask);
+
+  Serial.print("Acting leader stepping down, ");
+  Serial.println(reason);
+  crashLog("leader handed back, %s", reason);
+}
+
+/**
+ * Notes a frame only LONG sends, followers only: an acting leader hands control back
+ */
+void failoverLeaderHeard() {
+  failoverLeaderMs = millis();
+  if (failoverActive) failoverStepDown("LONG is back");
+}
+
+/*
+ * helper function taking over the calendar and playback from LONG
+ */
+void failoverTakeOver() {
+  failoverActive = true;
+  failoverTakeovers++;
+  failoverSinceMs = millis();
+  failoverBeatMs = 0;
+
+  Serial.print("LONG silent for ");
+  Serial.print((millis() - failoverLeaderMs) / 1000);
+  Serial.println(" s, taking over as acting leader");
+  crashLog("acting leader, LONG silent");
+
+  //carry on from the last state LONG sent, the calendar is compiled on the distributed clock
+  stateShowPlaying = stateDesired.playing;
+  calendarEventCount = 0;
+  taskRunIn(scheduleTask, 0);
+}
+
+/**
+ * Watches LONG and runs the election, announces the acting leader
+ * Run by the "failover" task every FAILOVER_CHECK_MS, followers only
+ */
+void failoverUpdate() {
+  uint32_t now = millis();
+  bool otherLeads = failoverOtherId != 0 && failoverOtherId < PLAYER_ID &&
+                    now - failoverOtherMs < FAILOVER_SILENT_MS;
+
+  if (failoverActive) {
+    if (otherLeads) {
+      failoverStepDown("a lower address leads");
+      return;
+    }
+    if (failoverBeatMs == 0 || now - failoverBeatMs >= FAILOVER_BEAT_MS) {
+      char frame[16];
+      int length = snprintf(frame, sizeof(frame), "V|%d|", PLAYER_ID);
+      busOut.write(':');
+      busOut.write(frame);
+      busOut.println(crc16((const uint8_t*)frame, length), HEX);
+      failoverBeatMs = now;
+    }
+    return;
+  }
+
+  if (PLAYER_ID >= FLEET_SIZE || !clockValid || otherLeads) return;
+  if (now - failoverLeaderMs < failoverDelay()) return;
+  failoverTakeOver();
+}
+
+/**
+ * Handles an acting leader announcement received on the bus, quietly
+ * @param frame Frame without the leading ':'
+ * @return True if the frame was an announcement
+ */
+bool failoverReceive(char* frame) {
+  if (strncmp(frame, "V|", 2) != 0) return false;
+
+  char* crcStart = strrchr(frame, '|');
+  int playerId;
+  if (crcStart == NULL ||
+      strtoul(crcStart + 1, NULL, 16) != crc16((const uint8_t*)frame, crcStart + 1 - frame) ||
+      sscanf(frame, "V|%d|", &playerId) != 1 || playerId <= 0 || playerId >= FLEET_SIZE ||
+      playerId == PLAYER_ID) {
+    return true;
+  }
+
+  //LONG: a follower led while this unit was away, it stops as soon as it hears the pings
+  if (PLAYER_ID == 0 && (failoverOtherId != playerId || millis() - failoverOtherMs > FAILOVER_SILENT_MS)) {
+    Serial.print("Unit ");
+    Serial.print(playerId);
+    Serial.println(" was acting leader, handing back");
+    crashLog("unit %d was acting leader", playerId);
+  }
+  failoverOtherId = playerId;
+  failoverOtherMs = millis();
+  return true;
+}
+
+/**
+ * Registers the failover task on followers, to be called once from setup
+ */
+void setupFailover() {
+  if (PLAYER_ID == 0) return;
+  failoverLeaderMs = millis();
+  taskAdd("failover", failoverUpdate, FAILOVER_CHECK_MS, 3);
+}
+
+/**
+ * Prints the failover state and history to Serial
+ */
+void failoverReport() {
+  Serial.println("\n-- FAILOVER --");
+  if (PLAYER_ID == 0) {
+    Serial.print("Acting Leader Last Heard ");
+    if (failoverOtherId != 0) {
+      Serial.printf("unit %d, %lu s ago\n", failoverOtherId, (unsigned long)((millis() - failoverOtherMs) / 1000));
+    } else {
+      Serial.println("never");
+    }
+    return;
+  }
+
+  Serial.print("Role ");
+  Serial.println(failoverActive ? "ACTING LEADER" : "FOLLOWER");
+  Serial.print("LONG Last Heard ");
+  Serial.print((millis() - failoverLeaderMs) / 1000);
+  Serial.println(" s ago");
+  Serial.print("Takes Over After ");
+  Serial.print(failoverDelay() / 1000);
+  Serial.println(clockValid ? " s of silence" : " s of silence, once the clock is valid");
+  uint32_t ledMs = failoverLedMs + (failoverActive ? millis() - failoverSinceMs : 0);
+  Serial.printf("Takeovers %lu, Handbacks %lu, Time Leading %lu s\n", (unsigned long)failoverTakeovers,
+                (unsigned long)failoverHandbacks, (unsigned long)(ledMs / 1000));
+}
+
+#endif // FAILOVERCTRL_H
@@ -0,0 +1,268 @@
+/**
+ * fleetCtrl.h - Fleet Telemetry Library
+ *
+ * Followers push a compact telemetry frame to LONG every FLEET_PUSH_MS, each in its own
+ * slot of the period so they do not talk over each other on the shared return line. The
+ * slots are timed on LONG's clock (see clockCtrl.h), up to 10 followers fit in a period.
+ * LONG samples itself at the same rate and keeps, for every unit, the last FLEET_HISTORY
+ * samples and when it was last heard from, so the system report shows the whole
+ * installation at once without asking the followers anything.
+ *
+ * Frame: ":T|ID|SEQ|TEMPx10|FLAGS|POSMS|LENMS|ERRORS|RUNUS|LATEMS|CRC"
+ * FLAGS is awake (bit 0), playing (bit 1), SD OK (bit 2) and the power phase (bits 4-6),
+ * CRC the crc16() in hex of the text between ':' and the last '|'. A frame damaged by a
+ * collision or line noise fails the CRC and is dropped.
+ */
+
+#ifndef FLEETCTRL_H
+#define FLEETCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern int PLAYER_ID;
+extern bool systemAwake;
+extern bool playbackStatus;
+extern AudioPlaySdWav wavPlayer;
+void linkHeard(int playerId);
+bool enumPresent(int address);
+
+#define FLEET_PUSH_MS 3000        // period of the telemetry frames
+#define FLEET_SLOT_MS (FLEET_PUSH_MS / FLEET_SIZE)  // follower n sends n * FLEET_SLOT_MS into the period, a frame takes ~70ms
+#define FLEET_SILENT_PUSHES 3     // missed frames before a unit counts as silent
+#define FLEET_HISTORY 10          // samples kept per unit, 30s at FLEET_PUSH_MS
+#define FLEET_FRAME_SIZE 80
+
+#define FLEET_AWAKE 0x01
+#define FLEET_PLAYING 0x02
+#define FLEET_SD_OK 0x04
+#define FLEET_PHASE_SHIFT 4
+
+// one telemetry sample, as sent by a follower
+struct FleetSample {
+  uint32_t seenMs;        // millis() on LONG when received
+  int16_t tempX10;        // CPU temperature in 0.1 °C
+  uint8_t flags;
+  uint32_t positionMs;
+  uint32_t lengthMs;
+  uint32_t errors;        // SD faults and watchdog local recoveries since boot
+  uint32_t maxRunUs;      // longest task run during the last period
+  uint32_t maxLateMs;     // largest task lateness during the last period
+};
+
+// what LONG knows about each unit
+struct FleetUnit {
+  bool known;
+  uint16_t lastSeq;
+  uint32_t frames;        // frames received
+  uint32_t lost;          // frames missing from the sequence
+  uint8_t head;           // next sample written
+  uint8_t count;
+  FleetSample history[FLEET_HISTORY];
+};
+
+FleetUnit fleet[FLEET_SIZE];
+uint32_t fleetRejected = 0;       // frames failing the CRC or the format
+uint16_t fleetSeq = 0;            // sequence of the frames sent by this unit
+int fleetTask = TASK_NONE;
+
+/*
+ * helper function filling a sample with the state of this unit
+ */
+void fleetSampleLocal(FleetSample &sample) {
+  sample.seenMs = millis();
+  sample.tempX10 = (int16_t)(tempmonGetTemp() * 10.0f);
+  sample.flags = (systemAwake ? FLEET_AWAKE : 0) | (playbackStatus ? FLEET_PLAYING : 0) |
+                 (sdReady ? FLEET_SD_OK : 0) | (powerPhase << FLEET_PHASE_SHIFT);
+  sample.positionMs = wavPlayer.isPlaying() ? wavPlayer.positionMillis() : 0;
+  sample.lengthMs = wavPlayer.isPlaying() ? wavPlayer.lengthMillis() : 0;
+  sample.errors = sdErrors;
+  for (int i = 0; i < WDT_REASON_COUNT; i++) {
+    sample.errors += watchdogLocal[i];
+  }
+  schedulerTakePeaks(sample.maxRunUs, sample.maxLateMs);
+}
+
+/*
+ * helper function adding a sample to the history of a unit
+ */
+void fleetStore(int playerId, const FleetSample &sample) {
+  FleetUnit &unit = fleet[playerId];
+  unit.known = true;
+  unit.history[unit.head] = sample;
+  unit.head = (unit.head + 1) % FLEET_HISTORY;
+  if (unit.count < FLEET_HISTORY) unit.count++;
+}
+
+/**
+ * @return Last sample of a unit, only meaningful once fleet[playerId].known
+ */
+const FleetSample& fleetLatest(int playerId) {
+  const FleetUnit &unit = fleet[playerId];
+  return unit.history[(unit.head + FLEET_HISTORY - 1) % FLEET_HISTORY];
+}
+
+/**
+ * @return True if LONG received from the unit within FLEET_SILENT_PUSHES periods
+ */
+bool fleetOnline(int playerId) {
+  if (playerId < 0 || playerId >= FLEET_SIZE || !fleet[playerId].known) return false;
+  return millis() - fleetLatest(playerId).seenMs < FLEET_PUSH_MS * FLEET_SILENT_PUSHES;
+}
+
+/*
+ * helper function returning the delay to the next slot of this follower, on LONG's clock so
+ * the slots of all followers line up once it is synchronised
+ */
+uint32_t fleetSlotDelay() {
+  uint32_t phase = (clockLeaderMillis() + FLEET_PUSH_MS - PLAYER_ID * FLEET_SLOT_MS) % FLEET_PUSH_MS;
+  return FLEET_PUSH_MS - phase;
+}
+
+/**
+ * Samples this unit: sent to LONG on followers, stored directly on LONG
+ * Run by the "fleet" task every FLEET_PUSH_MS
+ */
+void fleetUpdate() {
+  FleetSample sample;
+  fleetSampleLocal(sample);
+
+  if (PLAYER_ID == 0) {
+    fleetStore(0, sample);
+    return;
+  }
+
+  //no address yet, nothing to send
+  taskRunIn(fleetTask, fleetSlotDelay());
+  if (PLAYER_ID >= FLEET_SIZE) return;
+
+  char frame[FLEET_FRAME_SIZE];
+  int length = snprintf(frame, sizeof(frame), "T|%d|%u|%d|%u|%lu|%lu|%lu|%lu|%lu|",
+                        PLAYER_ID, fleetSeq++, sample.tempX10, sample.flags,
+                        (unsigned long)sample.positionMs, (unsigned long)sample.lengthMs,
+                        (unsigned long)sample.errors, (unsigned long)sample.maxRunUs,
+                        (unsigned long)sample.maxLateMs);
+  if (length <= 0 || length >= (int)sizeof(frame)) return;
+
+  //queued in the TX buffer, the task does not wait for the 9600 baud line
+  busOut.write(':');
+  busOut.write(frame);
+  busOut.println(crc16((const uint8_t*)frame, length), HEX);
+}
+
+/**
+ * Parses a telemetry frame received by LONG, frames failing the check are counted and dropped
+ * @param frame Frame without the leading ':'
+ */
+void fleetReceive(char* frame) {
+  char* crcStart = strrchr(frame, '|');
+  if (crcStart == NULL ||
+      strtoul(crcStart + 1, NULL, 16) != crc16((const uint8_t*)frame, crcStart + 1 - frame)) {
+    fleetRejected++;
+    return;
+  }
+
+  int playerId;
+  unsigned seq, flags;
+  int tempX10;
+  unsigned long positionMs, lengthMs, errors, runUs, lateMs;
+  if (sscanf(frame, "T|%d|%u|%d|%u|%lu|%lu|%lu|%lu|%lu|", &playerId, &seq, &tempX10, &flags,
+             &positionMs, &lengthMs, &errors, &runUs, &lateMs) != 9 ||
+      playerId <= 0 || playerId >= FLEET_SIZE) {
+    fleetRejected++;
+    return;
+  }
+
+  linkHeard(playerId);
+  FleetUnit &unit = fleet[playerId];
+  //a follower that rebooted restarts at 0, which shows as a backward jump and is not a loss
+  uint16_t gap = (uint16_t)(seq - unit.lastSeq - 1);
+  if (unit.frames > 0 && gap < 0x8000) unit.lost += gap;
+  unit.lastSeq = seq;
+  unit.frames++;
+
+  FleetSample sample;
+  sample.seenMs = millis();
+  sample.tempX10 = tempX10;
+  sample.flags = flags;
+  sample.positionMs = positionMs;
+  sample.lengthMs = lengthMs;
+  sample.errors = errors;
+  sample.maxRunUs = runUs;
+  sample.maxLateMs = lateMs;
+  fleetStore(playerId, sample);
+}
+
+/**
+ * Registers the fleet task, to be called once from setup
+ * Followers send in their slot of the period, the shared return line is set up by setupBus()
+ */
+void setupFleet() {
+  fleetTask = taskAdd("fleet", fleetUpdate, FLEET_PUSH_MS, 4, 0, PLAYER_ID * FLEET_SLOT_MS);
+}
+
+/**
+ * Prints the cached state of one unit, LONG only
+ * @param playerId Unit to print
+ */
+void fleetPrintUnit(int playerId) {
+  if (playerId < 0 || playerId >= FLEET_SIZE || !fleet[playerId].known) {
+    Serial.printf("  %d  no telemetry received\n", playerId);
+    return;
+  }
+
+  const FleetSample &sample = fleetLatest(playerId);
+  Serial.printf("  %d  %-7s %4lus %5.1f %-5s %-7s %-11s %4lu:%02lu/%lu:%02lu %-5s %6lu %7lu %7lu\n",
+                playerId,
+                fleetOnline(playerId) ? "ONLINE" : "SILENT",
+                (unsigned long)((millis() - sample.seenMs) / 1000),
+                sample.tempX10 / 10.0f,
+                (sample.flags & FLEET_AWAKE) ? "YES" : "NO",
+                (sample.flags & FLEET_PLAYING) ? "PLAYING" : "STOPPED",
+                powerPhaseNames[(sample.flags >> FLEET_PHASE_SHIFT) % 6],
+                (unsigned long)(sample.positionMs / 60000), (unsigned long)(sample.positionMs / 1000 % 60),
+                (unsigned long)(sample.lengthMs / 60000), (unsigned long)(sample.lengthMs / 1000 % 60),
+                (sample.flags & FLEET_SD_OK) ? "OK" : "FAULT",
+                (unsigned long)sample.errors,
+                (unsigned long)sample.maxRunUs,
+                (unsigned long)sample.maxLateMs);
+}
+
+/**
+ * Prints the fleet table and the recent history of each unit to Serial, LONG only
+ */
+void fleetReport() {
+  if (PLAYER_ID != 0) return;
+
+  Serial.println("\n-- FLEET --");
+  Serial.println("  id state     seen  temp awake playing phase          position    sd    errors   runUs  lateMs");
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    if (enumPresent(i) || fleet[i].known) fleetPrintUnit(i);
+  }
+
+  Serial.println("History, oldest first (temp °C / max task run us)");
+  uint32_t frames = 0;
+  uint32_t lost = 0;
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    const FleetUnit &unit = fleet[i];
+    frames += unit.frames;
+    lost += unit.lost;
+    if (!unit.known) continue;
+    Serial.printf("  %d ", i);
+    int first = (unit.head + FLEET_HISTORY - unit.count) % FLEET_HISTORY;
+    for (int j = 0; j < unit.count; j++) {
+      const FleetSample &sample = unit.history[(first + j) % FLEET_HISTORY];
+      Serial.printf(" %.1f/%lu", sample.tempX10 / 10.0f, (unsigned long)sample.maxRunUs);
+    }
+    Serial.println();
+  }
+
+  Serial.print("Frames Received ");
+  Serial.print(frames);
+  Serial.print(", Lost ");
+  Serial.print(lost);
+  Serial.print(", Rejected ");
+  Serial.println(fleetRejected);
+}
+
+#endif // FLEETCTRL_H
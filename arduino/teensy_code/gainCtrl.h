@@ -0,0 +1,290 @@
+/**
+ * gainCtrl.h - Software Gain Library
+ *
+ * Each volume change used to be an I2C write of the codec headphone volume, in 0.1 steps
+ * that could be heard as zipper noise while the knob turned. The volume is now mostly
+ * applied in the audio graph by AudioEffectRampGain, between the player and the output: the
+ * loop sets the target gain without locking, the audio interrupt ramps toward it sample by
+ * sample, reaching a new value within GAIN_RAMP_MS.
+ *
+ * The codec stays at a coarse level, a multiple of GAIN_CODEC_STEP in the scale of
+ * sgtl5000.volume(), and the software gain only attenuates below it. audioVolume keeps its
+ * meaning: the codec scale is 0.5 dB per 1/129, so software and codec together give the level
+ * the codec alone gave. The codec moves when the volume goes above its level, or more than
+ * two steps below it. It is walked there by the "gain" task one 0.5 dB register step at a
+ * time: the gain node first takes the opposite step, and the codec is written only once that
+ * block has left the node and the I2S queue, so the level heard holds through the change.
+ */
+
+#ifndef GAINCTRL_H
+#define GAINCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern AudioControlSGTL5000 sgtl5000;
+
+#define GAIN_RAMP_MS 20               // full scale ramp time of the software gain
+#define GAIN_CODEC_STEP 0.2f          // coarse codec levels, in sgtl5000.volume() units
+#define GAIN_CODEC_UNITS 129          // sgtl5000.volume() register steps
+#define GAIN_CODEC_DB_PER_UNIT 64.5f  // sgtl5000.volume(): 129 steps of 0.5 dB
+#define GAIN_QUEUE_BLOCKS 2           // audio blocks between the gain node and the DAC (I2S DMA)
+#define GAIN_POLL_MS 1                // a codec step checks this often whether its gain is heard
+#define GAIN_STALL_MS 50              // no audio block for this long, the engine is stopped
+
+// Gain applied in the audio graph, ramped per sample toward a target set from the loop, and a
+// factor taken without ramp that covers a codec step
+class AudioEffectRampGain : public AudioStream {
+public:
+  AudioEffectRampGain() : AudioStream(1, inputQueueArray) {}
+
+  /**
+   * Sets the target gain, safe to call from the loop while the audio interrupt runs
+   * @param gain Linear gain, 0.0 to 1.0
+   */
+  void gain(float gain) {
+    gain = constrain(gain, 0.0f, 1.0f);
+    foldTarget = gain;                  //a pending fold() takes the latest target
+    targetGain = gain;                  //one aligned 32 bit store, atomic on the M7
+  }
+
+  /**
+   * Applies a factor from the next block on, without ramp, ahead of the opposite codec step
+   * @param factor Linear factor
+   */
+  void compensate(float factor) {
+    compensationNext = factor;
+    compensationPending = true;         //stored after the factor, read before it
+  }
+
+  /**
+   * Takes the factor into the ramped gain once the codec made its step, nothing heard changes
+   * @param gain Target gain for the new codec level
+   */
+  void fold(float gain) {
+    foldTarget = constrain(gain, 0.0f, 1.0f);
+    foldPending = true;
+  }
+
+  /**
+   * @param queued Blocks between this node and the DAC
+   * @return True once the block carrying the last factor is being played
+   */
+  bool rendered(uint32_t queued) {
+    return !compensationPending && blocks - compensationBlock >= queued;
+  }
+
+  /**
+   * @return Audio blocks processed, stops while the audio engine is stopped
+   */
+  uint32_t blockCount() {
+    return blocks;
+  }
+
+  /**
+   * @return Gain applied to the last sample
+   */
+  float current() {
+    return min(currentGain * compensation, 1.0f);
+  }
+
+  void update(void) override {
+    blocks++;
+    if (foldPending) {
+      currentGain = min(currentGain * compensation, 1.0f);
+      compensation = 1.0f;
+      targetGain = foldTarget;
+      foldPending = false;
+    }
+    if (compensationPending) {
+      compensation = compensationNext;
+      compensationPending = false;
+      compensationBlock = blocks;
+    }
+    float target = targetGain;
+    float factor = compensation;
+
+    //settled at unity or silence, nothing to compute
+    if (currentGain == target && target == 1.0f && factor == 1.0f) {
+      audio_block_t* block = receiveReadOnly(0);
+      if (block == NULL) return;
+      transmit(block);
+      release(block);
+      return;
+    }
+    audio_block_t* block = receiveWritable(0);
+    if (block == NULL) return;
+    if (currentGain == target && target == 0.0f) {
+      release(block);
+      return;
+    }
+
+    const float step = 1.0f / (GAIN_RAMP_MS * AUDIO_SAMPLE_RATE_EXACT / 1000.0f);
+    float gain = currentGain;
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+      if (gain < target) {
+        gain = min(gain + step, target);
+      } else if (gain > target) {
+        gain = max(gain - step, target);
+      }
+      block->data[i] = (int16_t)(block->data[i] * min(gain * factor, 1.0f));
+    }
+    currentGain = gain;
+
+    transmit(block);
+    release(block);
+  }
+
+private:
+  audio_block_t* inputQueueArray[1];
+  volatile float targetGain = 1.0f;
+  volatile float foldTarget = 1.0f;
+  volatile float compensationNext = 1.0f;
+  volatile bool compensationPending = false;
+  volatile bool foldPending = false;
+  volatile uint32_t blocks = 0;             // written by the audio interrupt only
+  volatile uint32_t compensationBlock = 0;  // block the last factor was first applied to
+  float currentGain = 1.0f;                 // audio interrupt only
+  float compensation = 1.0f;                // audio interrupt only
+};
+
+extern AudioEffectRampGain audioGain;
+
+int gainCodecLevel = -1;              // codec level written, in register steps, -1 until the codec is enabled
+int gainCodecTarget = -1;             // level the codec is walked to
+int gainCodecNext = -1;               // level of the step in flight, -1 if none
+uint32_t gainStepStartMs = 0;
+uint32_t gainStepBlocks = 0;          // audio blocks processed when the step started
+float gainVolume = 0.0f;              // volume last set
+int gainTask = TASK_NONE;
+uint32_t gainCodecWrites = 0;
+uint32_t gainChanges = 0;
+
+/*
+ * helper function choosing the codec level for a volume, kept while it still fits
+ */
+int gainCodecFor(float volume) {
+  float current = (float)gainCodecTarget / GAIN_CODEC_UNITS;
+  if (gainCodecTarget >= 0 && current >= volume && current - volume <= 2 * GAIN_CODEC_STEP) {
+    return gainCodecTarget;
+  }
+  float level = ceilf(volume / GAIN_CODEC_STEP - 0.001f) * GAIN_CODEC_STEP;
+  return (int)ceilf(constrain(level, GAIN_CODEC_STEP, 1.0f) * GAIN_CODEC_UNITS - 0.001f);
+}
+
+/*
+ * helper function computing the software gain giving a volume over a codec level
+ */
+float gainSoftware(float volume, int level) {
+  //volume 0 is silence
+  if (volume <= 0.0f) return 0.0f;
+  return powf(10.0f, (volume - (float)level / GAIN_CODEC_UNITS) * GAIN_CODEC_DB_PER_UNIT / 20.0f);
+}
+
+/*
+ * helper function writing a codec level
+ */
+void gainCodecWrite(int level) {
+  sgtl5000.volume((float)level / GAIN_CODEC_UNITS);
+  gainCodecLevel = level;
+  gainCodecWrites++;
+}
+
+/*
+ * helper function moving the codec straight to a level, when nothing is heard
+ */
+void gainJump(int level) {
+  gainCodecWrite(level);
+  gainCodecNext = -1;
+  audioGain.compensate(1.0f);
+  audioGain.fold(gainSoftware(gainVolume, level));
+}
+
+/**
+ * Sets the volume, in the scale of sgtl5000.volume(), on the software gain and the codec
+ * @param volume 0.0 to 1.0
+ */
+void gainSet(float volume) {
+  volume = constrain(volume, 0.0f, 1.0f);
+  gainVolume = volume;
+  gainChanges++;
+
+  gainCodecTarget = gainCodecFor(volume);
+  if (gainCodecLevel < 0) {
+    gainJump(gainCodecTarget);
+    return;
+  }
+
+  //while the codec is walked, the gain task sets the software gain with each step
+  if (gainCodecNext >= 0) return;
+  if (gainCodecTarget != gainCodecLevel) {
+    taskRunIn(gainTask, 0);
+    return;
+  }
+  audioGain.gain(gainSoftware(volume, gainCodecLevel));
+}
+
+/**
+ * Walks the codec one 0.5 dB step toward its level, the software gain taking the opposite
+ * step first and the codec written once that gain is heard
+ * Run by the "gain" one-shot task, re-armed every GAIN_POLL_MS until the codec is there
+ */
+void gainUpdate() {
+  if (gainCodecNext >= 0) {
+    //audio engine stopped (low power idle), nothing is heard
+    if (audioGain.blockCount() == gainStepBlocks && millis() - gainStepStartMs >= GAIN_STALL_MS) {
+      gainJump(gainCodecTarget);
+      return;
+    }
+    if (!audioGain.rendered(GAIN_QUEUE_BLOCKS)) {
+      taskRunIn(gainTask, GAIN_POLL_MS);
+      return;
+    }
+    gainCodecWrite(gainCodecNext);
+    gainCodecNext = -1;
+    audioGain.fold(gainSoftware(gainVolume, gainCodecLevel));
+  }
+  if (gainCodecLevel == gainCodecTarget) return;
+
+  gainCodecNext = gainCodecLevel + (gainCodecTarget > gainCodecLevel ? 1 : -1);
+  audioGain.compensate(powf(10.0f, (gainCodecLevel - gainCodecNext) * GAIN_CODEC_DB_PER_UNIT / GAIN_CODEC_UNITS / 20.0f));
+  gainStepStartMs = millis();
+  gainStepBlocks = audioGain.blockCount();
+  taskRunIn(gainTask, GAIN_POLL_MS);
+}
+
+/**
+ * Writes the codec level again, to be called once the codec is enabled
+ */
+void gainBegin(float volume) {
+  gainCodecLevel = -1;
+  gainCodecTarget = -1;
+  gainSet(volume);
+}
+
+/**
+ * Registers the codec walk task, to be called once from setup
+ */
+void setupGain() {
+  gainTask = taskAdd("gain", gainUpdate, ONE_SHOT, 3);
+}
+
+/**
+ * Prints the software gain and the codec level to Serial
+ */
+void gainReport() {
+  Serial.println("\n-- GAIN --");
+  Serial.printf("Volume %.2f, Codec Level %.2f", gainVolume, (float)gainCodecLevel / GAIN_CODEC_UNITS);
+  if (gainCodecNext >= 0) {
+    Serial.printf(" (moving to %.2f)", (float)gainCodecTarget / GAIN_CODEC_UNITS);
+  }
+  float gain = audioGain.current();
+  if (gain > 0.0f) {
+    Serial.printf(", Software Gain %.1f dB\n", 20.0f * log10f(gain));
+  } else {
+    Serial.println(", Software Gain muted");
+  }
+  Serial.printf("Changes %lu, Codec Steps %lu\n", (unsigned long)gainChanges, (unsigned long)gainCodecWrites);
+}
+
+#endif // GAINCTRL_H
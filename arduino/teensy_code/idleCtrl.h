@@ -0,0 +1,191 @@
+/**
+ * idleCtrl.h - Low Power Idle Library
+ *
+ * Deep idle between END_HOUR and START_HOUR: once the system has been asleep for
+ * IDLE_ENTER_DELAY, the audio engine is stopped, the codec muted and the ARM clock
+ * reduced to IDLE_CPU_HZ. loop() then sleeps with WFI between tasks. The leader is
+ * woken on RTC_INT_PIN by the DS3231 alarm armed for the next schedule event (see
+ * scheduleArm()), followers by any frame on the serial bus that brings them back awake.
+ * Time spent sleeping is measured and reported with an estimate of the current
+ * drawn by the Teensy.
+ */
+
+#ifndef IDLECTRL_H
+#define IDLECTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern "C" uint32_t set_arm_clock(uint32_t frequency);
+
+extern int PLAYER_ID;
+extern const int PWM_PIN;
+extern const int RTC_INT_PIN;
+extern AudioControlSGTL5000 sgtl5000;
+extern AudioPlaySdWav wavPlayer;
+extern bool rebootPending;
+extern bool rtcReady;
+extern int scheduleTask;
+
+#define IDLE_CPU_HZ 24000000        // ARM clock while idle
+#define IDLE_ENTER_DELAY 30000      // ms asleep before entering idle, keeps USB snappy right after sleep
+
+// Teensy 4.0 current draw used for the estimate (mA, 5V input, from PJRC figures)
+#define CPU_RUN_MA_FULL 100.0       // running at 600 MHz
+#define CPU_RUN_MA_IDLE 20.0        // running at 24 MHz
+#define CPU_WFI_MA_IDLE 12.0        // sleeping in WFI at 24 MHz
+
+bool idleActive = false;
+volatile bool rtcAlarmFired = false;
+elapsedMillis idleAsleepTimer;       // time spent asleep and settled
+
+// measurements
+uint32_t idleSessions = 0;
+uint32_t idleEnteredMs = 0;
+uint64_t idleTotalMs = 0;            // completed sessions
+uint64_t idleSleepUs = 0;            // time spent in WFI, all sessions
+uint32_t idleWakeups = 0;            // wake-ups from an RTC alarm or a bus frame
+
+/*
+ * DS3231 INT/SQW falling edge, alarm 1 matched
+ */
+void rtcAlarmISR() {
+  rtcAlarmFired = true;
+}
+
+/**
+ * Stops audio processing, mutes the codec and lowers the ARM clock
+ */
+void idleEnter() {
+  Serial.println("Entering low power idle");
+
+  wavPlayer.stop();
+  analogWrite(PWM_PIN, 0);  // Set PWM to zero
+  sgtl5000.muteHeadphone();
+  sgtl5000.muteLineout();
+  AudioNoInterrupts();      // stops the audio update, both analyzers included
+  displayBinaryCode(1);
+
+  Serial.flush();
+  set_arm_clock(IDLE_CPU_HZ);
+
+  idleActive = true;
+  idleSessions++;
+  idleEnteredMs = millis();
+}
+
+/**
+ * Restores full clock and audio processing
+ */
+void idleExit() {
+  set_arm_clock(F_CPU);
+  AudioInterrupts();
+  sgtl5000.unmuteHeadphone();
+  sgtl5000.unmuteLineout();
+
+  idleActive = false;
+  idleTotalMs += millis() - idleEnteredMs;
+  idleAsleepTimer = 0;
+
+  Serial.println("Leaving low power idle");
+}
+
+/**
+ * Enters idle once asleep for long enough, leaves it on a wake request or RTC alarm
+ * Run by the "idle" task
+ */
+void idleUpdate() {
+  //without the RTC alarm nothing would wake LONG up
+  bool canIdle = !powerTargetAwake && powerPhase == PWR_ASLEEP && !rebootPending &&
+                 (PLAYER_ID != 0 || rtcReady);
+
+  if (idleActive) {
+    if (rtcAlarmFired) {
+      Serial.println("RTC alarm fired");
+      rtcAlarmFired = false;
+      idleWakeups++;
+      idleExit();
+      taskRunIn(scheduleTask, 0);
+    } else if (!canIdle) {
+      idleWakeups++;
+      idleExit();
+    }
+    return;
+  }
+
+  //the millis deadline handles schedule events while not idle
+  rtcAlarmFired = false;
+
+  if (!canIdle) {
+    idleAsleepTimer = 0;
+  } else if (idleAsleepTimer >= IDLE_ENTER_DELAY) {
+    idleEnter();
+  }
+}
+
+/**
+ * Sleeps until the next interrupt (systick, Serial1/3, USB, RTC alarm) while idle
+ * Called from loop() when no task was due
+ */
+void idleWait() {
+  if (!idleActive) return;
+
+  uint32_t startUs = micros();
+  asm volatile("wfi");
+  idleSleepUs += micros() - startUs;
+}
+
+/**
+ * Registers the idle task and the RTC alarm interrupt, to be called once from setup
+ */
+void setupIdle() {
+  if (PLAYER_ID == 0) {
+    pinMode(RTC_INT_PIN, INPUT_PULLUP);  // DS3231 INT/SQW is open drain
+    attachInterrupt(digitalPinToInterrupt(RTC_INT_PIN), rtcAlarmISR, FALLING);
+  }
+  taskAdd("idle", idleUpdate, 100, 0);
+}
+
+/**
+ * Prints idle measurements and the estimated current saved to Serial
+ */
+void idleReport() {
+  Serial.println("\n-- LOW POWER IDLE --");
+
+  uint64_t totalMs = idleTotalMs;
+  if (idleActive) {
+    totalMs += millis() - idleEnteredMs;
+  }
+
+  Serial.print("Idle Active ");
+  Serial.println(idleActive ? "YES" : "NO");
+  Serial.print("Idle Sessions ");
+  Serial.println(idleSessions);
+  Serial.print("Idle Wakeups ");
+  Serial.println(idleWakeups);
+  Serial.print("Idle Time ");
+  Serial.print((unsigned long)(totalMs / 60000));
+  Serial.println(" min");
+
+  if (totalMs == 0) return;
+
+  //share of idle time spent in WFI, the rest is tasks running at IDLE_CPU_HZ
+  float sleepRatio = (float)idleSleepUs / (totalMs * 1000.0f);
+  if (sleepRatio > 1.0f) sleepRatio = 1.0f;
+  float idleMa = sleepRatio * CPU_WFI_MA_IDLE + (1.0f - sleepRatio) * CPU_RUN_MA_IDLE;
+  float savedMah = (CPU_RUN_MA_FULL - idleMa) * totalMs / 3600000.0f;
+
+  Serial.print("Sleep Ratio ");
+  Serial.print(sleepRatio * 100.0f);
+  Serial.println(" %");
+  Serial.print("Estimated Idle Current ");
+  Serial.print(idleMa);
+  Serial.print(" mA (vs ");
+  Serial.print(CPU_RUN_MA_FULL);
+  Serial.println(" mA at full clock)");
+  Serial.print("Estimated Charge Saved ");
+  Serial.print(savedMah);
+  Serial.println(" mAh");
+}
+
+#endif // IDLECTRL_H
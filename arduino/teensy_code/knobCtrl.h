@@ -0,0 +1,107 @@
+/**
+ * knobCtrl.h - Volume Knob Library
+ *
+ * The knob on LONG used to be read once per check and every change of its 0.1 step was
+ * forwarded at once, so a twisted knob flooded the 9600 baud bus and a knob resting between
+ * two steps dithered from one to the other. Each check now averages KNOB_OVERSAMPLE ADC reads
+ * and smooths them, and the step only changes once the knob is KNOB_HYSTERESIS of a step past
+ * the midpoint. The new step is kept as the one pending change, a newer step replaces it
+ * (latest value wins), and it is staged on the fleet (see paramCtrl.h) at most once every
+ * KNOB_SEND_MS. The knob only moves the volume when turned, a volume set over USB stays.
+ */
+
+#ifndef KNOBCTRL_H
+#define KNOBCTRL_H
+
+#include <Arduino.h>
+
+extern const uint8_t VOL_CTRL_PIN;
+
+#define KNOB_OVERSAMPLE 8             // ADC reads averaged per check
+#define KNOB_SMOOTHING 0.5f           // weight of the new reading in the smoothed position
+#define KNOB_STEPS 10                 // volume steps, 0.0 to 1.0
+#define KNOB_HYSTERESIS 0.25f         // of a step, past the midpoint before the step changes
+#define KNOB_SEND_MS 250              // at most one change staged per period
+
+float knobPosition = -1.0f;           // smoothed position, in steps, -1 before the first read
+int knobStep = -1;                    // step the knob is on
+int knobPending = -1;                 // step waiting to be staged, -1 if none
+uint32_t knobSentMs = 0;
+
+uint32_t knobChanges = 0;             // steps taken by the knob
+uint32_t knobSent = 0;                // changes staged
+uint32_t knobCoalesced = 0;           // steps replaced by a newer one before being staged
+
+/*
+ * helper function reading the knob position in steps, oversampled and smoothed
+ */
+float knobRead() {
+  uint32_t sum = 0;
+  for (int i = 0; i < KNOB_OVERSAMPLE; i++) {
+    sum += analogRead(VOL_CTRL_PIN);
+  }
+  float position = sum * (float)KNOB_STEPS / (KNOB_OVERSAMPLE * 1023.0f);
+
+  if (knobPosition < 0.0f) {
+    knobPosition = position;
+  } else {
+    knobPosition += KNOB_SMOOTHING * (position - knobPosition);
+  }
+  return knobPosition;
+}
+
+/**
+ * Reads the knob and keeps its step as the pending change if it moved
+ * @return True if a change is pending
+ */
+bool knobSample() {
+  float position = knobRead();
+
+  //first read: where the knob rests, the restored or typed volume stays until it is turned
+  if (knobStep < 0) {
+    knobStep = constrain((int)lroundf(position), 0, KNOB_STEPS);
+    return knobPending >= 0;
+  }
+
+  //far enough from the current step
+  if (fabsf(position - knobStep) > 0.5f + KNOB_HYSTERESIS) {
+    int step = constrain((int)lroundf(position), 0, KNOB_STEPS);
+    if (step != knobStep) {
+      knobStep = step;
+      knobChanges++;
+      if (knobPending >= 0) knobCoalesced++;
+      knobPending = step;
+    }
+  }
+  return knobPending >= 0;
+}
+
+/**
+ * Takes the pending change if the send period allows it
+ * @return Step to stage, -1 if none
+ */
+int knobTake() {
+  if (knobPending < 0 || millis() - knobSentMs < KNOB_SEND_MS) return -1;
+  int step = knobPending;
+  knobPending = -1;
+  knobSentMs = millis();
+  knobSent++;
+  return step;
+}
+
+/**
+ * Prints the knob position and how its changes were coalesced to Serial
+ */
+void knobReport() {
+  Serial.println("\n-- VOLUME KNOB --");
+  if (knobStep < 0) {
+    Serial.println("Not read yet");
+    return;
+  }
+  Serial.printf("Position %.2f, Step %d", knobPosition, knobStep);
+  if (knobPending >= 0) Serial.printf(", Pending %d", knobPending);
+  Serial.printf("\nSteps %lu, Staged %lu, Coalesced %lu\n", (unsigned long)knobChanges,
+                (unsigned long)knobSent, (unsigned long)knobCoalesced);
+}
+
+#endif // KNOBCTRL_H
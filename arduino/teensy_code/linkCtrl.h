@@ -0,0 +1,276 @@
+/**
+ * linkCtrl.h - Serial Link Health Library
+ *
+ * The serial bus has no acknowledgement, so LONG pings each follower in turn, ":P|ID|SEQ",
+ * and the follower answers ":A|ID|SEQ" at once on the port the ping came from. Pings
+ * alternate between the two bus ports, their loss per port drives the port failover in
+ * busCtrl.h. For every follower LONG keeps a histogram of the
+ * round trip times, the share of pings lost over the last LINK_WINDOW pings and since boot,
+ * and the time since anything was last heard from it (answers, telemetry, clock pings).
+ * Only the followers that joined (see enumCtrl.h) or were heard from are pinged. A follower
+ * not heard from for LINK_SILENT_MS is reported silent: it is logged and LONG blinks its
+ * address on the LEDs, alternating with LINK_SILENT_CODE every LINK_BLINK_MS, which no other
+ * status uses, so any address up to 10 can be read.
+ *
+ * Followers note when they last heard LONG, any byte counts.
+ */
+
+#ifndef LINKCTRL_H
+#define LINKCTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+bool enumPresent(int address);
+void failoverLeaderHeard();
+
+#define LINK_PING_MS 500              // one follower pinged per period, each in turn
+#define LINK_PING_ASLEEP_MS 5000      // ping period while asleep, lets the followers idle
+#define LINK_TIMEOUT_MS 400           // an answer later than this counts as lost
+#define LINK_SILENT_MS 6000           // no contact for this long, the unit is silent
+#define LINK_WINDOW 32                // pings in the recent loss rate
+#define LINK_RTT_BUCKETS 7
+#define LINK_SILENT_CODE 12           // LED code alternating with the address of the first silent follower
+#define LINK_BLINK_MS 500
+
+const uint16_t linkRttLimits[LINK_RTT_BUCKETS - 1] = { 10, 20, 40, 80, 160, 320 };  // bucket upper bounds (ms)
+
+// link to one unit, as seen from here
+struct LinkPeer {
+  uint32_t lastContactMs;     // millis() of the last frame received
+  bool heard;                 // anything received since boot
+  bool silent;
+  uint16_t seq;               // last ping sent
+  uint32_t sentMs;
+  uint8_t port;               // bus port of the last ping
+  bool pending;               // waiting for the answer to seq
+  uint32_t pings;
+  uint32_t answers;
+  uint32_t lost;
+  uint32_t window;            // one bit per ping, set if lost, newest in bit 0
+  uint32_t rttHistogram[LINK_RTT_BUCKETS];
+  uint32_t lastRttMs;
+  uint32_t maxRttMs;
+  uint32_t totalRttMs;
+};
+
+LinkPeer linkPeers[FLEET_SIZE];       // indexed by player ID, 0 is LONG seen by a follower
+int linkNextPeer = 1;
+int linkNextPort = 0;
+uint32_t linkLastPingMs = 0;
+uint32_t linkAnswered = 0;            // followers: pings answered
+
+/**
+ * Notes a frame received from a unit
+ * @param playerId Sender
+ */
+void linkHeard(int playerId) {
+  if (playerId < 0 || playerId >= FLEET_SIZE) return;
+  LinkPeer &peer = linkPeers[playerId];
+  peer.lastContactMs = millis();
+  peer.heard = true;
+}
+
+/**
+ * @return True if anything was received from the unit since boot
+ */
+bool linkWasHeard(int playerId) {
+  return linkPeers[playerId].heard;
+}
+
+/**
+ * @return True if nothing was received from the unit for LINK_SILENT_MS
+ */
+bool linkSilent(int playerId) {
+  return millis() - linkPeers[playerId].lastContactMs > LINK_SILENT_MS;
+}
+
+/**
+ * @return Address of the first silent follower, 0 if none, LONG only
+ */
+int linkFirstSilent() {
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    if (linkPeers[i].silent) return i;
+  }
+  return 0;
+}
+
+/**
+ * @return LED code of a silent follower: LINK_SILENT_CODE then its address, in turn
+ */
+int linkSilentCode() {
+  return (millis() / LINK_BLINK_MS) % 2 == 0 ? LINK_SILENT_CODE : linkFirstSilent();
+}
+
+/*
+ * helper function closing a ping, answered or lost
+ */
+void linkClosePing(LinkPeer &peer, bool lost) {
+  peer.pending = false;
+  peer.window = (peer.window << 1) | (lost ? 1 : 0);
+  if (lost) peer.lost++;
+  busPingResult(peer.port, lost);
+}
+
+/*
+ * helper function logging silence changes, LONG only
+ */
+void linkCheckSilence(int playerId) {
+  LinkPeer &peer = linkPeers[playerId];
+  bool silent = linkSilent(playerId);
+  if (silent == peer.silent) return;
+
+  peer.silent = silent;
+  Serial.print("Link to unit ");
+  Serial.print(playerId);
+  Serial.println(silent ? " silent" : " back");
+  crashLog("unit %d %s", playerId, silent ? "silent" : "back");
+}
+
+/**
+ * Expires unanswered pings and pings the next follower, LONG only
+ * Run by the "link health" task every LINK_PING_MS
+ */
+void linkUpdate() {
+  uint32_t now = millis();
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    LinkPeer &peer = linkPeers[i];
+    if (peer.pending && now - peer.sentMs > LINK_TIMEOUT_MS) {
+      linkClosePing(peer, true);
+    }
+    if (enumPresent(i)) linkCheckSilence(i);
+  }
+
+  if (!powerTargetAwake && now - linkLastPingMs < LINK_PING_ASLEEP_MS) return;
+
+  //next follower present, every follower over one port, then over the other
+  int tried = 0;
+  while (!enumPresent(linkNextPeer) && tried++ < FLEET_SIZE) {
+    linkNextPeer = linkNextPeer % (FLEET_SIZE - 1) + 1;
+    if (linkNextPeer == 1) linkNextPort = (linkNextPort + 1) % BUS_PORTS;
+  }
+  if (!enumPresent(linkNextPeer)) return;  //no follower yet
+  linkLastPingMs = now;
+
+  LinkPeer &peer = linkPeers[linkNextPeer];
+  peer.seq++;
+  peer.sentMs = now;
+  peer.port = linkNextPort;
+  peer.pending = true;
+  peer.pings++;
+
+  char frame[24];
+  snprintf(frame, sizeof(frame), ":P|%d|%u", linkNextPeer, peer.seq);
+  busSend(linkNextPort, frame);
+
+  linkNextPeer = linkNextPeer % (FLEET_SIZE - 1) + 1;
+  if (linkNextPeer == 1) linkNextPort = (linkNextPort + 1) % BUS_PORTS;
+}
+
+/**
+ * Handles a ping or an answer received on the bus, quietly
+ * @param frame Frame without the leading ':'
+ * @param port Bus port it came from
+ * @return True if the frame was a ping or an answer
+ */
+bool linkReceive(char* frame, int port) {
+  int playerId;
+  unsigned seq;
+
+  if (strncmp(frame, "P|", 2) == 0) {
+    if (PLAYER_ID == 0 || sscanf(frame, "P|%d|%u", &playerId, &seq) != 2) return true;
+    failoverLeaderHeard();
+    if (playerId != PLAYER_ID) return true;  //ping for the other follower
+
+    char answer[24];
+    snprintf(answer, sizeof(answer), ":A|%d|%u", PLAYER_ID, seq);
+    busSend(port, answer);
+    linkAnswered++;
+    return true;
+  }
+
+  if (strncmp(frame, "A|", 2) != 0) return false;
+  if (PLAYER_ID != 0 || sscanf(frame, "A|%d|%u", &playerId, &seq) != 2) return true;
+  if (playerId <= 0 || playerId >= FLEET_SIZE) return true;
+
+  linkHeard(playerId);
+  LinkPeer &peer = linkPeers[playerId];
+  if (!peer.pending || seq != peer.seq || port != peer.port) return true;  //late answer, already counted as lost
+
+  uint32_t rttMs = millis() - peer.sentMs;
+  linkClosePing(peer, false);
+  peer.answers++;
+  peer.lastRttMs = rttMs;
+  peer.totalRttMs += rttMs;
+  if (rttMs > peer.maxRttMs) peer.maxRttMs = rttMs;
+
+  int bucket = 0;
+  while (bucket < LINK_RTT_BUCKETS - 1 && rttMs >= linkRttLimits[bucket]) bucket++;
+  peer.rttHistogram[bucket]++;
+  return true;
+}
+
+/**
+ * Registers the link health task on LONG, to be called once from setup
+ */
+void setupLink() {
+  if (PLAYER_ID != 0) return;
+  taskAdd("link health", linkUpdate, LINK_PING_MS, 3, 0, BOOT_LINK_GRACE);
+}
+
+/**
+ * Prints the link statistics to Serial
+ */
+void linkReport() {
+  Serial.println("\n-- LINK --");
+
+  if (PLAYER_ID != 0) {
+    Serial.print("LONG Last Heard ");
+    if (linkPeers[0].heard) {
+      Serial.print(millis() - linkPeers[0].lastContactMs);
+      Serial.println(" ms ago");
+    } else {
+      Serial.println("never");
+    }
+    Serial.print("Pings Answered ");
+    Serial.println(linkAnswered);
+    return;
+  }
+
+  Serial.println("  id state  contact   pings  answers  loss32  lossAll  rttLast  rttAvg  rttMax");
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    if (!enumPresent(i)) continue;
+    const LinkPeer &peer = linkPeers[i];
+    int recent = min(peer.pings, (uint32_t)LINK_WINDOW);
+    int recentLost = __builtin_popcount(recent < 32 ? peer.window & ((1UL << recent) - 1) : peer.window);
+    Serial.printf("  %d  %-6s ", i, peer.silent ? "SILENT" : "OK");
+    if (peer.heard) {
+      Serial.printf("%6lus ", (unsigned long)((millis() - peer.lastContactMs) / 1000));
+    } else {
+      Serial.print("  never ");
+    }
+    Serial.printf("%7lu %8lu %6d%% %7d%% %6lums %5lums %5lums\n",
+                  (unsigned long)peer.pings, (unsigned long)peer.answers,
+                  recent ? recentLost * 100 / recent : 0,
+                  peer.pings ? (int)(peer.lost * 100 / peer.pings) : 0,
+                  (unsigned long)peer.lastRttMs,
+                  (unsigned long)(peer.answers ? peer.totalRttMs / peer.answers : 0),
+                  (unsigned long)peer.maxRttMs);
+  }
+
+  Serial.print("Round trip histogram (ms)   ");
+  for (int b = 0; b < LINK_RTT_BUCKETS - 1; b++) {
+    Serial.printf(" <%-5u", linkRttLimits[b]);
+  }
+  Serial.printf(" >=%u\n", linkRttLimits[LINK_RTT_BUCKETS - 2]);
+  for (int i = 1; i < FLEET_SIZE; i++) {
+    if (!enumPresent(i)) continue;
+    Serial.printf("  %d                         ", i);
+    for (int b = 0; b < LINK_RTT_BUCKETS; b++) {
+      Serial.printf(" %6lu", (unsigned long)linkPeers[i].rttHistogram[b]);
+    }
+    Serial.println();
+  }
+}
+
+#endif // LINKCTRL_H
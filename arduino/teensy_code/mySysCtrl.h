@@ -12,7 +12,7 @@
 #include <RTClib.h>
 
 // External references to variables defined in the main program
-extern int PLAYER_ID;            // Current player ID (0=LONG, 1=SMALL, 2=SEASHELL)
+extern int PLAYER_ID;            // Current player ID (0=LONG, 1=SMALL, 2=SEASHELL, up to 10, ENUM_NONE)
 extern char FILE_NAME[];         // Current audio file name
 extern bool systemAwake;         // System active state
 extern bool playbackStatus;      // Audio playback state
@@ -33,14 +33,9 @@ extern const int SEASHELL_PIN;   // Pin for SEASHELL player identification
 extern const int LONG_PIN;       // Pin for LONG player identification
 
 // External constant references
-extern const char SM_STR[];      // File name for SMALL player
-extern const char SS_STR[];      // File name for SEASHELL player
-extern const char LO_STR[];      // File name for LONG player
 extern const int START_HOUR;     // Daily wake-up hour
 extern const int END_HOUR;       // Daily sleep hour
-extern const bool PEAK_MODE;     // Audio peak vs RMS mode
 extern const char days[][12];    // Weekday names array
-extern const int REL_SW_DELAY;   // Delay between relay switching operations
 
 // External references for system report
 extern const int SDCARD_CS_PIN;
@@ -58,9 +53,6 @@ extern const uint8_t LED_ARRAY[];
 extern float audioVolume;
 extern int rangePWM;
 extern int currentCode;
-extern const int STARTUP_DELAY;
-extern int pwmFreq;
-const int CHECK_INTERVAL = 60000;
 
 #define CMD_LED_1 '1'  // LED 1 control
 #define CMD_LED_2 '2'  // LED 2 control
@@ -79,10 +71,14 @@ const int CHECK_INTERVAL = 60000;
 #define CMD_PWM_DOWN '<' // Decrease PWM range
 #define CMD_REBOOT 'B'  // Reboot system
 #define CMD_KNOB_CTRL 'K' //toggles extern analog mode
+#define CMD_TRACE 'T'   // Dump event trace buffer
+
+int scheduleTask = TASK_NONE;     // one-shot task armed for the next calendar event
 
 /*
  * Identifies player type and sets configuration
- * Sets PLAYER_ID (0=LONG, 1=SMALL, 2=SEASHELL) and audio file
+ * Sets PLAYER_ID (0=LONG, 1=SMALL, 2=SEASHELL, otherwise the address kept from the last run,
+ * confirmed or changed by LONG, see enumCtrl.h) and audio file
  */
 void setupPlayerID() {
   pinMode(SMALL_PIN, INPUT);
@@ -96,30 +92,87 @@ void setupPlayerID() {
     PLAYER_ID = 1;
   } else if (digitalRead(SEASHELL_PIN) == HIGH) {
     PLAYER_ID = 2;
+  } else {
+    PLAYER_ID = enumSavedAddress();
   }
 
   Serial.print("Player ID is  ");
   Serial.println(PLAYER_ID);
 
-  //match file name according to player ID
-  if (PLAYER_ID == 0) {
-    strcpy(FILE_NAME, LO_STR);
-  } else if (PLAYER_ID == 1) {
-    strcpy(FILE_NAME, SM_STR);
-  } else if (PLAYER_ID == 2) {
-    strcpy(FILE_NAME, SS_STR);
-  }
+  //match file name according to player ID, CONFIG.INI may change it once the SD card is up
+  strcpy(FILE_NAME, configTrackName());
 
   Serial.print("Audio file setup ");
   Serial.println(FILE_NAME);
 }
 
+#define RTC_RETRY_MS 60000     // a missing RTC is looked for again this often
+
+bool rtcReady = false;          // the RTC answered with a valid time, set by setupRTC()
+bool rtcLostLogged = false;
+uint32_t rtcProbeMs = 0;
+
+/*
+ * helper function looking for a missing RTC every RTC_RETRY_MS, LONG only
+ * A late RTC that lost power is not used, its time is unknown until set over USB at boot
+ */
+bool rtcProbe() {
+  if (rtcReady) return true;
+  if (millis() - rtcProbeMs < RTC_RETRY_MS) return false;
+  rtcProbeMs = millis();
+
+  watchdogBegin(WDT_ACT_RTC);
+  bool found = rtc.begin();
+  bool lostPower = found && rtc.lostPower();
+  watchdogEnd();
+  if (!found) return false;
+
+  if (lostPower) {
+    if (!rtcLostLogged) {
+      Serial.println("RTC lost power, connect USB and reboot to set its time");
+      crashLog("rtc lost power");
+      rtcLostLogged = true;
+    }
+    return false;
+  }
+
+  Serial.println("RTC found");
+  crashLog("rtc found");
+  rtcReady = true;
+  return true;
+}
+
+/**
+ * Reads the current date/time from the RTC over I2C, traced as it can stall the loop
+ * @return Current RTC date/time, 2000/01/01 while no RTC answers, check rtcProbe() first
+ */
+DateTime rtcNow() {
+  if (!rtcProbe()) return DateTime();
+  TRACE_SCOPE(TRACE_RTC_NOW);
+
+  watchdogBegin(WDT_ACT_RTC);
+  DateTime now = rtc.now();
+  uint32_t readMs = watchdogEnd();
+
+  //slow or garbage read, a slave is likely holding the bus
+  if (readMs > WDT_RTC_MAX_MS || !now.isValid()) {
+    watchdogRecovered(WDT_REASON_RTC);
+    watchdogI2cRecover();
+    now = rtc.now();
+  }
+  return now;
+}
+
 /**
  * Prints current date/time from RTC to Serial
  * Format: YYYY/MM/DD (DayName) HH:MM:SS
  */
 void clockMe() {
-  DateTime input = rtc.now();
+  if (!rtcReady) {
+    Serial.println("unknown, no RTC");
+    return;
+  }
+  DateTime input = rtcNow();
   Serial.print(input.year(), DEC);
   Serial.print('/');
   Serial.print(input.month(), DEC);
@@ -166,6 +219,8 @@ String formatTimeToMinutesSecondsMs(unsigned long ms) {
  * @param player The player ID for the report
  */
 void systemReport(int player) {
+  TRACE_SCOPE(TRACE_REPORT);
+
   //header
   Serial.println("\n----- SYSTEM REPORT -----");
   if (PLAYER_ID == 0){
@@ -252,7 +307,7 @@ void systemReport(int player) {
   //Serial.print("Audio Memory ");
   //Serial.println(audioMemory);
   Serial.print("Startup Delay ");
-  Serial.print(STARTUP_DELAY);
+  Serial.print(settings.startupDelay);
   Serial.println(" ms");
   Serial.print("Track Iteration ");
   Serial.println(trackIteration);
@@ -260,59 +315,90 @@ void systemReport(int player) {
   Serial.println(START_HOUR);
   Serial.print("End Hour ");
   Serial.println(END_HOUR);
-  Serial.print("PWM Frequency ");
-  Serial.print(pwmFreq);
-  Serial.println(" Hz");
+  Serial.print("PWM Period ");
+  Serial.print(settings.pwmFreq);
+  Serial.println(" ms");
 
   // System state
   Serial.println("\n-- SYSTEM STATES --");
   Serial.print("System Awake ");
   Serial.println(systemAwake ? "YES" : "NO");
+  Serial.print("Power Phase ");
+  Serial.println(powerPhaseName());
   Serial.print("Playback Status ");
   Serial.println(playbackStatus ? "PLAYING" : "STOPPED");
   Serial.print("Peak Mode ");
-  Serial.println(PEAK_MODE ? "ENABLED" : "DISABLED");
+  Serial.println(settings.peakMode ? "ENABLED" : "DISABLED");
 
-  Serial.println("\n----- END REPORT -----\n");
-}
+  // Boot stages of the current run
+  bootReport();
 
-/**
- * Powers on amplifier then speaker with delay, wakes system up
- */
-void startupSequence() {
-  //startup only if system is asleep
-  if (!systemAwake){
-    digitalWrite(REL_1, HIGH);  //turns amp on
-    Serial.println("amp is ON");
-    delay(REL_SW_DELAY);
-    digitalWrite(REL_2, HIGH);  //turns speaker on
-    Serial.println("speaker is ON");
-    delay(REL_SW_DELAY);
-
-    systemAwake = true; //system wakeup
-    trackIteration = 0; //reset daily track count
-  }
-}
+  // Watchdog and local recoveries
+  watchdogReport();
 
-/**
- * Powers off speaker then amplifier with delay, puts system to sleep
- */
-void shutDownSequence() {
-  //shutdown only if system is awake
-  if (systemAwake){
-    //stop any audio or light
-    wavPlayer.stop();
-    analogWrite(PWM_PIN, 0);  // Set PWM to zero
-
-    digitalWrite(REL_2, LOW);  //turns speaker off
-    Serial.println("speaker is OFF");
-    delay(REL_SW_DELAY);
-    digitalWrite(REL_1, LOW);  //turns amp off
-    Serial.println("amp is OFF");
-    delay(REL_SW_DELAY);
-
-    systemAwake = false; //puts system asleep
+  // Resets, crashes and log kept across resets
+  crashReport();
+
+  // Telemetry of all units, from the cache on LONG
+  fleetReport();
+
+  // Wall clock distributed by LONG
+  clockReport();
+
+  // State replicated from LONG
+  stateReport();
+
+  // Serial link health
+  linkReport();
+
+  // Redundant bus ports
+  busReport();
+
+  // Unit addresses
+  enumReport();
+
+  // Leader role and takeovers
+  failoverReport();
+
+  // Staged volume and PWM changes
+  paramReport();
+
+  // Software gain and codec volume
+  gainReport();
+
+  // Audio processor profile
+  dapReport();
+
+  // Cue clips in RAM
+  cueReport();
+
+  // Ambient beds streamed from SD
+  streamReport();
+
+  // Volume knob, LONG only
+  if (PLAYER_ID == 0) knobReport();
+
+  // SD card health
+  sdReport();
+
+  // SD card configuration
+  configReport();
+
+  // Show calendar
+  if (PLAYER_ID == 0) {
+    calendarReport();
   }
+
+  // Scheduler statistics
+  schedulerReport();
+
+  // Low power idle measurements
+  idleReport();
+
+  // Settings saved in EEPROM
+  persistReport();
+
+  Serial.println("\n----- END REPORT -----\n");
 }
 
 /**
@@ -320,8 +406,20 @@ void shutDownSequence() {
  * Increments trackIteration and sets playbackStatus
  */
 void playAudio() {
-  wavPlayer.play(FILE_NAME);
+  TRACE_SCOPE(TRACE_PLAY);
+
+  //no address yet, so no track either
+  if (PLAYER_ID >= FLEET_SIZE) return;
+
+  if (!sdReady || !wavPlayer.play(FILE_NAME)) {
+    Serial.print("Unable to play ");
+    Serial.println(FILE_NAME);
+    sdPlayFailed();
+    return;
+  }
   delay(50); //debounce
+  bootMark("playing");
+  stateTrackStarted();
   trackIteration += 1;
   playbackStatus = true;
   
@@ -343,86 +441,60 @@ void playAudio() {
 }
 
 /**
- * Sends formatted single character commands via Serial3
+ * Sends formatted single character commands on the serial bus
  * @param command Character command to send
  */
 void sendSerialCommand(char command) {
+  TRACE_SCOPE_ARG(TRACE_SERIAL_CMD, command);
+
   //Send command
-  Serial3.write(command);
+  busOut.write(command);
 
   //print command on usb monitor
   Serial.print("Command '");
   Serial.print(command);
-  Serial.println("' was sent on Serial3");
+  Serial.println("' was sent on the bus");
 
   delay(50); //debounce
 }
 
 void sendSerialMessage(char* message){
-  Serial3.write(":"); //means a message (string) is incoming
-  Serial3.write(message);
+  TRACE_SCOPE_ARG(TRACE_SERIAL_MSG, strlen(message));
+
+  busOut.write(":"); //means a message (string) is incoming
+  busOut.println(message);  //ended, a frame sent right after is not read as part of it
 
   Serial.print("Message '");
   Serial.print(message);
-  Serial.println("' was sent on Serial3");
+  Serial.println("' was sent on the bus");
   delay(50); //debounce
 }
 
 /**
  * Reads the analog volume control pin and updates audio volume in 10 discrete steps.
- * Volume is quantized to 0.0, 0.1, 0.2, ... 1.0 only.
- * Rate-limited to prevent flooding the serial connection.
+ * Volume is quantized to 0.0, 0.1, 0.2, ... 1.0 only, the latest step is staged on all
+ * units at a bounded rate (see knobCtrl.h).
+ * Called every 50ms by the "knob" task.
  */
 void volumeControl() {
-  //static variables for updates timing
-  static unsigned long lastUpdateTime = 0;
-  static unsigned long lastSendTime = 0;
-  static float lastSentValue = -1.0; // Initialize to impossible value
-  
-  //Limit updates to once every 50ms
-  unsigned long currentTime = millis();
-  if (currentTime - lastUpdateTime < 50) {
-    return;
-  }
-  lastUpdateTime = currentTime;
-  
-  // store analog value (0-1023 analog range mapped to 0.0-1.0)
-  float rawValue = analogRead(VOL_CTRL_PIN) / 1024.0;
-  
-  // Quantize to 10 discrete steps (0.0, 0.1, 0.2, ... 1.0)
-  float quantizedValue = round(rawValue * 10.0) / 10.0;
-  
-  // Only update if the quantized value is different from current volume
-  if (quantizedValue != audioVolume) {
-    //set and update
-    audioVolume = quantizedValue;
-    sgtl5000.volume(audioVolume);
-    
-    //print
-    Serial.print("Volume set to ");
-    Serial.println(audioVolume);
-    
-    //Forward volume to other players,  rate limit to once per 500ms
-    if (PLAYER_ID == 0 && 
-        (currentTime - lastSendTime > 500 || quantizedValue != lastSentValue)) {
-      
-      char volumeMsg[20];
-      snprintf(volumeMsg, sizeof(volumeMsg), "volume %.1f", audioVolume);
-      sendSerialMessage(volumeMsg);
-      
-      lastSendTime = currentTime;
-      lastSentValue = quantizedValue;
-    }
-  }
+  if (!knobSample()) return;
+
+  int step = knobTake();
+  if (step < 0) return;  //sent on a later check, unless a newer step replaces it
+
+  //staged on all units, see paramCtrl.h
+  paramChange(step / (float)KNOB_STEPS, paramPwm());
+  Serial.print("Volume set to ");
+  Serial.println(paramVolume());
 }
 
 /**
- * Sends status information back to the leader via Serial3
+ * Sends status information back to the leader on the serial bus
  * Only used by followers (PLAYER_ID != 0)
  */
 void sendStatusToLeader() {
-  // Only followers should send status
-  if (PLAYER_ID != 0){
+  // Only followers with an address should send status
+  if (PLAYER_ID != 0 && PLAYER_ID < FLEET_SIZE){
     //init empty msg
     char statusMsg[MSG_BUFFER_SIZE];
     
@@ -437,49 +509,108 @@ void sendStatusToLeader() {
       lengthMs = wavPlayer.lengthMillis();
     }
     
-    // Format the status message - :STATUS|PLAYERID|TEMP|AWAKE|PLAYING|POS|LEN
+    // Reset summary - RESETS|CAUSE|WDT|ADDR|UPTIME
+    char crashSummary[64];
+    crashFormatSummary(crashSummary, sizeof(crashSummary));
+
+    // Format the status message - :STATUS|PLAYERID|TEMP|AWAKE|PLAYING|POS|LEN|PHASE|SDOK|SDERR|SDMAXMS|<reset summary>
     //this format will be intepreted by player 0
-    snprintf(statusMsg, MSG_BUFFER_SIZE, ":STATUS|%d|%.1f|%d|%d|%lu|%lu", 
+    snprintf(statusMsg, MSG_BUFFER_SIZE, ":STATUS|%d|%.1f|%d|%d|%lu|%lu|%d|%d|%lu|%lu|%s", 
             PLAYER_ID,              // Player ID
             temp,                   // CPU temperature
             systemAwake ? 1 : 0,    // System awake status
             playbackStatus ? 1 : 0, // Playback status
             positionMs,             // Current position in ms
-            lengthMs                // Total length in ms
+            lengthMs,               // Total length in ms
+            powerPhase,             // Power sequencing phase
+            sdReady ? 1 : 0,        // SD card state
+            sdErrors,               // SD faults since boot
+            sdMaxRecoveryMs,        // Longest SD recovery
+            crashSummary            // Resets and crashes
           );
     
     // Send the status message to leader
-    Serial3.println(statusMsg);
+    busOut.println(statusMsg);
     Serial.print("Sent status to leader: ");
     Serial.println(statusMsg);
   }
 }
 
+/**
+ * Handles a status request for one follower (":status N", ":small", ":seashell")
+ * Only the addressed follower answers, the others stay quiet, so no reply trick is needed
+ * @param address Follower address
+ * @return True, the request is always handled
+ */
+bool requestStatus(int address) {
+  if (PLAYER_ID == 0) {
+    // Cached telemetry right away, the full status follows from the follower
+    fleetPrintUnit(address);
+  } else if (PLAYER_ID == address) {
+    Serial.print("Report command for unit ");
+    Serial.print(address);
+    Serial.println(" received via message");
+    delay(10);
+    sendStatusToLeader();
+  }
+  return true;
+}
+
+int rebootTask = TASK_NONE;     // one-shot task performing the reset
+bool rebootPending = false;     // reboot code is displayed while waiting
+
+/**
+ * Resets the Teensy, run by the "reboot" one-shot task
+ */
+void rebootNow() {
+  Serial.println("Rebooting now");
+  crashLog("reboot");
+  Serial.flush();
+  SCB_AIRCR = 0x05FA0004;
+}
+
 /**
  * Schedules a system reboot
  * This function is called when a reboot command is received
+ * The relays are shut down and the reset happens STARTUP_DELAY later, without blocking the loop
  */
 void scheduledReboot() {
+  if (rebootPending) return;
+
   // Log reboot event
-  Serial.println("Performing scheduled system reboot. System will reboot in 10s.");
+  Serial.print("Performing scheduled system reboot. System will reboot in ");
+  Serial.print(settings.startupDelay / 1000);
+  Serial.println("s.");
 
   //forward reboot command to followers
   if (PLAYER_ID == 0){
     sendSerialCommand(CMD_REBOOT);
-    delay(50); //debounce
   }
   
-  // if system is awake shut it down
-  if (systemAwake) {
-    shutDownSequence();
-  }
+  // shut the relays down, the sequence completes well before the reset
+  shutDownSequence();
 
-  //display reboot code and wait 5sec
+  //display reboot code until the reset
+  rebootPending = true;
   displayBinaryCode(7);
-  delay(STARTUP_DELAY);
-  
-  //reboot
-  SCB_AIRCR = 0x05FA0004;
+  taskRunIn(rebootTask, settings.startupDelay);
+}
+
+/*
+ * helper function telling if a command changes volume or PWM range, those are staged rather than relayed
+ */
+bool isParamCommand(char cmd) {
+  return cmd == CMD_VOL_UP || cmd == CMD_VOL_DOWN || cmd == CMD_PWM_UP || cmd == CMD_PWM_DOWN;
+}
+
+/*
+ * helper function telling if a message changes volume or PWM range
+ * @content: message without the leading ':'
+ */
+bool isParamMessage(const char* content) {
+  return strcmp(content, "volup") == 0 || strcmp(content, "voldown") == 0 ||
+         strncmp(content, "volume ", 7) == 0 || strcmp(content, "pwmup") == 0 ||
+         strcmp(content, "pwmdown") == 0;
 }
 
 /**
@@ -488,6 +619,7 @@ void scheduledReboot() {
  * @return True if command processed successfully
  */
 bool processCommand(char cmd) {
+  crashLog("cmd %c", cmd);
   switch(cmd) {
     case CMD_HELP:
       Serial.println("\n----- AVAILABLE COMMANDS -----");
@@ -506,6 +638,9 @@ bool processCommand(char cmd) {
       Serial.println("> - :pwmup    || Increase PWM range");
       Serial.println("< - :pwmdown  || Decrease PWM range");
       Serial.println("1-4 - :ledx   || Toggle individual LEDs");
+      Serial.println("T - :trace    || Dump event trace buffer");
+      Serial.println(":reload       || Reload CONFIG.INI and the cues from the SD card");
+      Serial.println(":cue n        || Play cue n (CUEn.WAV) from RAM");
       Serial.println("------------------------------\n");
       return true;
       
@@ -515,17 +650,15 @@ bool processCommand(char cmd) {
       return true;
       
     case CMD_WAKEUP:
-      if (!systemAwake) {
-        startupSequence();
-        Serial.println("System woken up");
-      }
+      startupSequence();
+      Serial.print("System waking up, power phase ");
+      Serial.println(powerPhaseName());
       return true;
       
     case CMD_SLEEP:
-      if (systemAwake) {
-        shutDownSequence();
-        Serial.println("System going to sleep");
-      }
+      shutDownSequence();
+      Serial.print("System going to sleep, power phase ");
+      Serial.println(powerPhaseName());
       return true;
     
     case CMD_REBOOT:
@@ -545,37 +678,37 @@ bool processCommand(char cmd) {
       
     case CMD_STOP:
       wavPlayer.stop();
+      stateStopped();
       Serial.println("Stopping audio");
       return true;
       
+    //volume and PWM range changes are staged on all units, see paramCtrl.h
     case CMD_VOL_UP:
-      audioVolume += 0.1f;
-      if (audioVolume > 1.0f) audioVolume = 1.0f;
-      sgtl5000.volume(audioVolume);
+      paramChange(paramVolume() + 0.1f, paramPwm());
       Serial.print("Volume increased to ");
-      Serial.println(audioVolume);
+      Serial.println(paramVolume());
       return true;
       
     case CMD_VOL_DOWN:
-      audioVolume -= 0.1f;
-      if (audioVolume < 0.0f) audioVolume = 0.0f;
-      sgtl5000.volume(audioVolume);
+      paramChange(paramVolume() - 0.1f, paramPwm());
       Serial.print("Volume decreased to ");
-      Serial.println(audioVolume);
+      Serial.println(paramVolume());
       return true;
       
     case CMD_PWM_UP:
-      rangePWM += 25;
-      if (rangePWM > 255) rangePWM = 255;
+      paramChange(paramVolume(), paramPwm() + 25);
       Serial.print("PWM range increased to ");
-      Serial.println(rangePWM);
+      Serial.println(paramPwm());
       return true;
       
     case CMD_PWM_DOWN:
-      rangePWM -= 25;
-      if (rangePWM < 0) rangePWM = 0;
+      paramChange(paramVolume(), paramPwm() - 25);
       Serial.print("PWM range decreased to ");
-      Serial.println(rangePWM);
+      Serial.println(paramPwm());
+      return true;
+
+    case CMD_TRACE:
+      traceDump();
       return true;
 
     case CMD_KNOB_CTRL:
@@ -586,6 +719,7 @@ bool processCommand(char cmd) {
         knobCtrl = true;
         Serial.print("Volume control via analog potentiometer.");
       }
+      persistMarkDirty();
       return true;
       
     case CMD_LED_1: {
@@ -655,37 +789,29 @@ bool processMessage(char* msg) {
     processCommand(CMD_REPORT);
     return true;
   }
-
-  else if (strcmp(content, "seashell") == 0) {
-    if (PLAYER_ID == 2) {
-      // This player (seashell) should respond
-      Serial.println("Report command for seashell received via message");
-      delay(10);
-      sendStatusToLeader();
-      return true;
-    } else if (PLAYER_ID == 1) {
-      // This player (small) should not respond - temporarily disable Serial3
-      Serial3.end();  // Disable the serial port
-      delay(250);     // Give time for the other player to respond
-      Serial3.begin(9600);  // Re-enable with same baud rate
-      return true;
-    }
+  // Configuration reload, forwarded to the followers when typed on LONG
+  else if (strcmp(content, "reload") == 0) {
+    Serial.println("Reload command received via message");
+    cueReload();
+    return configLoad();
+  }
+  // Cue from the bank in RAM, forwarded to the followers when typed on LONG
+  else if (strncmp(content, "cue ", 4) == 0) {
+    return cueTrigger(atoi(content + 4));
+  }
+  // Trace dump command
+  else if (strcmp(content, "trace") == 0) {
+    Serial.println("Trace command received via message");
+    processCommand(CMD_TRACE);
+    return true;
   }
 
-  else if (strcmp(content, "small") == 0) {
-    if (PLAYER_ID == 1) {
-      // This player (small) should respond
-      Serial.println("Report command for small received via message");
-      delay(10);
-      sendStatusToLeader();
-      return true;
-    } else if (PLAYER_ID == 2) {
-      // This player (seashell) should not respond - temporarily disable Serial3
-      Serial3.end();  // Disable the serial port
-      delay(250);     // Give time for the other player to respond
-      Serial3.begin(9600);  // Re-enable with same baud rate
-      return true;
-    }
+  // Status of one follower, by address or by name
+  else if (strncmp(content, "status ", 7) == 0 || strcmp(content, "small") == 0 ||
+           strcmp(content, "seashell") == 0) {
+    int address = strcmp(content, "small") == 0 ? 1 : strcmp(content, "seashell") == 0 ? 2 : atoi(content + 7);
+    if (address <= 0 || address >= FLEET_SIZE) return false;
+    return requestStatus(address);
   }
 
   else if (strncmp(content, "STATUS|", 7) == 0) {
@@ -733,6 +859,43 @@ bool processMessage(char* msg) {
                   Serial.print(" / ");
                   Serial.println(formatTimeToMinutesSecondsMs(followerLength));
                 }
+
+                token = strtok(NULL, "|");
+                if (token != NULL) {
+                  int followerPhase = atoi(token);
+                  if (followerPhase >= PWR_ASLEEP && followerPhase <= PWR_AMP_OFF) {
+                    Serial.print("Power Phase: ");
+                    Serial.println(powerPhaseNames[followerPhase]);
+                  }
+
+                  token = strtok(NULL, "|");
+                  if (token != NULL) {
+                    bool followerSdReady = (atoi(token) == 1);
+                    char* errorsToken = strtok(NULL, "|");
+                    char* recoveryToken = strtok(NULL, "|");
+                    Serial.print("SD Card: ");
+                    Serial.print(followerSdReady ? "OK" : "FAULT");
+                    if (errorsToken != NULL && recoveryToken != NULL) {
+                      Serial.print(", ");
+                      Serial.print(strtoul(errorsToken, NULL, 10));
+                      Serial.print(" errors, max recovery ");
+                      Serial.print(strtoul(recoveryToken, NULL, 10));
+                      Serial.print(" ms");
+                    }
+                    Serial.println();
+
+                    //reset summary, kept in the fleet table and shown in the report
+                    char* crashToken = strtok(NULL, "");
+                    crashParseSummary(followerId, crashToken);
+                    if (crashToken != NULL && followerId >= 0 && followerId < FLEET_SIZE) {
+                      Serial.print("Last Reset: ");
+                      Serial.print(resetCauseNames[crashFleet[followerId].cause]);
+                      Serial.print(", ");
+                      Serial.print(crashFleet[followerId].resets);
+                      Serial.println(" since power on");
+                    }
+                  }
+                }
               }
             }
           }
@@ -792,10 +955,9 @@ bool processMessage(char* msg) {
     
     // Validate and apply volume
     if (newVolume >= 0.0 && newVolume <= 1.0) {
-      audioVolume = newVolume;
-      sgtl5000.volume(audioVolume);
+      paramChange(newVolume, paramPwm());
       Serial.print("Volume adjusted to ");
-      Serial.println(audioVolume);
+      Serial.println(paramVolume());
       return true;
     } else {
       Serial.print("Invalid volume value: ");
@@ -849,27 +1011,34 @@ bool processMessage(char* msg) {
 }
 
 /**
- * Receives and processes messages from Serial3 (from the leader)
+ * Receives and processes messages from one port of the serial bus
+ * @param port Bus port with a ':' waiting
  */
-void receiveSerialMessage() {
+void receiveSerialMessage(int port) {
+  TRACE_SCOPE(TRACE_SERIAL_RX);
+  HardwareSerial &link = busSerial(port);
+
   // Clear the message buffer
   memset(messageBuffer, 0, MSG_BUFFER_SIZE);
   
   int index = 0;
   
+  watchdogBegin(WDT_ACT_PARSER);
+
   // Read the ':' character
-  messageBuffer[index++] = (char)Serial3.read();
+  messageBuffer[index++] = (char)link.read();
   
   // Wait a bit for more data to arrive
   delay(5);
   
   // Read until end of message or buffer is full
   bool messageComplete = false;
+  bool messageEnded = false;  //ended by its terminator, not cut by the timeout or the buffer
   unsigned long startTime = millis();
   
   while (!messageComplete && index < MSG_BUFFER_SIZE - 1) {
-    if (Serial3.available()) {
-      char c = (char)Serial3.read();
+    if (link.available()) {
+      char c = (char)link.read();
       
       // Message is considered ended if a new line, carriage return, or semicolon is read
       if (c == '\n' || c == '\r' || c == ';') {
@@ -878,6 +1047,7 @@ void receiveSerialMessage() {
           messageBuffer[index++] = c;
         }
         messageComplete = true;
+        messageEnded = true;
       } else {
         // Add character to buffer
         messageBuffer[index++] = c;
@@ -893,7 +1063,33 @@ void receiveSerialMessage() {
   
   // Null-terminate the string
   messageBuffer[index] = '\0';
+
+  //a stream that never ends a message, drop it and start clean
+  if (watchdogEnd() > WDT_PARSER_MAX_MS) {
+    while (link.available()) {
+      link.read();
+    }
+    busReceived(port, index, false);
+    watchdogRecovered(WDT_REASON_PARSER);
+    return;
+  }
+
+  // The same message arrives on both ports, the second copy is dropped
+  busReceived(port, index, messageEnded);
+  if (busDuplicate(port, messageBuffer, index)) {
+    return;
+  }
   
+  // Telemetry and clock frames are handled quietly, every few seconds they would flood the monitor
+  if (PLAYER_ID == 0 && strncmp(messageBuffer, ":T|", 3) == 0) {
+    fleetReceive(messageBuffer + 1);
+    return;
+  }
+  if (linkReceive(messageBuffer + 1, port) || clockReceive(messageBuffer + 1) || stateReceive(messageBuffer + 1) ||
+      enumReceive(messageBuffer + 1) || failoverReceive(messageBuffer + 1) || paramReceive(messageBuffer + 1)) {
+    return;
+  }
+
   // Only process message if it has content
   if (index > 1) {
     // Print received message
@@ -910,6 +1106,7 @@ void receiveSerialMessage() {
  * @return True if command was processed
  */
 bool checkUsbCommands() {
+  TRACE_SCOPE(TRACE_USB_RX);
   bool commandProcessed = false;
   
   if (Serial.available() > 0) {
@@ -923,8 +1120,8 @@ bool checkUsbCommands() {
       Serial.print(inChar);
       Serial.println("'");
 
-      // If this is the leader, relay the command to followers
-      if (PLAYER_ID == 0) {
+      // If this is the leader, relay the command to followers, parameter changes are staged instead
+      if (PLAYER_ID == 0 && !isParamCommand(inChar)) {
         sendSerialCommand(inChar);
       }
       
@@ -947,6 +1144,7 @@ bool checkUsbCommands() {
         case CMD_PWM_UP:
         case CMD_PWM_DOWN:
         case CMD_KNOB_CTRL:
+        case CMD_TRACE:
           // Valid command - process it
           commandProcessed = processCommand(inChar);
           break;
@@ -974,6 +1172,7 @@ bool checkUsbCommands() {
  * @return True if message was processed
  */
 bool checkUsbMessages() {
+  TRACE_SCOPE(TRACE_USB_RX);
   memset(messageBuffer, 0, MSG_BUFFER_SIZE);
   bool messageProcessed = false;
 
@@ -1028,87 +1227,153 @@ bool checkUsbMessages() {
   Serial.println(messageBuffer);
   processMessage(messageBuffer);
   
-  // If this is the leader player and we have a valid message, forward it
-  if (PLAYER_ID == 0 && index > 1) {
+  // If this is the leader player and we have a valid message, forward it, parameter changes are staged instead
+  if (PLAYER_ID == 0 && index > 1 && !isParamMessage(messageBuffer + 1)) {
     // Use a single print statement to avoid formatting issues
     Serial.print("Message '");
     Serial.print(messageBuffer);
-    Serial.println("' was sent on Serial3");
+    Serial.println("' was sent on the bus");
     
-    // Actually send the message
-    Serial3.print(messageBuffer);
+    // Actually send the message, ended so a frame sent right after is not read as part of it
+    busOut.println(messageBuffer);
   }
   
   messageProcessed = true;
   return messageProcessed;
 }
 
+/*
+ * helper function reading the schedule time: the RTC on LONG, the distributed clock on an acting leader
+ */
+DateTime scheduleNow() {
+  return PLAYER_ID == 0 ? rtcNow() : clockDateTime();
+}
+
+/*
+ * helper function to arm the scheduler task and the DS3231 alarm 1 for the next calendar event
+ * @now: current RTC time
+ */
+void scheduleArm(const DateTime &now) {
+  const CalendarEvent &next = calendarNext();
+
+  //millis deadline derived from this RTC read, re-checked against the RTC when it fires
+  taskRunIn(scheduleTask, (next.time - now.unixtime()) * 1000UL);
+
+  //hardware alarm wakes LONG from low power idle at the same time, an acting leader has no RTC
+  if (PLAYER_ID == 0 && rtcReady) {
+    rtc.clearAlarm(1);
+    rtc.writeSqwPinMode(DS3231_OFF);  // INT/SQW pin used for alarms
+    rtc.setAlarm1(DateTime(next.time), DS3231_A1_Date);
+    rtcAlarmFired = false;
+  }
+
+  Serial.print("Next event ");
+  Serial.print(calendarActionNames[next.action]);
+  Serial.print(" in ");
+  Serial.print((next.time - now.unixtime()) / 60);
+  Serial.println(" min");
+}
+
 /**
- * Updates system state based on time of day
- * For LONG player, manages wake/sleep state based on configured hours
- * For SMALL and SEASHELL, it only controls playback status
+ * Applies the calendar and arms the next event, LONG player or acting leader only
+ * Run by the "schedule" one-shot task: once at startup, then at each event time
+ * Reads the RTC once per event instead of polling it
  */
-void statusUpdates() {
-  //check static variables
-  static unsigned long lastCheck = 0;
-  static bool lastActiveState = false;
-  static bool initialCheckDone = false;
-  
-  // check first 5 seconds after setup, then every minute
-  unsigned long checkInterval = initialCheckDone ? CHECK_INTERVAL : STARTUP_DELAY;
-  
-  //if current time minus last check time is greater than interval, it's time to check status
-  if (PLAYER_ID == 0 && (millis() - lastCheck > checkInterval)) {
-    lastCheck = millis();
-    initialCheckDone = true;
-    DateTime now = rtc.now();
-    int currentHour = now.hour();
-
-    /*   
-    Serial.print("Time check: ");
-    Serial.print(currentHour);
-    Serial.print(":");
-    Serial.print(now.minute());
-    Serial.print(" - Active hours: ");
-    Serial.print(START_HOUR);
-    Serial.print("-");
-    Serial.println(END_HOUR);
-    */
-    
-    //if current time is greater or equal to 6AM and inferior than 11PM, system should be active
-    bool isActive = (currentHour >= START_HOUR && currentHour < END_HOUR);
-    
-    if (isActive != lastActiveState) {
-      lastActiveState = isActive;
-      
-      //if system is active but asleep, trigger startup sequence
-      if (isActive) {
-        if (!systemAwake) {
-          Serial.println("Entering active hours");
-          sendSerialCommand(CMD_WAKEUP);
-          startupSequence();
-          displayBinaryCode(15);
-        }
-      } else { //if system is inactive but awake, trigger shutdown sequence
-        if (systemAwake) {
-          Serial.println("Exiting active hours");
-          sendSerialCommand(CMD_SLEEP);
-          shutDownSequence();
-        }
-      }
+void scheduleUpdate() {
+  TRACE_SCOPE(TRACE_SCHEDULE);
+  if (!failoverLeading()) return;
+
+  //no time to run the calendar on, LONG holds the installation asleep until the RTC answers
+  if (PLAYER_ID == 0 && !rtcProbe()) {
+    if (powerTargetAwake) {
+      Serial.println("No RTC, going to sleep");
+      sendSerialCommand(CMD_SLEEP);
+      shutDownSequence();
     }
+    taskRunIn(scheduleTask, RTC_RETRY_MS);
+    return;
+  }
 
-    //software reboot every sunday midnight / monday 00:00
-    if (now.dayOfTheWeek() == 0 && now.hour() == 0 && now.minute() == 0) {
-      Serial.println("Weekly reboot time reached");
-      scheduledReboot();
+  DateTime now = scheduleNow();
+  if (calendarEventCount == 0) {
+    calendarCompile(now);
+  }
+
+  //fire every event reached, the millis deadline may fire slightly early and is then
+  //re-armed for the remaining seconds
+  bool rebootDue = false;
+  while (calendarNext().time <= now.unixtime()) {
+    CalendarEvent event = calendarNext();
+    calendarCursor++;
+
+    if (event.action == CAL_REBOOT) {
+      rebootDue = true;
+    } else if (event.action == CAL_REBUILD) {
+      calendarCompile(now);
+    } else {
+      calendarMode = event.action;
     }
   }
-  
+
+  //system should be active during SHOW and AWAKE windows
+  bool isActive = (calendarMode != CAL_SLEEP);
+
+  //if system is active but asleep, trigger startup sequence
+  if (isActive) {
+    if (!powerTargetAwake) {
+      Serial.println("Entering active hours");
+      crashLog("active hours start");
+      sendSerialCommand(CMD_WAKEUP);
+      startupSequence();
+      displayBinaryCode(15);
+    }
+  } else { //if system is inactive but awake, trigger shutdown sequence
+    if (powerTargetAwake) {
+      Serial.println("Exiting active hours");
+      crashLog("active hours end");
+      sendSerialCommand(CMD_SLEEP);
+      shutDownSequence();
+    }
+  }
+
+  //an acting leader would come back without the clock it leads on, it skips the reboot
+  if (rebootDue && PLAYER_ID == 0) {
+    Serial.println("Weekly reboot time reached");
+    crashLog("weekly reboot");
+    scheduledReboot();
+    return;
+  }
+
+  scheduleArm(now);
+}
+
+/**
+ * Registers the schedule task, armed on LONG once the followers are listening, on a follower
+ * when it takes over (see failoverCtrl.h)
+ */
+void setupSchedule() {
+  scheduleTask = taskAdd("schedule", scheduleUpdate, ONE_SHOT, 3, 1000);
+  if (PLAYER_ID == 0) taskRunIn(scheduleTask, BOOT_LINK_GRACE);
+}
+
+/**
+ * Updates playback status once per second
+ * Wake/sleep transitions are handled by scheduleUpdate() at event times
+ */
+void statusUpdates() {
+  // Uptime kept across resets
+  crashUpdate();
+
+  // Clock anchor broadcast on LONG
+  clockTick();
+
+  // Failover between the bus ports
+  busCheckHealth();
+
   // Update playback status
   if (!wavPlayer.isPlaying()) {
     playbackStatus = false;
   }
 }
 
-#endif // MYSYSCTRL_H
\ No newline at end of file
+#endif // MYSYSCTRL_H
@@ -0,0 +1,193 @@
+/**
+ * paramCtrl.h - Synchronized Parameter Library
+ *
+ * Volume and PWM range changes used to be forwarded one command at a time, each unit applying
+ * it on arrival, so the units changed audibly and visibly at different moments. They now go
+ * in two phases. The leader stages the new values with the time to apply them,
+ * ":S|SEQ|VOLUME|PWM|AT|CRC" (volume in 1/100, AT on LONG's millis()), PARAM_LEAD_MS ahead,
+ * long enough for the frame to reach every unit. Each unit, the leader included, commits them
+ * at AT on the shared clock (see clockCtrl.h): the units change within the clock error, about
+ * one audio block, on the next light frame. A newer stage replaces a pending one, latest
+ * value wins.
+ *
+ * A follower whose clock is not synced, or that gets the stage after AT, applies it at once.
+ * One that missed it is corrected by the desired state (see stateCtrl.h), which leaves volume
+ * and PWM alone while a stage is pending. On a follower not leading, changes typed over USB
+ * apply locally right away.
+ */
+
+#ifndef PARAMCTRL_H
+#define PARAMCTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+extern float audioVolume;
+extern int rangePWM;
+
+#define PARAM_LEAD_MS 200             // stage to commit, covers a frame queued behind others at 9600 baud
+#define PARAM_FRAME_SIZE 48
+
+// values waiting for their commit time
+struct ParamStage {
+  bool pending;
+  uint16_t seq;
+  uint8_t volume;         // audioVolume * 100
+  uint8_t pwm;            // rangePWM
+  uint32_t atMs;          // commit time, LONG's millis()
+};
+
+ParamStage paramStaged;
+uint16_t paramSeq = 0;
+int paramTask = TASK_NONE;
+
+uint32_t paramStages = 0;             // stages sent (leader) or received (followers)
+uint32_t paramCommits = 0;
+uint32_t paramLate = 0;               // followers: stages received after their commit time
+uint32_t paramRejected = 0;           // followers: frames failing the CRC or the format
+int32_t paramLastErrorMs = 0;         // commit time error of the last commit
+int32_t paramMaxErrorMs = 0;
+
+/**
+ * @return True while staged values wait for their commit time
+ */
+bool paramPending() {
+  return paramStaged.pending;
+}
+
+/**
+ * @return Volume once the pending stage is committed, to build the next change on
+ */
+float paramVolume() {
+  return paramStaged.pending ? paramStaged.volume / 100.0f : audioVolume;
+}
+
+/**
+ * @return PWM range once the pending stage is committed
+ */
+int paramPwm() {
+  return paramStaged.pending ? paramStaged.pwm : rangePWM;
+}
+
+/*
+ * helper function applying volume and PWM range, the gain is only set on a change
+ */
+void paramApply(uint8_t volume, uint8_t pwm) {
+  if ((uint8_t)(audioVolume * 100.0f + 0.5f) != volume) {
+    audioVolume = volume / 100.0f;
+    gainSet(audioVolume);
+  }
+  rangePWM = pwm;
+  persistMarkDirty();
+}
+
+/**
+ * Applies the staged values, on every unit at the same time on the shared clock
+ * Run by the "param" one-shot task at the commit time
+ */
+void paramCommit() {
+  if (!paramStaged.pending) return;
+  paramStaged.pending = false;
+
+  int32_t errorMs = (int32_t)(clockLeaderMillis() - paramStaged.atMs);
+  paramApply(paramStaged.volume, paramStaged.pwm);
+  paramCommits++;
+  paramLastErrorMs = errorMs;
+  if (abs(errorMs) > abs(paramMaxErrorMs)) paramMaxErrorMs = errorMs;
+
+  Serial.printf("Volume %.2f, PWM range %d committed (%ld ms)\n", audioVolume, rangePWM, (long)errorMs);
+}
+
+/*
+ * helper function keeping values until their commit time, arms the commit task
+ */
+void paramHold(uint16_t seq, uint8_t volume, uint8_t pwm, uint32_t atMs) {
+  paramStaged.pending = true;
+  paramStaged.seq = seq;
+  paramStaged.volume = volume;
+  paramStaged.pwm = pwm;
+  paramStaged.atMs = atMs;
+
+  int32_t waitMs = (int32_t)(atMs - clockLeaderMillis());
+  taskRunIn(paramTask, waitMs > 0 ? waitMs : 0);
+}
+
+/**
+ * Changes volume and PWM range: staged on every unit by the leader, applied at once elsewhere
+ * @param volume New volume, 0.0 to 1.0
+ * @param pwm New PWM range, 0 to 255
+ */
+void paramChange(float volume, int pwm) {
+  uint8_t volume100 = (uint8_t)(constrain(volume, 0.0f, 1.0f) * 100.0f + 0.5f);
+  uint8_t pwm8 = (uint8_t)constrain(pwm, 0, 255);
+
+  if (!failoverLeading()) {
+    paramStaged.pending = false;
+    paramApply(volume100, pwm8);
+    return;
+  }
+
+  uint32_t atMs = clockLeaderMillis() + PARAM_LEAD_MS;
+  char frame[PARAM_FRAME_SIZE];
+  int length = snprintf(frame, sizeof(frame), "S|%u|%u|%u|%lu|", ++paramSeq, volume100, pwm8,
+                        (unsigned long)atMs);
+  busOut.write(':');
+  busOut.write(frame);
+  busOut.println(crc16((const uint8_t*)frame, length), HEX);
+  paramStages++;
+
+  paramHold(paramSeq, volume100, pwm8, atMs);
+}
+
+/**
+ * Handles staged values received on the bus, quietly
+ * @param frame Frame without the leading ':'
+ * @return True if the frame was a stage
+ */
+bool paramReceive(char* frame) {
+  if (strncmp(frame, "S|", 2) != 0) return false;
+  if (failoverLeading()) return true;
+
+  char* crcStart = strrchr(frame, '|');
+  unsigned seq, volume, pwm;
+  unsigned long atMs;
+  if (crcStart == NULL ||
+      strtoul(crcStart + 1, NULL, 16) != crc16((const uint8_t*)frame, crcStart + 1 - frame) ||
+      sscanf(frame, "S|%u|%u|%u|%lu|", &seq, &volume, &pwm, &atMs) != 4 || volume > 100 || pwm > 255) {
+    paramRejected++;
+    return true;
+  }
+  paramStages++;
+
+  //without a synced clock the commit time means nothing here
+  if (!clockSynced) atMs = clockLeaderMillis();
+  if ((int32_t)(atMs - clockLeaderMillis()) < 0) paramLate++;
+  paramHold(seq, volume, pwm, atMs);
+  return true;
+}
+
+/**
+ * Registers the commit task, to be called once from setup
+ */
+void setupParam() {
+  paramTask = taskAdd("param", paramCommit, ONE_SHOT, 0, 5);
+}
+
+/**
+ * Prints the staged values and the commit timing to Serial
+ */
+void paramReport() {
+  Serial.println("\n-- PARAMETERS --");
+  Serial.printf("Volume %.2f, PWM Range %d\n", audioVolume, rangePWM);
+  if (paramStaged.pending) {
+    Serial.printf("Staged Volume %.2f, PWM Range %u in %ld ms\n", paramStaged.volume / 100.0f,
+                  paramStaged.pwm, (long)(int32_t)(paramStaged.atMs - clockLeaderMillis()));
+  }
+  Serial.printf("Stages %lu, Commits %lu", (unsigned long)paramStages, (unsigned long)paramCommits);
+  if (PLAYER_ID != 0) {
+    Serial.printf(", Late %lu, Rejected %lu", (unsigned long)paramLate, (unsigned long)paramRejected);
+  }
+  Serial.printf("\nCommit Error Last %ld ms, Max %ld ms\n", (long)paramLastErrorMs, (long)paramMaxErrorMs);
+}
+
+#endif // PARAMCTRL_H
@@ -0,0 +1,183 @@
+/**
+ * persistCtrl.h - Persistent Settings Library
+ *
+ * Keeps the settings changed at runtime (volume, PWM range, knob control) and the address
+ * given by LONG to a follower (see enumCtrl.h) across reboots
+ * in the Teensy's emulated EEPROM. The EEPROM is split in slots holding a versioned,
+ * CRC-protected record with a sequence number: loading is one pass over the slots keeping
+ * the newest valid record, saving writes the slot after it. A write interrupted by a power
+ * cut therefore never loses the previous record, and writes are spread over the whole EEPROM.
+ *
+ * Changes only mark the settings dirty, the "persist" one-shot task writes them
+ * PERSIST_DELAY after the last change, so a burst of changes costs a single write.
+ */
+
+#ifndef PERSISTCTRL_H
+#define PERSISTCTRL_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+extern float audioVolume;
+extern int rangePWM;
+extern bool knobCtrl;
+
+#define PERSIST_MAGIC 0x534D      // "SM"
+#define PERSIST_VERSION 1
+#define PERSIST_DELAY 5000        // ms after the last change before writing
+
+struct __attribute__((packed)) PersistRecord {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t size;           // sizeof(PersistRecord), rejects records from other layouts
+  uint32_t sequence;      // incremented at each write, the highest valid one is current
+  float audioVolume;
+  int16_t rangePWM;
+  uint8_t knobCtrl;
+  uint8_t address;        // follower address given by LONG, 0 if none (was reserved, always 0)
+  uint16_t crc;           // CRC-16 of all the fields above
+};
+
+PersistRecord persistSaved;       // last record loaded or written
+int persistSlot = -1;             // slot of persistSaved, -1 if none
+int persistTask = TASK_NONE;
+uint32_t persistWrites = 0;       // writes since boot
+uint8_t persistAddress = 0;       // follower address to keep, set by enumCtrl.h
+
+/**
+ * Computes the CRC-16/CCITT-FALSE of a buffer, used for all stored records
+ * @param data Buffer start
+ * @param length Number of bytes
+ * @return CRC value
+ */
+uint16_t crc16(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/*
+ * helper function computing the CRC of a record, crc field excluded
+ */
+uint16_t persistCrc(const PersistRecord &record) {
+  return crc16((const uint8_t*)&record, offsetof(PersistRecord, crc));
+}
+
+/*
+ * helper function returning the number of record slots in the EEPROM
+ */
+int persistSlotCount() {
+  return EEPROM.length() / sizeof(PersistRecord);
+}
+
+/**
+ * Loads the newest valid record in one pass over the slots and applies it
+ * To be called at the top of setup, before the settings are used
+ * @return True if a record was found
+ */
+bool persistLoad() {
+  PersistRecord record;
+  persistSlot = -1;
+
+  for (int slot = 0; slot < persistSlotCount(); slot++) {
+    EEPROM.get(slot * sizeof(PersistRecord), record);
+    if (record.magic != PERSIST_MAGIC || record.version != PERSIST_VERSION ||
+        record.size != sizeof(PersistRecord) || record.crc != persistCrc(record)) continue;
+
+    if (persistSlot < 0 || (int32_t)(record.sequence - persistSaved.sequence) > 0) {
+      persistSaved = record;
+      persistSlot = slot;
+    }
+  }
+
+  if (persistSlot < 0) {
+    Serial.println("No saved settings, using defaults");
+    return false;
+  }
+
+  if (persistSaved.audioVolume >= 0.0f && persistSaved.audioVolume <= 1.0f) {
+    audioVolume = persistSaved.audioVolume;
+  }
+  rangePWM = constrain((int)persistSaved.rangePWM, 0, 255);
+  knobCtrl = persistSaved.knobCtrl;
+  persistAddress = persistSaved.address;
+
+  Serial.print("Saved settings loaded from slot ");
+  Serial.println(persistSlot);
+  return true;
+}
+
+/**
+ * Writes the current settings to the next slot if they changed since the last write
+ * Run by the "persist" one-shot task, never from the light or link tasks
+ */
+void persistSave() {
+  PersistRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = PERSIST_MAGIC;
+  record.version = PERSIST_VERSION;
+  record.size = sizeof(PersistRecord);
+  record.audioVolume = audioVolume;
+  record.rangePWM = rangePWM;
+  record.knobCtrl = knobCtrl ? 1 : 0;
+  record.address = persistAddress;
+
+  if (persistSlot >= 0 &&
+      record.audioVolume == persistSaved.audioVolume &&
+      record.rangePWM == persistSaved.rangePWM &&
+      record.knobCtrl == persistSaved.knobCtrl &&
+      record.address == persistSaved.address) {
+    return;  // nothing new since the last write
+  }
+
+  record.sequence = (persistSlot >= 0) ? persistSaved.sequence + 1 : 1;
+  record.crc = persistCrc(record);
+
+  int slot = (persistSlot + 1) % persistSlotCount();
+  EEPROM.put(slot * sizeof(PersistRecord), record);
+
+  persistSaved = record;
+  persistSlot = slot;
+  persistWrites++;
+
+  Serial.print("Settings saved to slot ");
+  Serial.println(slot);
+}
+
+/**
+ * Marks the settings as changed, the write happens PERSIST_DELAY after the last call
+ */
+void persistMarkDirty() {
+  taskRunIn(persistTask, PERSIST_DELAY);
+}
+
+/**
+ * Registers the persist task, to be called once from setup
+ */
+void setupPersist() {
+  persistTask = taskAdd("persist", persistSave, ONE_SHOT, 4, 1000);
+}
+
+/**
+ * Prints the persisted settings state to Serial
+ */
+void persistReport() {
+  Serial.println("\n-- SAVED SETTINGS --");
+  Serial.print("Slot ");
+  Serial.print(persistSlot);
+  Serial.print(" / ");
+  Serial.println(persistSlotCount());
+  Serial.print("Sequence ");
+  Serial.println(persistSlot >= 0 ? persistSaved.sequence : 0);
+  Serial.print("Writes Since Boot ");
+  Serial.println(persistWrites);
+  Serial.print("Write Pending ");
+  Serial.println(taskPending(persistTask) ? "YES" : "NO");
+}
+
+#endif // PERSISTCTRL_H
@@ -0,0 +1,149 @@
+/**
+ * powerCtrl.h - Power Sequencing Library
+ *
+ * Timed state machine switching the amplifier and speaker relays without blocking.
+ * startupSequence() and shutDownSequence() only request a target state, the "power"
+ * one-shot task then advances one relay step every settings.relSwDelay ms, so light output,
+ * serial parsing and follower traffic keep running during transitions.
+ */
+
+#ifndef POWERCTRL_H
+#define POWERCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern bool systemAwake;
+extern int trackIteration;
+extern const int REL_1;
+extern const int REL_2;
+extern const int PWM_PIN;
+extern AudioPlaySdWav wavPlayer;
+
+// Relay sequencing phases, a phase lasts settings.relSwDelay except the two settled ones
+enum PowerPhase : uint8_t {
+  PWR_ASLEEP = 0,     // both relays off (settled)
+  PWR_AMP_ON,         // amp switched on, waiting before the speaker
+  PWR_SPEAKER_ON,     // speaker switched on, waiting before waking up
+  PWR_AWAKE,          // both relays on (settled)
+  PWR_SPEAKER_OFF,    // speaker switched off, waiting before the amp
+  PWR_AMP_OFF         // amp switched off, waiting before sleeping
+};
+
+const char* const powerPhaseNames[] = { "ASLEEP", "AMP ON", "SPEAKER ON", "AWAKE", "SPEAKER OFF", "AMP OFF" };
+
+PowerPhase powerPhase = PWR_ASLEEP;
+bool powerTargetAwake = false;
+int powerTask = TASK_NONE;
+
+/**
+ * @return Name of the current power phase
+ */
+const char* powerPhaseName() {
+  return powerPhaseNames[powerPhase];
+}
+
+/**
+ * @return True while relays are being switched
+ */
+bool powerInTransition() {
+  return powerPhase != PWR_ASLEEP && powerPhase != PWR_AWAKE;
+}
+
+/*
+ * helper function to leave a settled phase toward the target state
+ */
+void powerBeginTransition() {
+  if (powerPhase == PWR_ASLEEP && powerTargetAwake) {
+    digitalWrite(REL_1, HIGH);  //turns amp on
+    Serial.println("amp is ON");
+    powerPhase = PWR_AMP_ON;
+    taskRunIn(powerTask, settings.relSwDelay);
+  } else if (powerPhase == PWR_AWAKE && !powerTargetAwake) {
+    //stop any audio or light, system is asleep from now on
+    systemAwake = false;
+    wavPlayer.stop();
+    analogWrite(PWM_PIN, 0);  // Set PWM to zero
+
+    digitalWrite(REL_2, LOW);  //turns speaker off
+    Serial.println("speaker is OFF");
+    powerPhase = PWR_SPEAKER_OFF;
+    taskRunIn(powerTask, settings.relSwDelay);
+  }
+}
+
+/**
+ * Advances the relay sequence by one step, run by the "power" one-shot task
+ */
+void powerStep() {
+  TRACE_SCOPE(TRACE_RELAY_SEQ);
+
+  switch (powerPhase) {
+    case PWR_AMP_ON:
+      digitalWrite(REL_2, HIGH);  //turns speaker on
+      Serial.println("speaker is ON");
+      powerPhase = PWR_SPEAKER_ON;
+      taskRunIn(powerTask, settings.relSwDelay);
+      return;
+
+    case PWR_SPEAKER_ON:
+      powerPhase = PWR_AWAKE;
+      systemAwake = true; //system wakeup
+      trackIteration = 0; //reset daily track count
+      Serial.println("System is awake");
+      crashLog("awake");
+      bootMark("awake");
+      taskRunIn(playbackTask, 0); //start the track now rather than at the next playback check
+      break;
+
+    case PWR_SPEAKER_OFF:
+      digitalWrite(REL_1, LOW);  //turns amp off
+      Serial.println("amp is OFF");
+      powerPhase = PWR_AMP_OFF;
+      taskRunIn(powerTask, settings.relSwDelay);
+      return;
+
+    case PWR_AMP_OFF:
+      powerPhase = PWR_ASLEEP;
+      Serial.println("System is asleep");
+      crashLog("asleep");
+      break;
+
+    default:
+      break;
+  }
+
+  //a request for the opposite state came in during the transition
+  powerBeginTransition();
+}
+
+/**
+ * Registers the power task, to be called once from setup
+ */
+void setupPower() {
+  powerTask = taskAdd("power", powerStep, ONE_SHOT, 0);
+}
+
+/**
+ * Requests the amp then speaker to be powered on, system is awake once both relays are on
+ * Returns immediately, the sequence runs from the scheduler
+ */
+void startupSequence() {
+  powerTargetAwake = true;
+  if (!powerInTransition()) {
+    powerBeginTransition();
+  }
+}
+
+/**
+ * Requests the speaker then amp to be powered off, audio and light stop immediately
+ * Returns immediately, the sequence runs from the scheduler
+ */
+void shutDownSequence() {
+  powerTargetAwake = false;
+  if (!powerInTransition()) {
+    powerBeginTransition();
+  }
+}
+
+#endif // POWERCTRL_H
@@ -0,0 +1,241 @@
+/**
+ * sdCtrl.h - SD Card Health Library
+ *
+ * Replaces the endless "Unable to access the SD card" loop with a monitor that keeps the
+ * unit running. A card that fails at boot, a track that cannot be opened, or a playback
+ * position frozen for SD_STALL_MS marks the card as faulty: playback stops, the LEDs show
+ * code 3 and the "sd" task re-initialises the card with an exponential backoff between
+ * SD_RETRY_MIN_MS and SD_RETRY_MAX_MS. Once the card answers again the track restarts
+ * (on LONG through the playback task, so the followers restart with it).
+ *
+ * Each fault is logged with its cause, the number of attempts and the time to recover,
+ * shown in the system report and sent to LONG in the follower status frame.
+ */
+
+#ifndef SDCTRL_H
+#define SDCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+#include <SD.h>
+
+extern int PLAYER_ID;
+extern bool systemAwake;
+extern bool playbackStatus;
+extern const int SDCARD_CS_PIN;
+extern AudioPlaySdWav wavPlayer;
+extern int scheduleTask;
+void playAudio();
+bool failoverLeading();
+
+#define SD_CHECK_MS 200           // period of the sd task
+#define SD_STALL_MS 1500          // playback position frozen this long counts as a read fault
+#define SD_RETRY_MIN_MS 250       // first re-initialisation delay, doubled after each failure
+#define SD_RETRY_MAX_MS 8000
+#define SD_EVENT_LOG 8            // last fault events kept for the report
+
+enum SdFault : uint8_t {
+  SD_FAULT_BOOT = 0,    // SD.begin() failed in setup
+  SD_FAULT_OPEN,        // the track could not be opened
+  SD_FAULT_STALL        // playback position stopped moving
+};
+
+const char* const sdFaultNames[] = { "BOOT", "OPEN", "STALL" };
+
+struct SdEvent {
+  uint32_t startMs;     // millis() when the fault was detected
+  uint32_t recoveryMs;  // time to recover
+  uint16_t attempts;    // SD.begin() calls
+  SdFault fault;
+  bool recovered;
+};
+
+bool sdReady = false;
+bool sdFilesLoaded = false;       // CONFIG.INI and SCHEDULE.BIN were read from the card
+bool sdResume = false;            // restart the track once recovered
+int sdTask = TASK_NONE;
+
+uint32_t sdErrors = 0;            // faults detected since boot
+uint32_t sdRecoveries = 0;
+uint32_t sdMaxRecoveryMs = 0;
+uint32_t sdRetryMs = SD_RETRY_MIN_MS;
+uint32_t sdNextTryMs = 0;
+
+SdEvent sdEvents[SD_EVENT_LOG];   // ring, sdErrors is the total
+uint32_t sdLastPositionMs = 0;
+elapsedMillis sdStallTimer;
+
+/*
+ * helper function returning the log entry of the current (last) fault
+ */
+SdEvent& sdCurrentEvent() {
+  return sdEvents[(sdErrors - 1) % SD_EVENT_LOG];
+}
+
+/**
+ * Marks the card as faulty and starts the recovery, ignored while already recovering
+ * @param fault Cause of the fault
+ */
+void sdFault(SdFault fault) {
+  if (!sdReady && sdErrors > 0) return;
+
+  sdErrors++;
+  SdEvent &event = sdCurrentEvent();
+  event.startMs = millis();
+  event.recoveryMs = 0;
+  event.attempts = 0;
+  event.fault = fault;
+  event.recovered = false;
+
+  sdReady = false;
+  sdResume = systemAwake;
+  wavPlayer.stop();
+  playbackStatus = false;
+
+  sdRetryMs = SD_RETRY_MIN_MS;
+  sdNextTryMs = millis() + (fault == SD_FAULT_BOOT ? SD_RETRY_MIN_MS : 0);
+
+  Serial.print("SD card fault: ");
+  Serial.println(sdFaultNames[fault]);
+  crashLog("sd fault %s", sdFaultNames[fault]);
+
+  if (fault == SD_FAULT_STALL) {
+    watchdogRecovered(WDT_REASON_AUDIO);
+  }
+}
+
+/**
+ * Called by playAudio() when the track could not be started
+ */
+void sdPlayFailed() {
+  if (sdReady) {
+    sdFault(SD_FAULT_OPEN);
+  } else {
+    sdResume = systemAwake;
+  }
+}
+
+/**
+ * Initialises the card once from setup, a failure starts the recovery instead of stopping
+ * @return True if the card answered
+ */
+bool sdBegin() {
+  sdReady = SD.begin(SDCARD_CS_PIN);
+  sdFilesLoaded = sdReady;
+  if (!sdReady) {
+    sdFault(SD_FAULT_BOOT);
+  }
+  return sdReady;
+}
+
+/*
+ * helper function trying to re-initialise the card, backs off on failure
+ */
+void sdRecover() {
+  SdEvent &event = sdCurrentEvent();
+  event.attempts++;
+
+  if (!SD.begin(SDCARD_CS_PIN)) {
+    sdRetryMs = min((uint32_t)(sdRetryMs * 2), (uint32_t)SD_RETRY_MAX_MS);
+    sdNextTryMs = millis() + sdRetryMs;
+    Serial.print("SD card still unavailable, next try in ");
+    Serial.print(sdRetryMs);
+    Serial.println(" ms");
+    return;
+  }
+
+  sdReady = true;
+  event.recoveryMs = millis() - event.startMs;
+  event.recovered = true;
+  if (event.recoveryMs > sdMaxRecoveryMs) sdMaxRecoveryMs = event.recoveryMs;
+  sdRecoveries++;
+  sdLastPositionMs = 0;
+  sdStallTimer = 0;
+
+  Serial.print("SD card recovered in ");
+  Serial.print(event.recoveryMs);
+  Serial.println(" ms");
+  crashLog("sd recovered %lu ms", (unsigned long)event.recoveryMs);
+
+  //the card was missing at boot, read the files the defaults stood in for
+  if (!sdFilesLoaded) {
+    sdFilesLoaded = true;
+    configLoad();
+    calendarLoad();
+    cueReload();
+    calendarEventCount = 0;  //recompiled at the next schedule check
+    taskRunIn(scheduleTask, 0);
+  }
+
+  if (sdResume && systemAwake) {
+    if (failoverLeading()) {
+      taskRunIn(playbackTask, 0);  //restarts the followers too
+    } else {
+      playAudio();
+    }
+  }
+  sdResume = false;
+}
+
+/**
+ * Watches playback for a frozen position and runs the recovery attempts
+ * Run by the "sd" task
+ */
+void sdUpdate() {
+  if (!sdReady) {
+    if (timeReached(millis(), sdNextTryMs)) {
+      sdRecover();
+    }
+    return;
+  }
+
+  if (!wavPlayer.isPlaying()) {
+    sdStallTimer = 0;
+    return;
+  }
+
+  uint32_t positionMs = wavPlayer.positionMillis();
+  if (positionMs != sdLastPositionMs) {
+    sdLastPositionMs = positionMs;
+    sdStallTimer = 0;
+  } else if (sdStallTimer >= SD_STALL_MS) {
+    sdFault(SD_FAULT_STALL);
+  }
+}
+
+/**
+ * Registers the sd task, to be called once from setup
+ */
+void setupSd() {
+  sdTask = taskAdd("sd", sdUpdate, SD_CHECK_MS, 3);
+}
+
+/**
+ * Prints the card state and the last fault events to Serial
+ */
+void sdReport() {
+  Serial.println("\n-- SD CARD --");
+  Serial.print("Card State ");
+  Serial.println(sdReady ? "OK" : "FAULT, RECOVERING");
+  Serial.print("Errors ");
+  Serial.println(sdErrors);
+  Serial.print("Recoveries ");
+  Serial.println(sdRecoveries);
+  Serial.print("Max Recovery Time ");
+  Serial.print(sdMaxRecoveryMs);
+  Serial.println(" ms");
+
+  uint32_t first = sdErrors > SD_EVENT_LOG ? sdErrors - SD_EVENT_LOG : 0;
+  for (uint32_t i = first; i < sdErrors; i++) {
+    const SdEvent &event = sdEvents[i % SD_EVENT_LOG];
+    Serial.printf("  at %lu s %-5s attempts %u ", (unsigned long)(event.startMs / 1000),
+                  sdFaultNames[event.fault], event.attempts);
+    if (event.recovered) {
+      Serial.printf("recovered in %lu ms\n", (unsigned long)event.recoveryMs);
+    } else {
+      Serial.println("not recovered");
+    }
+  }
+}
+
+#endif // SDCTRL_H
@@ -0,0 +1,256 @@
+/**
+ * stateCtrl.h - Desired State Replication Library
+ *
+ * Commands from LONG are sent once, so a follower that rebooted or lost a byte used to stay
+ * wrong until the next transition. LONG now broadcasts what every unit should be doing,
+ * ":D|SEQ|AWAKE|PLAYING|RUN|VOLUME|PWM|CRC", as soon as it changes and every
+ * STATE_REFRESH_MS otherwise. Followers compare it with their own state and converge:
+ * wake up or go to sleep, stop, start the track, take the volume (in 1/100) and the PWM
+ * range. RUN counts the track starts on LONG, a follower that missed a start (and did not
+ * just get CMD_PLAY) starts its track right away. Applying the same record twice does nothing.
+ */
+
+#ifndef STATECTRL_H
+#define STATECTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+
+extern int PLAYER_ID;
+extern bool systemAwake;
+extern float audioVolume;
+extern int rangePWM;
+extern AudioPlaySdWav wavPlayer;
+bool failoverLeading();
+bool paramPending();
+float paramVolume();
+int paramPwm();
+
+#define STATE_CHECK_MS 250            // LONG compares the state this often, sends on change
+#define STATE_REFRESH_MS 2000         // unchanged state is repeated this often while awake
+#define STATE_REFRESH_ASLEEP_MS 10000 // and this often while asleep
+#define STATE_PLAY_GRACE_MS 1000      // a track started this recently was started for this run
+#define STATE_FRAME_SIZE 48
+
+struct DesiredState {
+  bool awake;
+  bool playing;
+  uint16_t run;           // track starts on LONG
+  uint8_t volume;         // audioVolume * 100
+  uint8_t pwm;            // rangePWM
+};
+
+DesiredState stateDesired;            // LONG: current state, followers: last state received
+bool stateKnown = false;              // followers: a state was received
+bool stateShowPlaying = false;        // leader: the track is meant to play, cleared by CMD_STOP
+uint16_t stateRun = 0;                // followers: run the current track belongs to
+uint32_t stateStartedMs = 0;          // millis() of the last track start
+uint16_t stateSeq = 0;
+uint32_t stateSentMs = 0;
+uint32_t stateReceivedMs = 0;
+int stateTask = TASK_NONE;
+
+uint32_t stateSent = 0;               // LONG: records sent
+uint32_t stateReceived = 0;           // followers: records applied
+uint32_t stateRejected = 0;           // followers: records failing the CRC or the format
+uint32_t stateFixes = 0;              // followers: corrections made
+const char* stateLastFix = "-";
+
+/*
+ * helper function computing the state LONG wants, staged volume and PWM included so a record
+ * sent before their commit does not take them back on units that already committed
+ */
+DesiredState stateCurrent() {
+  DesiredState state;
+  state.awake = powerTargetAwake;
+  state.playing = stateShowPlaying && powerTargetAwake;
+  state.run = stateDesired.run;
+  state.volume = (uint8_t)(paramVolume() * 100.0f + 0.5f);
+  state.pwm = (uint8_t)paramPwm();
+  return state;
+}
+
+/*
+ * helper function sending the desired state, leader only
+ */
+void stateBroadcast() {
+  char frame[STATE_FRAME_SIZE];
+  int length = snprintf(frame, sizeof(frame), "D|%u|%d|%d|%u|%u|%u|", stateSeq++,
+                        stateDesired.awake ? 1 : 0, stateDesired.playing ? 1 : 0,
+                        stateDesired.run, stateDesired.volume, stateDesired.pwm);
+  busOut.write(':');
+  busOut.write(frame);
+  busOut.println(crc16((const uint8_t*)frame, length), HEX);
+
+  stateSentMs = millis();
+  stateSent++;
+}
+
+/**
+ * Sends the desired state when it changed or is due for a refresh, LONG or the acting leader
+ * Run by the "state" task every STATE_CHECK_MS
+ */
+void stateUpdate() {
+  if (!failoverLeading()) return;
+  DesiredState state = stateCurrent();
+  bool changed = state.awake != stateDesired.awake || state.playing != stateDesired.playing ||
+                 state.volume != stateDesired.volume || state.pwm != stateDesired.pwm;
+  uint32_t refreshMs = state.awake ? STATE_REFRESH_MS : STATE_REFRESH_ASLEEP_MS;
+
+  stateDesired = state;
+  if (changed || stateSent == 0 || millis() - stateSentMs >= refreshMs) {
+    stateBroadcast();
+  }
+}
+
+/**
+ * Called by playAudio() when a track starts, on the leader this begins a new run
+ */
+void stateTrackStarted() {
+  stateStartedMs = millis();
+  if (!failoverLeading()) return;
+
+  stateDesired.run++;
+  stateShowPlaying = true;
+  stateDesired.playing = powerTargetAwake;
+  stateBroadcast();
+}
+
+/**
+ * Called on CMD_STOP, on the leader the followers stop with it
+ */
+void stateStopped() {
+  stateShowPlaying = false;
+}
+
+/*
+ * helper function counting a correction made on a follower
+ */
+void stateFixed(const char* what) {
+  stateFixes++;
+  stateLastFix = what;
+  Serial.print("Desired state: ");
+  Serial.println(what);
+}
+
+/*
+ * helper function bringing a follower to the desired state
+ */
+void stateApply(const DesiredState &desired) {
+  if (desired.awake != powerTargetAwake) {
+    if (desired.awake) {
+      startupSequence();
+      stateFixed("wake up");
+    } else {
+      shutDownSequence();
+      stateFixed("sleep");
+    }
+  }
+
+  //a staged change is about to be committed, the record may predate it
+  bool staged = paramPending();
+  if (!staged && (uint8_t)(audioVolume * 100.0f + 0.5f) != desired.volume) {
+    audioVolume = desired.volume / 100.0f;
+    gainSet(audioVolume);
+    persistMarkDirty();
+    stateFixed("volume");
+  }
+
+  if (!staged && rangePWM != desired.pwm) {
+    rangePWM = desired.pwm;
+    persistMarkDirty();
+    stateFixed("pwm range");
+  }
+
+  //playback follows once the relays are on and the codec answers
+  if (!systemAwake || !codecReady) return;
+
+  if (!desired.playing) {
+    if (wavPlayer.isPlaying()) {
+      wavPlayer.stop();
+      stateFixed("stop");
+    }
+    stateRun = desired.run;
+  } else if (desired.run != stateRun) {
+    stateRun = desired.run;
+    //CMD_PLAY usually arrives just before the record of its run
+    if (!wavPlayer.isPlaying() || millis() - stateStartedMs > STATE_PLAY_GRACE_MS) {
+      playAudio();
+      stateFixed("play");
+    }
+  }
+}
+
+/**
+ * Handles a desired state record received on the bus, followers only
+ * @param frame Frame without the leading ':'
+ * @return True if the frame was a desired state record
+ */
+bool stateReceive(char* frame) {
+  if (strncmp(frame, "D|", 2) != 0) return false;
+  if (failoverLeading()) return true;
+
+  char* crcStart = strrchr(frame, '|');
+  unsigned seq, awake, playing, run, volume, pwm;
+  if (crcStart == NULL ||
+      strtoul(crcStart + 1, NULL, 16) != crc16((const uint8_t*)frame, crcStart + 1 - frame) ||
+      sscanf(frame, "D|%u|%u|%u|%u|%u|%u|", &seq, &awake, &playing, &run, &volume, &pwm) != 6 ||
+      volume > 100 || pwm > 255) {
+    stateRejected++;
+    return true;
+  }
+
+  stateDesired.awake = awake;
+  stateDesired.playing = playing;
+  stateDesired.run = run;
+  stateDesired.volume = volume;
+  stateDesired.pwm = pwm;
+  stateKnown = true;
+  stateReceivedMs = millis();
+  stateReceived++;
+
+  stateApply(stateDesired);
+  return true;
+}
+
+/**
+ * Registers the state task, it only sends on LONG or an acting leader, to be called once from setup
+ */
+void setupState() {
+  if (PLAYER_ID == 0) stateDesired = stateCurrent();
+  stateTask = taskAdd("state", stateUpdate, STATE_CHECK_MS, 3, 0, BOOT_LINK_GRACE);
+}
+
+/**
+ * Prints the desired state and the corrections made to Serial
+ */
+void stateReport() {
+  Serial.println("\n-- DESIRED STATE --");
+  if (PLAYER_ID != 0 && !stateKnown) {
+    Serial.println("No state received from LONG");
+  } else {
+    Serial.printf("Awake %s, Playing %s, Run %u, Volume %u, PWM %u\n",
+                  stateDesired.awake ? "YES" : "NO", stateDesired.playing ? "YES" : "NO",
+                  stateDesired.run, stateDesired.volume, stateDesired.pwm);
+  }
+
+  if (PLAYER_ID == 0) {
+    Serial.print("Records Sent ");
+    Serial.println(stateSent);
+    return;
+  }
+
+  Serial.print("Last Received ");
+  Serial.print(stateKnown ? (millis() - stateReceivedMs) / 1000 : 0);
+  Serial.println(" s ago");
+  Serial.print("Records Received ");
+  Serial.print(stateReceived);
+  Serial.print(", Rejected ");
+  Serial.println(stateRejected);
+  Serial.print("Corrections ");
+  Serial.print(stateFixes);
+  Serial.print(", last ");
+  Serial.println(stateLastFix);
+}
+
+#endif // STATECTRL_H
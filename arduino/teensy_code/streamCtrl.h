@@ -0,0 +1,143 @@
+/**
+ * streamCtrl.h - SD Stream Library
+ *
+ * A unit could only play one file, wavPlayer wired straight to the output. Up to STREAM_BEDS
+ * ambient beds, BED1 and BED2 in CONFIG.INI (16 bit PCM at 44.1 kHz, mono or stereo mixed
+ * down), now loop under the track while the system is awake. They are mixed with it by
+ * streamMix, in front of audioMix, the light still follows the track alone.
+ *
+ * The track player reads the SD card from the audio interrupt, 512 bytes per block. The beds
+ * are read from the loop instead, each into its own ring of WAV_BUFFER_SAMPLES in DMAMEM
+ * that AudioPlaySdStream empties one audio block at a time without locking. The "stream" task
+ * tops up the bed with the least audio left with one WAV_READ_BYTES read, a whole number of
+ * sectors, so the beds share the single SPI bus in large reads, lowest buffer first, between
+ * the small reads of the track. The audio interrupt is held off during every access to the
+ * card, opening and closing a bed included: the SD library and its sector cache are shared
+ * with the track player. A ring running dry plays silence and counts an underrun;
+ * arduino/sd_stream_benchmark measures how many streams a card sustains.
+ */
+
+#ifndef STREAMCTRL_H
+#define STREAMCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+#include <SD.h>
+
+extern AudioMixer4 streamMix;
+extern bool systemAwake;
+extern bool codecReady;
+extern bool sdReady;
+extern bool idleActive;
+
+#define STREAM_BEDS CONFIG_BEDS       // streamMix inputs 1 and 2, the track is on input 0
+#define STREAM_FILL_MS 2              // task period, up to 1 MB/s of reads
+#define STREAM_RETRY_MS 5000          // before opening a bed that failed again
+#define STREAM_BED_GAIN 0.5f          // mixer gain of the beds, under the track
+
+extern AudioPlaySdStream streamBeds[STREAM_BEDS];
+
+DMAMEM int16_t streamRings[STREAM_BEDS][WAV_BUFFER_SAMPLES];
+uint8_t streamScratch[WAV_READ_BYTES] __attribute__((aligned(4)));
+char streamNames[STREAM_BEDS][CONFIG_NAME_SIZE];  // file of each open bed
+uint32_t streamRetryMs[STREAM_BEDS];
+
+uint32_t streamReads = 0;
+uint64_t streamBytes = 0;
+uint32_t streamMaxReadUs = 0;
+uint32_t streamFailures = 0;          // beds that could not be opened or read
+uint32_t streamStartMs = 0;
+
+/*
+ * helper function stopping a bed
+ */
+void streamStop(int bed) {
+  streamBeds[bed].close();
+  streamNames[bed][0] = '\0';
+}
+
+/*
+ * helper function opening a bed, retried after STREAM_RETRY_MS if it fails
+ */
+void streamOpen(int bed, const char* name) {
+  if (millis() - streamRetryMs[bed] < STREAM_RETRY_MS && streamRetryMs[bed] != 0) return;
+  if (!streamBeds[bed].open(name, streamRings[bed])) {
+    streamFailures++;
+    streamRetryMs[bed] = millis();
+    Serial.print(name);
+    Serial.println(" not played: missing, or not 16 bit 44.1 kHz PCM");
+    return;
+  }
+  strcpy(streamNames[bed], name);
+  streamRetryMs[bed] = 0;
+  if (streamStartMs == 0) streamStartMs = millis();
+}
+
+/**
+ * Starts and stops the beds with the system, then tops up the one with the least buffered
+ * Run by the "stream" task every STREAM_FILL_MS
+ */
+void streamUpdate() {
+  //no SD access in idle, the audio interrupt is off and each access turns it on again
+  if (idleActive) return;
+  bool awake = systemAwake && codecReady && sdReady;
+  for (int i = 0; i < STREAM_BEDS; i++) {
+    const char* name = settings.beds[i];
+    bool wanted = awake && name[0] != '\0';
+    if (streamBeds[i].isOpen() && (!wanted || strcmp(name, streamNames[i]) != 0)) streamStop(i);
+    if (wanted && !streamBeds[i].isOpen()) streamOpen(i, name);
+  }
+
+  int got;
+  uint32_t readUs;
+  int lowest = wavFillLowest(streamBeds, STREAM_BEDS, streamScratch, got, readUs);
+  if (lowest < 0) return;
+
+  if (got < 0) {
+    Serial.printf("%s read failed, bed stopped\n", streamNames[lowest]);
+    streamStop(lowest);
+    streamFailures++;
+    streamRetryMs[lowest] = millis();
+    return;
+  }
+  streamReads++;
+  streamBytes += got;
+  if (readUs > streamMaxReadUs) streamMaxReadUs = readUs;
+}
+
+/**
+ * Sets the mixer gains and registers the fill task, to be called once from setup
+ */
+void setupStream() {
+  streamMix.gain(0, 1.0f);
+  for (int i = 0; i < STREAM_BEDS; i++) {
+    streamMix.gain(i + 1, STREAM_BED_GAIN);
+  }
+  taskAdd("stream", streamUpdate, STREAM_FILL_MS, 1);
+}
+
+/**
+ * Prints the beds, their buffers and the read load to Serial
+ */
+void streamReport() {
+  Serial.println("\n-- SD STREAMS --");
+  for (int i = 0; i < STREAM_BEDS; i++) {
+    AudioPlaySdStream &bed = streamBeds[i];
+    Serial.printf("Bed %d ", i + 1);
+    if (!bed.isOpen()) {
+      Serial.println(settings.beds[i][0] != '\0' ? "stopped" : "not set");
+      continue;
+    }
+    Serial.printf("%s %s, Buffer %lu ms, Lowest %lu ms, Underruns %lu, Loops %lu\n", streamNames[i],
+                  bed.isPlaying() ? "playing" : "buffering", (unsigned long)(bed.available() * 1000UL / 44100),
+                  (unsigned long)(bed.lowSamples * 1000UL / 44100), (unsigned long)bed.underruns,
+                  (unsigned long)bed.loops);
+  }
+  uint32_t seconds = streamStartMs != 0 ? (millis() - streamStartMs) / 1000 : 0;
+  Serial.printf("Reads %lu, %lu KB", (unsigned long)streamReads, (unsigned long)(streamBytes / 1024));
+  if (seconds > 0) Serial.printf(", %lu KB/s", (unsigned long)(streamBytes / 1024 / seconds));
+  Serial.printf("\nLongest Read %lu us, Failures %lu\n", (unsigned long)streamMaxReadUs,
+                (unsigned long)streamFailures);
+}
+
+#endif // STREAMCTRL_H
@@ -0,0 +1,249 @@
+/**
+ * taskCtrl.h - Cooperative Task Scheduler Library
+ *
+ * Small deadline-based scheduler replacing the elapsedMillis polling in loop().
+ * Tasks are periodic or one-shot, run to completion, and are picked by priority
+ * (0 = most urgent) then by due time. Each task keeps deadline-miss and runtime
+ * statistics that are printed in the system report.
+ */
+
+#ifndef TASKCTRL_H
+#define TASKCTRL_H
+
+#include <Arduino.h>
+
+#define MAX_TASKS 28
+#define TASK_NONE -1
+#define ONE_SHOT 0              // period value for one-shot tasks
+#define ONE_SHOT_DEADLINE 10    // default lateness tolerated for one-shot tasks (ms)
+
+typedef void (*TaskFunction)();
+
+struct Task {
+  const char* name;
+  TaskFunction function;
+  uint32_t periodMs;      // ONE_SHOT or period in ms
+  uint32_t deadlineMs;    // lateness after which a run counts as a deadline miss
+  uint32_t nextDueMs;     // millis() value of the next run
+  uint8_t priority;       // 0 runs first
+  bool active;            // periodic tasks start active, one-shot tasks once armed
+
+  // statistics
+  uint32_t runs;
+  uint32_t misses;        // runs started later than deadlineMs
+  uint32_t skipped;       // periods skipped because the task fell behind
+  uint32_t maxLateMs;
+  uint32_t lastRunMs;     // millis() at the start of the last run, the task check-in
+  uint32_t lastRunUs;
+  uint32_t maxRunUs;
+  uint64_t totalRunUs;
+};
+
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+volatile int taskRunning = TASK_NONE;   // task being run, read by the watchdog warning interrupt
+uint32_t schedulerPeakRunUs = 0;        // longest run since schedulerTakePeaks()
+uint32_t schedulerPeakLateMs = 0;       // largest lateness since schedulerTakePeaks()
+
+/*
+ * helper function to compare millis() timestamps across the 49 days wrap
+ * @return true if time a is at or after time b
+ */
+bool timeReached(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) >= 0;
+}
+
+/**
+ * Registers a task
+ * @param name Short name shown in reports
+ * @param function Function run to completion at each activation
+ * @param periodMs Period in ms, or ONE_SHOT for a task armed with taskRunIn()
+ * @param priority 0 is the most urgent
+ * @param deadlineMs Lateness counted as a miss, 0 for the default (one period)
+ * @param offsetMs Delay before the first run of a periodic task
+ * @return Task handle, TASK_NONE if the table is full
+ */
+int taskAdd(const char* name, TaskFunction function, uint32_t periodMs, uint8_t priority,
+            uint32_t deadlineMs = 0, uint32_t offsetMs = 0) {
+  if (taskCount >= MAX_TASKS) {
+    Serial.print("Task table full, unable to add ");
+    Serial.println(name);
+    return TASK_NONE;
+  }
+
+  Task &task = tasks[taskCount];
+  memset(&task, 0, sizeof(Task));
+  task.name = name;
+  task.function = function;
+  task.periodMs = periodMs;
+  task.priority = priority;
+  if (deadlineMs > 0) {
+    task.deadlineMs = deadlineMs;
+  } else {
+    task.deadlineMs = (periodMs == ONE_SHOT) ? ONE_SHOT_DEADLINE : periodMs;
+  }
+  task.active = (periodMs != ONE_SHOT);
+  task.nextDueMs = millis() + offsetMs;
+  task.lastRunMs = millis();
+
+  return taskCount++;
+}
+
+/**
+ * Arms a task to run once after a delay (also works to delay the next run of a periodic task)
+ * @param handle Task handle returned by taskAdd()
+ * @param delayMs Delay from now in ms
+ */
+void taskRunIn(int handle, uint32_t delayMs) {
+  if (handle < 0 || handle >= taskCount) return;
+  tasks[handle].nextDueMs = millis() + delayMs;
+  tasks[handle].active = true;
+}
+
+/**
+ * Disarms a task until the next taskRunIn()
+ * @param handle Task handle returned by taskAdd()
+ */
+void taskCancel(int handle) {
+  if (handle < 0 || handle >= taskCount) return;
+  tasks[handle].active = false;
+}
+
+/**
+ * Changes the period of a periodic task, the next run keeps its due time
+ * @param handle Task handle returned by taskAdd()
+ * @param periodMs New period in ms, the deadline follows it
+ */
+void taskSetPeriod(int handle, uint32_t periodMs) {
+  if (handle < 0 || handle >= taskCount || periodMs == ONE_SHOT) return;
+  if (tasks[handle].periodMs == ONE_SHOT) return;
+  if (tasks[handle].deadlineMs == tasks[handle].periodMs) {
+    tasks[handle].deadlineMs = periodMs;
+  }
+  tasks[handle].periodMs = periodMs;
+}
+
+/**
+ * @return true if the task is armed or periodic
+ */
+bool taskPending(int handle) {
+  if (handle < 0 || handle >= taskCount) return false;
+  return tasks[handle].active;
+}
+
+/**
+ * Runs the most urgent due task, if any
+ * To be called continuously from loop()
+ * @return True if a task ran
+ */
+bool schedulerRun() {
+  uint32_t now = millis();
+  int next = TASK_NONE;
+
+  //pick the due task with the best priority, earliest due time first on equal priority
+  for (int i = 0; i < taskCount; i++) {
+    Task &task = tasks[i];
+    if (!task.active || !timeReached(now, task.nextDueMs)) continue;
+
+    if (next == TASK_NONE ||
+        task.priority < tasks[next].priority ||
+        (task.priority == tasks[next].priority && (int32_t)(task.nextDueMs - tasks[next].nextDueMs) < 0)) {
+      next = i;
+    }
+  }
+
+  if (next == TASK_NONE) {
+    return false;
+  }
+
+  Task &task = tasks[next];
+  uint32_t lateMs = now - task.nextDueMs;
+  if (lateMs > task.maxLateMs) task.maxLateMs = lateMs;
+  if (lateMs > task.deadlineMs) task.misses++;
+  if (lateMs > schedulerPeakLateMs) schedulerPeakLateMs = lateMs;
+
+  //reschedule before running so the task may re-arm or cancel itself
+  if (task.periodMs == ONE_SHOT) {
+    task.active = false;
+  } else {
+    task.nextDueMs += task.periodMs;
+    //fell behind by more than one period, skip the missed activations instead of bursting
+    if (timeReached(now, task.nextDueMs)) {
+      uint32_t behind = (now - task.nextDueMs) / task.periodMs + 1;
+      task.skipped += behind;
+      task.nextDueMs += behind * task.periodMs;
+    }
+  }
+
+  uint32_t startUs = micros();
+  task.lastRunMs = now;
+  taskRunning = next;
+  {
+    TRACE_SCOPE_ARG(TRACE_TASK, next);
+    task.function();
+  }
+  taskRunning = TASK_NONE;
+  uint32_t runUs = micros() - startUs;
+
+  task.runs++;
+  task.lastRunUs = runUs;
+  task.totalRunUs += runUs;
+  if (runUs > task.maxRunUs) task.maxRunUs = runUs;
+  if (runUs > schedulerPeakRunUs) schedulerPeakRunUs = runUs;
+
+  return true;
+}
+
+/**
+ * Reads the loop timing peaks since the previous call and starts a new window
+ * @param runUs Longest task run in us
+ * @param lateMs Largest task lateness in ms
+ */
+void schedulerTakePeaks(uint32_t &runUs, uint32_t &lateMs) {
+  runUs = schedulerPeakRunUs;
+  lateMs = schedulerPeakLateMs;
+  schedulerPeakRunUs = 0;
+  schedulerPeakLateMs = 0;
+}
+
+/**
+ * @return ms until the next armed task is due, 0 if one is due now
+ */
+uint32_t schedulerIdleMs() {
+  uint32_t now = millis();
+  uint32_t idle = UINT32_MAX;
+
+  for (int i = 0; i < taskCount; i++) {
+    if (!tasks[i].active) continue;
+    if (timeReached(now, tasks[i].nextDueMs)) return 0;
+    uint32_t wait = tasks[i].nextDueMs - now;
+    if (wait < idle) idle = wait;
+  }
+
+  return idle;
+}
+
+/**
+ * Prints per-task statistics to Serial
+ */
+void schedulerReport() {
+  Serial.println("\n-- TASKS --");
+  Serial.println("name        prio period  runs      miss  skip  maxLate  avgUs  maxUs");
+  for (int i = 0; i < taskCount; i++) {
+    Task &task = tasks[i];
+    unsigned long avgUs = task.runs ? (unsigned long)(task.totalRunUs / task.runs) : 0;
+    Serial.printf("%-11s %4u %6lu %9lu %5lu %5lu %6lums %6lu %6lu%s\n",
+                  task.name,
+                  task.priority,
+                  (unsigned long)task.periodMs,
+                  (unsigned long)task.runs,
+                  (unsigned long)task.misses,
+                  (unsigned long)task.skipped,
+                  (unsigned long)task.maxLateMs,
+                  avgUs,
+                  (unsigned long)task.maxRunUs,
+                  task.periodMs == ONE_SHOT ? " (one-shot)" : "");
+  }
+}
+
+#endif // TASKCTRL_H
@@ -2,6 +2,7 @@
   Sound to light system for installation Suuret Muinaiset in Turku, Finland.
   Mono audio playback outputs audio RMS or peak values to PWM output, driving LED strip through a MOSFET.
   3 players in action: 1 leader (LO short for LONG) has an RTC module and control 2 followers through Serial3 (SM for SMALL and SS for SEASHELL)
+  up to 10 followers can be added, they get their address from the leader (see enumCtrl.h)
   The whole system can be controlled via USB serial commands or messages sent from the leader to the followers.
 */
 
@@ -13,23 +14,58 @@
 #include <elapsedMillis.h>
 #include <RTClib.h>
 #include "LedzCtrl.h"       //custom lib for LEDs array control
+#include "traceCtrl.h"      //custom lib for event tracing
+#include "taskCtrl.h"       //custom lib for cooperative task scheduling
+#include "gainCtrl.h"       //custom lib for the software volume ramp
+#include "dapCtrl.h"        //custom lib for the codec audio processor
+#include "bootCtrl.h"       //custom lib for the boot timeline and codec bring-up
+#include "watchdogCtrl.h"   //custom lib for the supervised task watchdog
+#include "busCtrl.h"        //custom lib for the redundant serial bus
+#include "enumCtrl.h"       //custom lib for unit addresses and the fleet size
+#include "clockCtrl.h"      //custom lib for the distributed wall clock
+#include "crashCtrl.h"      //custom lib for crash and reset forensics
+#include "configCtrl.h"     //custom lib for the SD card configuration file
+#include "powerCtrl.h"      //custom lib for relay power sequencing
+#include "idleCtrl.h"       //custom lib for low power idle
+#include "persistCtrl.h"    //custom lib for settings saved in EEPROM
+#include "wavCtrl.h"        //custom lib for WAV file headers and SD streams
+#include "cueCtrl.h"        //custom lib for the cue bank
+#include "streamCtrl.h"     //custom lib for the ambient beds streamed from SD
+#include "calendarCtrl.h"   //custom lib for the show calendar
+#include "sdCtrl.h"         //custom lib for SD card fault recovery
+#include "fleetCtrl.h"      //custom lib for fleet telemetry
+#include "stateCtrl.h"      //custom lib for desired state replication
+#include "linkCtrl.h"       //custom lib for serial link health
+#include "failoverCtrl.h"   //custom lib for leader failover
+#include "paramCtrl.h"      //custom lib for synchronized parameter changes
+#include "knobCtrl.h"       //custom lib for the volume knob
 #include "mySysCtrl.h"      //custom lib for system control
-//#include <Watchdog_t4.h>
 
 //OBJECTS
 //audio
 AudioPlaySdWav wavPlayer;
+AudioPlayMemory cueVoices[CUE_VOICES];
+AudioPlaySdStream streamBeds[STREAM_BEDS];
+AudioMixer4 streamMix;
+AudioMixer4 audioMix;
+AudioEffectRampGain audioGain;
 AudioAnalyzePeak audioPeak;
 AudioAnalyzeRMS audioRMS;
 AudioOutputI2S audioOutput;
 AudioControlSGTL5000 sgtl5000;
 //RTC
 RTC_DS3231 rtc;
-//watchdog
-//WDT_T4<WDT1> wdt;
 
 //AUDIO MATRIX
-AudioConnection patchCord1(wavPlayer, 0, audioOutput, 0);
+AudioConnection patchCord1(wavPlayer, 0, streamMix, 0);
+AudioConnection patchCord9(streamBeds[0], 0, streamMix, 1);
+AudioConnection patchCord10(streamBeds[1], 0, streamMix, 2);
+AudioConnection patchCord11(streamMix, 0, audioMix, 0);
+AudioConnection patchCord5(cueVoices[0], 0, audioMix, 1);
+AudioConnection patchCord6(cueVoices[1], 0, audioMix, 2);
+AudioConnection patchCord7(cueVoices[2], 0, audioMix, 3);
+AudioConnection patchCord8(audioMix, 0, audioGain, 0);
+AudioConnection patchCord4(audioGain, 0, audioOutput, 0);
 AudioConnection patchCord2(wavPlayer, 0, audioPeak, 0);
 AudioConnection patchCord3(wavPlayer, 0, audioRMS, 0);
 
@@ -49,6 +85,7 @@ const int PWM_PIN = 6;
 const int SMALL_PIN = 30;
 const int SEASHELL_PIN = 28;
 const int LONG_PIN = 32;
+const int RTC_INT_PIN = 9;     //DS3231 INT/SQW (LO only)
 
 //ANALOG PINS
 const uint8_t VOL_CTRL_PIN = A8; //pin22
@@ -59,36 +96,45 @@ const uint8_t LED_ARRAY[4] = {LED_1, LED_2, LED_3, LED_4};
 //SYSTEM
 /* -----------------------
 * VARIABLES YOU CAN CHANGE
-*/ -----------------------
-float audioVolume = 0.8;  //any float between 0.0 and 1.0. Will be automatic startup volume if the knobCtrl is set to false.
-bool knobCtrl = false;     //true to activate the volume knob control at startup, false to maintain audioVolume at startup. Can be switched later in the serial monitor using the command'K'
+* ----------------------- */
+float audioVolume = 0.8;  //any float between 0.0 and 1.0. Default startup volume if the knobCtrl is set to false, replaced by the saved volume once changed at runtime.
+bool knobCtrl = false;     //true to activate the volume knob control at startup, false to maintain audioVolume at startup. Can be switched later in the serial monitor using the command'K' (saved)
 const int START_HOUR = 8;  //daily wake-up time
 const int END_HOUR = 20;   //daily sleep time
 /* -----------------------
 * ########################
-*/ -----------------------
+* ----------------------- */
+
+//defaults, each player can override them in CONFIG.INI on its SD card (see configCtrl.h)
+const Settings DEFAULT_SETTINGS = {
+  20,              //UPDATE_RATE: how often should we check for updates (ms)
+  25,              //PWM_FREQ: refresh period of the PWM (ms)
+  500,             //REL_SW_DELAY: delay in between the relays are being switched (ms)
+  10000,           //STARTUP_DELAY: time the relays stay off before a scheduled reboot (ms)
+  "SMALL.WAV",     //SM_STR
+  "SEASHELL.WAV",  //SS_STR
+  "LONG.WAV",      //LO_STR
+  true,            //PEAK_MODE: switch between peak or rms mode
+  {},              //TRACK: per unit address, none set
+  {},              //BED1, BED2: no ambient bed
+  {}               //PEQ1-PEQ7, TONE, AVC, SURROUND: codec audio processor bypassed
+};
+Settings settings = DEFAULT_SETTINGS;
 
 int rangePWM = 255;       //0-255, controls brightness
 int currentCode = 0;      //starts at 0
-const int STARTUP_DELAY = 10000;   //inactivity time after setup for LONG player
 int trackIteration = 0;    //resets every day at START_HOUR
-int pwmFreq = 25;   //Hz, refresh rate for the PWM
-const int REL_SW_DELAY = 500; //delay in between the relays are being switched
 bool systemAwake = false;  //activity time between START_HOUR and END_HOUR
 bool playbackStatus = false;  //if the player is currently playing back
 bool messageIncoming = true; //if a mesage is currently coming in
 
 const int MSG_BUFFER_SIZE = 512;  //how long can a message be
 char messageBuffer[MSG_BUFFER_SIZE];  //message buffer
-const int UPDATE_RATE = 20;           //how often should we check for updates
-const bool PEAK_MODE = true;        //Switch between peak or rms mode
 const char days[7][12] = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday" };
-const char SM_STR[13] = "SMALL.WAV";
-const char SS_STR[13] = "SEASHELL.WAV";
-const char LO_STR[13] = "LONG.WAV";
 const char TEST_STR[13] = "TESTLOOP.WAV";
 char FILE_NAME[13];     //empty string to be defined by a function, will take one of the 3 file names
-int PLAYER_ID;          //the id of this player 0 1 or 2
+int PLAYER_ID;          //the id of this player, 0 for the leader, 1 to 10 for the followers
+#define PLAYBACK_CHECK_MS 10000  //period of the "playback" task, a finished track restarts within it
 
 #define SGTL_ERR_CODE 4
 #define PLAYBACK_CODE
@@ -100,22 +146,24 @@ int PLAYER_ID;          //the id of this player 0 1 or 2
 //
 void setup() {
   Serial.begin(9600);
-  Serial3.begin(9600);
-  
-  //WDT_timings_t config;
-  //config.timeout = 5;
-  //wdt.begin(config);
-  
-  // Log any crash report data
-  if (CrashReport) {
-    Serial.print("Previous crash detected: ");
-    Serial.println(CrashReport);
-    delay(1000);
-  } else{
-    Serial.println("No crash report available.");
-  }
+  busBegin();
+  bootMark("serial");
 
+  // Reason of the previous watchdog reset, if any
+  watchdogBoot();
+
+  // Settings changed at runtime before the last reboot
+  persistLoad();
+  bootMark("saved settings");
+  
   setupPlayerID();
+  bootMark("player id");
+
+  // Both bus ports, open drain TX on the followers
+  setupBus();
+
+  // Reset cause, crash report and log lines kept from the previous run
+  crashBoot(watchdogLastReset.reason);
 
   // Initialize LED array pins
   for (int j = 0; j < 4; j++) {
@@ -134,6 +182,7 @@ void setup() {
   pinMode(PWM_PIN, OUTPUT);
   digitalWrite(PWM_PIN, LOW); // Start with PWM off
   Serial.println("PWM pin setup");
+  bootMark("pins");
 
   // Audio memory allocation with error handling
   if (AudioMemoryUsage() > 0) {
@@ -142,41 +191,40 @@ void setup() {
     Serial.println("Audio memory is empty, let's allocate it.");
   }
   AudioMemory(64);
-  
-  // Enable audio codec with error checking
-  while (!sgtl5000.enable()) {
-    Serial.println("ERROR: Audio codec failed to enable");
-    displayBinaryCode(13); // Error indication
-    delay(1000);
-  }
-  sgtl5000.volume(audioVolume);
   Serial.println("Audio memory allocated");
+  //the codec is enabled by the "codec" task once the loop runs, see setupCodec()
 
   // Configure SPI for SD card with error handling
   SPI.setMOSI(SDCARD_MOSI_PIN);
   SPI.setSCK(SDCARD_SCK_PIN);
   
-  // SD card initialization with retry
+  // SD card initialization, retried by the sd task on failure
   Serial.println("SD card initialization...");
   
-  if (!(SD.begin(SDCARD_CS_PIN))) {
-    while (1) {
-      Serial.println("Unable to access the SD card");
-      displayBinaryCode(3);
-      delay(100);
-    }
+  if (!sdBegin()) {
+    Serial.println("Unable to access the SD card, running on defaults until it recovers");
   } else {
     Serial.println("SD card loaded");
   }
+  bootMark("sd card");
+
+  // Per-unit settings from SD card, defaults if missing or invalid
+  configLoad();
+
+  // Show calendar from SD card, compiled later against the RTC
+  calendarLoad();
+
+  // Cue clips from SD card into RAM
+  cueLoad();
+  bootMark("sd files");
 
   // RTC setup for LONG player only
   if (PLAYER_ID == 0) {
     setupRTC();
     Serial.println("RTC setup complete");
-    
-    Serial.print("Setup complete! Starting playback in ");
-    Serial.print(STARTUP_DELAY / 1000);
-    Serial.println("s.");
+    bootMark("rtc");
+
+    Serial.println("Setup complete! Checking the schedule.");
   } else {
     Serial.println("Setup complete! Waiting for LONG player commands.");
   }
@@ -185,59 +233,187 @@ void setup() {
   systemAwake = false;
   playbackStatus = false;
   trackIteration = 0;
-  
-  //wdt.reset();
-}
 
-//start millis thread timer
-elapsedMillis pwmTimer;       // For PWM updates
-elapsedMillis commandTimer;   // For checking commands
-elapsedMillis statusTimer;    // For status updates
-//elapsedMillis reportTimer;    // For periodic reporting (optional)
+  setupTasks();
+
+  // Hardware watchdog, fed from now on by the watchdog task
+  setupWatchdog();
+  bootMark("setup");
+}
 
 //LOOP
 void loop() {
-  //wdt.feed();
+  //run the most urgent due task, all periodic work is registered in setupTasks()
+  if (!schedulerRun()) {
+    //nothing due, sleep until the next interrupt while in low power idle
+    idleWait();
+  }
+}
+
+//###########################################################################
+//#######                           TASKS                             #######
+//###########################################################################
+/*
+ * helper function to register all periodic work on the scheduler
+ * priorities: 0 light output, 1 serial bus, 2 USB, 3 volume knob and playback, 4 status
+ */
+void setupTasks() {
+  pwmTask = taskAdd("pwm", pwmUpdate, settings.pwmFreq, 0);
+  lightTask = taskAdd("light", lightUpdate, settings.updateRate, 0);
+  taskAdd("link", serialUpdate, 10, 1);
+  taskAdd("usb", usbUpdate, 10, 2);
 
-  if (statusTimer >= 1000) {
-    statusUpdates();
-    statusTimer = 0;
+  //LO player, the playback check also runs on an acting leader
+  if (PLAYER_ID == 0) {
+    taskAdd("knob", knobUpdate, 50, 3);
   }
+  playbackTask = taskAdd("playback", playbackUpdate, PLAYBACK_CHECK_MS, 3);  //checks for the end of the track, runs right away on wake-up
+
+  taskAdd("status", statusUpdates, 1000, 4, 0, 1000);
+  setupSchedule();
+
+  //one-shot tasks
+  setupPower();
+  setupIdle();
+  setupPersist();
+  setupCodec();
+  setupSd();
+  setupFleet();
+  setupClock();
+  setupState();
+  setupLink();
+  setupEnum();
+  setupFailover();
+  setupParam();
+  setupGain();
+  setupCue();
+  setupStream();
+  rebootTask = taskAdd("reboot", rebootNow, ONE_SHOT, 0);
+  Serial.println("Tasks registered");
+}
+
+//writes the light level to the LED strip while playing
+void pwmUpdate() {
+  if (systemAwake && wavPlayer.isPlaying()) {
+    writeOutPWM(PWM_PIN);
+  }
+}
 
+//updates the status code on the LEDs array, keeps light and audio off while asleep
+void lightUpdate() {
+  //code and light are set once when entering idle
+  if (idleActive) return;
+
+  if (!codecReady && codecFailures > 0) {
+    displayBinaryCode(13); // codec still failing, retried by the codec task
+  } else if (!sdReady) {
+    displayBinaryCode(3);  // SD card fault, retried by the sd task
+  } else if (PLAYER_ID == 0 && linkFirstSilent() != 0 && !rebootPending) {
+    displayBinaryCode(linkSilentCode());  // a follower stopped answering, its address blinks
+    if (!systemAwake) {
+      analogWrite(PWM_PIN, 0);
+    }
+  } else if (systemAwake) {
+    if (wavPlayer.isPlaying()) {
+      displayBinaryCode(8);
+    } else {
+      displayBinaryCode(2);
+      analogWrite(PWM_PIN, 0);  // Set PWM to zero
+    }
+  } else {
+    // System is asleep
+    if (wavPlayer.isPlaying()) {
+      wavPlayer.stop();
+    }
+    displayBinaryCode(rebootPending ? 7 : 1);
+    analogWrite(PWM_PIN, 0);  // Set PWM to zero
+  }
+}
+
+//checks for commands and messages on USB
+void usbUpdate() {
   if (Serial.available()) {
     // Check for ':' (=message)
     if (Serial.peek() == ':') {
       checkUsbMessages();
-      commandTimer = 0;
     } else {
       // Not a message, process as command
       checkUsbCommands();
-      commandTimer = 0;
     }
   }
+}
+
+//checks both bus ports: responses from followers on LO, commands from the leader on SM/SS
+void serialUpdate() {
+  for (int port = 0; port < BUS_PORTS; port++) {
+    serialUpdatePort(port);
+  }
+}
+
+//reads one frame or command from a bus port, copies already received on the other port are dropped
+void serialUpdatePort(int port) {
+  HardwareSerial &link = busSerial(port);
+  if (!link.available()) return;
 
   //LO player
   if (PLAYER_ID == 0) {
-    leader();
+    // Check if it's a message starting with ':'
+    if (link.peek() == ':') {
+      receiveSerialMessage(port);  // Process the incoming message from follower
+    } else {
+      // Drop the character, a frame may follow right behind it
+      link.read();
+    }
+    return;
   }
 
   // SM/SS player
-  if (PLAYER_ID != 0) {
-    follower();
+  linkHeard(0);
+
+  // Check if this is a message (starts with ':')
+  if (link.peek() == ':') {
+    receiveSerialMessage(port);
+  } else {
+    // Process as a single command, line endings left by the frames are skipped
+    char inChar = (char)link.read();
+    if (inChar > 32) {
+      busReceived(port, 1, true);
+      if (!busDuplicate(port, &inChar, 1)) {
+        processCommand(inChar);
+      }
+    }
   }
+}
 
-  delay(5); //debounce
+//reads the volume knob on LO while playing
+void knobUpdate() {
+  if (knobCtrl && systemAwake && wavPlayer.isPlaying()) {
+    volumeControl();
+  }
 }
+
+//starts playback on LO and followers when awake and the track ended, except in AWAKE-only calendar windows
+//also run right away when the system becomes awake, see powerStep()
+void playbackUpdate() {
+  if (failoverLeading() && systemAwake && codecReady && !wavPlayer.isPlaying() && calendarMode != CAL_AWAKE) {
+    sendSerialCommand(CMD_PLAY);
+    playAudio();
+  }
+}
+
 //###########################################################################
 //#######                          HELPERS                            #######
 //###########################################################################
 //helper function to setup the RTC module - always updates time when connected via USB
+//without it the installation stays asleep and rtcProbe() keeps looking for it
 void setupRTC() {
   if (!rtc.begin()) {
-    Serial.println("Couldn't find RTC");
-    Serial.flush();
-    while (1) delay(10);//wait for rtc to be connected
+    Serial.println("Couldn't find RTC, staying asleep until it answers");
+    crashLog("rtc missing");
+    rtcProbeMs = millis();
+    return;
   }
+  rtcReady = true;
 
   // Always update the time when connected via USB
   if (Serial) {
@@ -260,123 +436,18 @@ void setupRTC() {
  * @peak: TRUE for peak mode, FALSE for RMS mode.
  */
 void writeOutPWM(uint8_t pin) {
-  if (pwmTimer >= (unsigned long)pwmFreq) {
-    pwmTimer = 0;  // Reset timer
-    
-    // Simplified peak/RMS handling
-    if (PEAK_MODE) {
-      if (audioPeak.available()) {
-        int pwmValue = audioPeak.read() * rangePWM;
-        analogWrite(pin, pwmValue);
-      }
-    } else {
-      if (audioRMS.available()) {
-        int pwmValue = audioRMS.read() * rangePWM;
-        analogWrite(pin, pwmValue);
-      }
-    }
-  }
-}
-
-void leader() {
-  static elapsedMillis playbackTimer;
-  static elapsedMillis updateTimer;
-  static elapsedMillis serialCheckTimer;
-  const unsigned long RETRY_INTERVAL = STARTUP_DELAY;
-  
-  // Check for playback (every 5 seconds)
-  if (systemAwake && !wavPlayer.isPlaying() && playbackTimer >= RETRY_INTERVAL) {
-    playbackTimer = 0;
-    sendSerialCommand(CMD_PLAY);
-    playAudio();
-  }
-
-  // Check for responses from followers
-  if (serialCheckTimer >= 10) {  // Check every 10ms
-    serialCheckTimer = 0;
-    
-    if (Serial3.available()) {
-      // Check if it's a message starting with ':'
-      if (Serial3.peek() == ':') {
-        receiveSerialMessage();  // Process the incoming message from follower
-      } else {
-        // Clear any other characters
-        while (Serial3.available()) {
-          Serial3.read();
-        }
-      }
-    }
-  }
-  
-  // Update display and PWM output
-  if (updateTimer >= UPDATE_RATE) {
-    updateTimer = 0;
-    if (systemAwake) {
-      if (wavPlayer.isPlaying()) {
-        writeOutPWM(PWM_PIN);
-        if (knobCtrl){
-          volumeControl();
-        }
-        displayBinaryCode(8);
-      } else {
-        displayBinaryCode(2);
-        analogWrite(PWM_PIN, 0);  // Set PWM to zero
-      }
-    } else {
-      // System is asleep
-      if (wavPlayer.isPlaying()) {
-        wavPlayer.stop();
-      }
-      displayBinaryCode(1);
-      analogWrite(PWM_PIN, 0);  // Set PWM to zero
-    }
-  }
-}
+  TRACE_SCOPE(TRACE_LIGHT_FRAME);
 
-void follower() {
-  static elapsedMillis commandCheckTimer;
-  static elapsedMillis updateTimer;
-  
-  // Check for commands frequently
-  if (commandCheckTimer >= 10) {
-    commandCheckTimer = 0;
-    
-    if (Serial3.available()) {
-      // Check if this is a message (starts with ':')
-      if (Serial3.peek() == ':') {
-        receiveSerialMessage();
-      } else {
-        // Process as a single command
-        char inChar = (char)Serial3.read();
-        processCommand(inChar);
-      }
-      
-      // Clear buffer
-      while (Serial3.available()) {
-        Serial3.read();
-      }
+  // Simplified peak/RMS handling
+  if (settings.peakMode) {
+    if (audioPeak.available()) {
+      int pwmValue = audioPeak.read() * rangePWM;
+      analogWrite(pin, pwmValue);
     }
-  }
-
-  // Update display and PWM output
-  if (updateTimer >= UPDATE_RATE) {
-    updateTimer = 0;
-    
-    if (systemAwake) {
-      if (wavPlayer.isPlaying()) {
-        writeOutPWM(PWM_PIN);
-        displayBinaryCode(8);
-      } else {
-        displayBinaryCode(2);
-        analogWrite(PWM_PIN, 0);  // Set PWM to zero
-      }
-    } else {
-      if (wavPlayer.isPlaying()) {
-        wavPlayer.stop();
-      }
-      displayBinaryCode(1);
-      analogWrite(PWM_PIN, 0);  // Set PWM to zero
+  } else {
+    if (audioRMS.available()) {
+      int pwmValue = audioRMS.read() * rangePWM;
+      analogWrite(pin, pwmValue);
     }
   }
 }
-
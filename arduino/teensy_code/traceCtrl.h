@@ -0,0 +1,147 @@
+/**
+ * traceCtrl.h - Event Trace Library
+ *
+ * Keeps a compact ring buffer of timestamped begin/end events in RAM, so we can
+ * see what stalled the light frames around a glitch (serial commands, RTC reads,
+ * relay sequences, reports...). The buffer is dumped over USB with 'T' or ":trace"
+ * and converted on the host with tools/trace2json.py into Chrome/Perfetto trace JSON.
+ */
+
+#ifndef TRACECTRL_H
+#define TRACECTRL_H
+
+#include <Arduino.h>
+
+extern int PLAYER_ID;
+
+#define TRACE_ENABLED 1         // set to 0 to compile all trace points out
+#define TRACE_CAPACITY 512      // number of events kept (8 bytes each)
+
+// Traced sections, keep in sync with traceNames[]
+enum TraceId : uint8_t {
+  TRACE_SERIAL_CMD = 0,   // sendSerialCommand()
+  TRACE_SERIAL_MSG,       // sendSerialMessage()
+  TRACE_SERIAL_RX,        // receiveSerialMessage()
+  TRACE_USB_RX,           // checkUsbCommands() / checkUsbMessages()
+  TRACE_RTC_NOW,          // rtc.now() I2C read
+  TRACE_RELAY_SEQ,        // startupSequence() / shutDownSequence()
+  TRACE_REPORT,           // systemReport()
+  TRACE_SCHEDULE,         // scheduleUpdate()
+  TRACE_LIGHT_FRAME,      // writeOutPWM()
+  TRACE_PLAY,             // playAudio()
+  TRACE_TASK,             // scheduler task run, arg is the task handle
+  TRACE_ID_COUNT
+};
+
+const char* const traceNames[TRACE_ID_COUNT] = {
+  "sendSerialCommand",
+  "sendSerialMessage",
+  "receiveSerialMessage",
+  "usbInput",
+  "rtc.now",
+  "relaySequence",
+  "systemReport",
+  "scheduleUpdate",
+  "lightFrame",
+  "playAudio",
+  "task"
+};
+
+#define TRACE_BEGIN 'B'
+#define TRACE_END 'E'
+
+// One trace event, 8 bytes
+struct TraceEvent {
+  uint32_t timeUs;  // micros() timestamp
+  uint8_t id;       // TraceId
+  char phase;       // TRACE_BEGIN or TRACE_END
+  uint16_t arg;     // free argument (command char, message length...)
+};
+
+TraceEvent traceBuffer[TRACE_CAPACITY];
+uint16_t traceHead = 0;       // next slot to write
+uint16_t traceCount = 0;      // number of valid events
+uint32_t traceDropped = 0;    // events overwritten since last dump
+bool traceRecording = true;   // paused while dumping
+
+/*
+ * helper function to record one event in the ring buffer, oldest event gets overwritten when full
+ * @id: TraceId of the section
+ * @phase: TRACE_BEGIN or TRACE_END
+ * @arg: optional argument stored with the event
+ */
+void traceRecord(uint8_t id, char phase, uint16_t arg = 0) {
+  if (!traceRecording) return;
+
+  TraceEvent &event = traceBuffer[traceHead];
+  event.timeUs = micros();
+  event.id = id;
+  event.phase = phase;
+  event.arg = arg;
+
+  traceHead = (traceHead + 1) % TRACE_CAPACITY;
+  if (traceCount < TRACE_CAPACITY) {
+    traceCount++;
+  } else {
+    traceDropped++;
+  }
+}
+
+/**
+ * Records a begin event on construction and the matching end event when going out of scope,
+ * so functions with several return paths are traced correctly.
+ */
+class TraceScope {
+public:
+  TraceScope(uint8_t id, uint16_t arg = 0) : traceId(id), traceArg(arg) {
+    traceRecord(traceId, TRACE_BEGIN, traceArg);
+  }
+  ~TraceScope() {
+    traceRecord(traceId, TRACE_END, traceArg);
+  }
+private:
+  uint8_t traceId;
+  uint16_t traceArg;
+};
+
+#if TRACE_ENABLED
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(id) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(id)
+#define TRACE_SCOPE_ARG(id, arg) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(id, arg)
+#else
+#define TRACE_SCOPE(id)
+#define TRACE_SCOPE_ARG(id, arg)
+#endif
+
+/**
+ * Dumps the ring buffer over USB, oldest event first
+ * Format (one per line): TRACE|<micros>|<id>|<B/E>|<arg>
+ * Header lines carry the player ID and the id -> name table for the host converter
+ */
+void traceDump() {
+  traceRecording = false;
+
+  Serial.println("\n----- TRACE DUMP -----");
+  Serial.print("TRACE|player|");
+  Serial.println(PLAYER_ID);
+  for (int i = 0; i < TRACE_ID_COUNT; i++) {
+    Serial.printf("TRACE|name|%d|%s\n", i, traceNames[i]);
+  }
+  Serial.printf("TRACE|count|%u|dropped|%lu\n", traceCount, (unsigned long)traceDropped);
+
+  uint16_t start = (traceHead + TRACE_CAPACITY - traceCount) % TRACE_CAPACITY;
+  for (uint16_t i = 0; i < traceCount; i++) {
+    const TraceEvent &event = traceBuffer[(start + i) % TRACE_CAPACITY];
+    Serial.printf("TRACE|%lu|%u|%c|%u\n", (unsigned long)event.timeUs, event.id, event.phase, event.arg);
+  }
+  Serial.println("----- END TRACE -----\n");
+
+  // start a fresh window after each dump
+  traceHead = 0;
+  traceCount = 0;
+  traceDropped = 0;
+  traceRecording = true;
+}
+
+#endif // TRACECTRL_H
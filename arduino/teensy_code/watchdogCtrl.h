@@ -0,0 +1,307 @@
+/**
+ * watchdogCtrl.h - Supervised Task Watchdog Library
+ *
+ * The hardware watchdog (WDT1) is only fed by the "watchdog" task, and only while every
+ * periodic task has checked in (run) within WDT_CHECKIN_PERIODS of its period. A loop stuck
+ * in one task or a task starved by the others therefore ends in a hardware reset.
+ *
+ * Detectors for the known failure points try a local recovery first:
+ * - stalled audio position: the SD card is re-initialised (see sdCtrl.h)
+ * - slow or invalid RTC read: the I2C bus is cleared and the read retried
+ * - serial parser busy longer than WDT_PARSER_MAX_MS: the bus port is flushed
+ * More than WDT_MAX_LOCAL recoveries of the same kind within WDT_ESCALATE_MS escalate to
+ * a hardware reset by no longer feeding the watchdog.
+ *
+ * The reason, the task running and the activity in progress (RTC read, parser) are kept in
+ * DMAMEM, which is not cleared by a reset, and printed at the next boot and in the report.
+ */
+
+#ifndef WATCHDOGCTRL_H
+#define WATCHDOGCTRL_H
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Watchdog_t4.h>
+
+void crashLog(const char* format, ...);
+
+#define WDT_TIMEOUT_S 8           // hardware reset when not fed for this long
+#define WDT_WARNING_S 2           // warning interrupt this long before the reset
+#define WDT_CHECK_MS 500          // period of the watchdog task
+#define WDT_CHECKIN_PERIODS 4     // periods a task may miss before it counts as stuck
+#define WDT_CHECKIN_MIN_MS 2000   // lower bound of the check-in window for fast tasks
+#define WDT_RTC_MAX_MS 50         // RTC read longer than this counts as a hung bus
+#define WDT_PARSER_MAX_MS 1000    // a 512 char message at 9600 baud takes about 530 ms
+#define WDT_MAX_LOCAL 3           // local recoveries of one kind before escalating
+#define WDT_ESCALATE_MS 600000    // window of WDT_MAX_LOCAL recoveries
+#define WDT_MAX_REPEATS 3         // resets in a row for one reason before escalation is disabled
+#define WDT_I2C_SCL_PIN 19        // Wire SCL on Teensy 4.0
+#define WDT_RECORD_MAGIC 0x57445452  // "WDTR"
+
+enum WdtReason : uint8_t {
+  WDT_REASON_NONE = 0,  // normal boot or reset on request
+  WDT_REASON_HANG,      // the loop stopped feeding the watchdog
+  WDT_REASON_STARVED,   // a periodic task did not check in
+  WDT_REASON_AUDIO,     // playback position stalled repeatedly
+  WDT_REASON_RTC,       // RTC reads hung repeatedly
+  WDT_REASON_PARSER,    // serial parser stuck repeatedly
+  WDT_REASON_COUNT
+};
+
+const char* const wdtReasonNames[] = { "NONE", "HANG", "STARVED", "AUDIO STALL", "RTC HUNG", "PARSER STUCK" };
+
+// what the loop is doing besides running a task, kept to tell where a hang happened
+enum WdtActivity : uint8_t {
+  WDT_ACT_NONE = 0,
+  WDT_ACT_RTC,          // rtc.now() I2C read
+  WDT_ACT_PARSER,       // receiveSerialMessage()
+  WDT_ACT_COUNT
+};
+
+const char* const wdtActivityNames[] = { "-", "RTC READ", "SERIAL PARSER" };
+
+// survives a reset in DMAMEM, validated with magic and check
+struct WatchdogRecord {
+  uint32_t magic;
+  uint8_t reason;           // WdtReason of the last reset
+  uint8_t activity;         // WdtActivity when it happened
+  uint8_t repeats;          // resets in a row for the same reason
+  uint8_t reserved;
+  char task[12];            // task running or starved
+  uint32_t uptimeMs;
+  uint32_t resets;          // watchdog resets since power-up
+  uint32_t check;
+};
+
+DMAMEM WatchdogRecord watchdogRecord;
+WatchdogRecord watchdogLastReset;     // copy of the record found at boot
+
+WDT_T4<WDT1> wdt;
+bool watchdogStarted = false;
+bool watchdogEscalated = false;       // no longer feeding, reset within WDT_TIMEOUT_S
+WdtReason watchdogEscalation = WDT_REASON_NONE;
+
+volatile uint8_t watchdogActivity = WDT_ACT_NONE;
+uint32_t watchdogActivityMs = 0;
+
+uint32_t watchdogLocal[WDT_REASON_COUNT];            // local recoveries since boot
+uint32_t watchdogWindowStart[WDT_REASON_COUNT];
+uint8_t watchdogWindowCount[WDT_REASON_COUNT];
+
+/*
+ * helper function computing the record check value
+ */
+uint32_t watchdogRecordCheck(const WatchdogRecord &record) {
+  const uint8_t* data = (const uint8_t*)&record;
+  uint32_t check = 0xA5A5A5A5;
+  for (size_t i = 0; i < offsetof(WatchdogRecord, check); i++) {
+    check = (check << 5) + (check >> 27) + data[i];
+  }
+  return check;
+}
+
+/*
+ * helper function writing the reset reason to DMAMEM, safe from the warning interrupt
+ */
+void watchdogRecordReason(WdtReason reason, const char* task) {
+  bool valid = watchdogRecord.magic == WDT_RECORD_MAGIC &&
+               watchdogRecord.check == watchdogRecordCheck(watchdogRecord);
+  //an escalation already wrote its reason, keep it
+  if (valid && watchdogRecord.reason != WDT_REASON_NONE) return;
+
+  watchdogRecord.magic = WDT_RECORD_MAGIC;
+  watchdogRecord.repeats = (watchdogLastReset.reason == reason) ? watchdogLastReset.repeats + 1 : 1;
+  watchdogRecord.reason = reason;
+  watchdogRecord.activity = watchdogActivity;
+  strncpy(watchdogRecord.task, task, sizeof(watchdogRecord.task) - 1);
+  watchdogRecord.task[sizeof(watchdogRecord.task) - 1] = '\0';
+  watchdogRecord.uptimeMs = millis();
+  watchdogRecord.resets = watchdogLastReset.resets + 1;
+  watchdogRecord.check = watchdogRecordCheck(watchdogRecord);
+  arm_dcache_flush(&watchdogRecord, sizeof(watchdogRecord));
+}
+
+/*
+ * WDT1 warning interrupt, the reset follows in WDT_WARNING_S
+ */
+void watchdogWarning() {
+  int running = taskRunning;
+  watchdogRecordReason(WDT_REASON_HANG, running != TASK_NONE ? tasks[running].name : "-");
+}
+
+/**
+ * Marks the start of an activity that may hang outside the scheduler's view
+ * @param activity Activity starting
+ */
+void watchdogBegin(WdtActivity activity) {
+  watchdogActivity = activity;
+  watchdogActivityMs = millis();
+}
+
+/**
+ * Marks the end of the current activity
+ * @return Duration of the activity in ms
+ */
+uint32_t watchdogEnd() {
+  watchdogActivity = WDT_ACT_NONE;
+  return millis() - watchdogActivityMs;
+}
+
+/*
+ * helper function to stop feeding the hardware watchdog, a reset follows in WDT_TIMEOUT_S
+ */
+void watchdogEscalate(WdtReason reason, const char* task) {
+  if (watchdogEscalated) return;
+
+  //the same fault survived several resets, resetting again would only loop
+  if (watchdogLastReset.reason == reason && watchdogLastReset.repeats >= WDT_MAX_REPEATS) {
+    Serial.print("Watchdog escalation suppressed after repeated resets: ");
+    Serial.println(wdtReasonNames[reason]);
+    return;
+  }
+
+  Serial.print("Watchdog escalation, hardware reset for ");
+  Serial.println(wdtReasonNames[reason]);
+  crashLog("wdt escalate %s %s", wdtReasonNames[reason], task);
+  watchdogRecordReason(reason, task);
+  watchdogEscalated = true;
+  watchdogEscalation = reason;
+}
+
+/**
+ * Counts a local recovery, escalates when the same one repeats too often
+ * @param reason Detector that recovered
+ */
+void watchdogRecovered(WdtReason reason) {
+  watchdogLocal[reason]++;
+
+  uint32_t now = millis();
+  if (watchdogWindowCount[reason] == 0 || now - watchdogWindowStart[reason] > WDT_ESCALATE_MS) {
+    watchdogWindowStart[reason] = now;
+    watchdogWindowCount[reason] = 0;
+  }
+  watchdogWindowCount[reason]++;
+
+  Serial.print("Watchdog local recovery: ");
+  Serial.println(wdtReasonNames[reason]);
+  crashLog("wdt recover %s", wdtReasonNames[reason]);
+
+  if (watchdogWindowCount[reason] > WDT_MAX_LOCAL) {
+    watchdogEscalate(reason, "-");
+  }
+}
+
+/**
+ * Frees an I2C bus held low by a slave stuck mid-byte, then restarts Wire
+ */
+void watchdogI2cRecover() {
+  pinMode(WDT_I2C_SCL_PIN, OUTPUT_OPENDRAIN);
+  for (int i = 0; i < 9; i++) {
+    digitalWrite(WDT_I2C_SCL_PIN, LOW);
+    delayMicroseconds(5);
+    digitalWrite(WDT_I2C_SCL_PIN, HIGH);
+    delayMicroseconds(5);
+  }
+  Wire.begin();
+}
+
+/**
+ * Feeds the hardware watchdog if every periodic task checked in, run by the "watchdog" task
+ */
+void watchdogUpdate() {
+  uint32_t now = millis();
+
+  for (int i = 0; i < taskCount; i++) {
+    Task &task = tasks[i];
+    if (task.periodMs == ONE_SHOT || !task.active) continue;
+
+    uint32_t allowed = max((uint32_t)(task.periodMs * WDT_CHECKIN_PERIODS), (uint32_t)WDT_CHECKIN_MIN_MS);
+    if (now - task.lastRunMs > allowed) {
+      Serial.print("Task did not check in: ");
+      Serial.println(task.name);
+      watchdogEscalate(WDT_REASON_STARVED, task.name);
+    }
+  }
+
+  if (watchdogStarted && !watchdogEscalated) {
+    wdt.feed();
+  }
+}
+
+/**
+ * Reads the record left by the previous reset, to be called early in setup
+ */
+void watchdogBoot() {
+  bool valid = watchdogRecord.magic == WDT_RECORD_MAGIC &&
+               watchdogRecord.check == watchdogRecordCheck(watchdogRecord);
+  if (valid) {
+    watchdogLastReset = watchdogRecord;
+  } else {
+    memset(&watchdogLastReset, 0, sizeof(watchdogLastReset));
+  }
+
+  if (watchdogLastReset.reason != WDT_REASON_NONE) {
+    Serial.print("Previous watchdog reset: ");
+    Serial.print(wdtReasonNames[watchdogLastReset.reason % WDT_REASON_COUNT]);
+    Serial.print(" in ");
+    Serial.print(watchdogLastReset.task);
+    Serial.print(" / ");
+    Serial.print(wdtActivityNames[watchdogLastReset.activity % WDT_ACT_COUNT]);
+    Serial.print(" after ");
+    Serial.print(watchdogLastReset.uptimeMs / 1000);
+    Serial.println(" s");
+  }
+
+  //armed for this run, the reset counters carry over
+  watchdogRecord = watchdogLastReset;
+  watchdogRecord.magic = WDT_RECORD_MAGIC;
+  watchdogRecord.reason = WDT_REASON_NONE;
+  watchdogRecord.check = watchdogRecordCheck(watchdogRecord);
+  arm_dcache_flush(&watchdogRecord, sizeof(watchdogRecord));
+}
+
+/**
+ * Starts the hardware watchdog and registers the watchdog task, to be called at the end of setup
+ */
+void setupWatchdog() {
+  taskAdd("watchdog", watchdogUpdate, WDT_CHECK_MS, 0);
+
+  WDT_timings_t config;
+  config.trigger = WDT_WARNING_S;
+  config.timeout = WDT_TIMEOUT_S;
+  config.callback = watchdogWarning;
+  wdt.begin(config);
+  watchdogStarted = true;
+}
+
+/**
+ * Prints watchdog state, local recoveries and the last reset reason to Serial
+ */
+void watchdogReport() {
+  Serial.println("\n-- WATCHDOG --");
+  Serial.print("Hardware Watchdog ");
+  Serial.println(watchdogStarted ? "RUNNING" : "OFF");
+  Serial.print("Escalated ");
+  Serial.println(watchdogEscalated ? wdtReasonNames[watchdogEscalation] : "NO");
+  Serial.print("Local Recoveries ");
+  for (int i = WDT_REASON_AUDIO; i < WDT_REASON_COUNT; i++) {
+    Serial.print(wdtReasonNames[i]);
+    Serial.print(" ");
+    Serial.print(watchdogLocal[i]);
+    Serial.print(i < WDT_REASON_COUNT - 1 ? ", " : "\n");
+  }
+  Serial.print("Watchdog Resets ");
+  Serial.println(watchdogLastReset.resets);
+  Serial.print("Last Reset ");
+  if (watchdogLastReset.reason == WDT_REASON_NONE) {
+    Serial.println("-");
+  } else {
+    Serial.print(wdtReasonNames[watchdogLastReset.reason % WDT_REASON_COUNT]);
+    Serial.print(" in ");
+    Serial.print(watchdogLastReset.task);
+    Serial.print(" / ");
+    Serial.println(wdtActivityNames[watchdogLastReset.activity % WDT_ACT_COUNT]);
+  }
+}
+
+#endif // WATCHDOGCTRL_H
@@ -0,0 +1,250 @@
+/**
+ * wavCtrl.h - WAV File Library
+ *
+ * The cue bank and the SD streams read the same files: 16 bit PCM at 44.1 kHz, mono or
+ * stereo. wavReadHeader() walks the RIFF chunks of such a file up to its PCM data, the format
+ * chunk coming before the data chunk as every common tool writes it, and leaves the file at
+ * the first sample.
+ *
+ * AudioPlaySdStream loops such a file from a ring of WAV_BUFFER_SAMPLES (stereo mixed down),
+ * emptied one audio block at a time by the audio interrupt without locking and filled from
+ * the loop by wavFillLowest(), one WAV_READ_BYTES read (four sectors) for the stream with the
+ * least audio buffered. Every access to the card holds off the audio interrupt, as
+ * AudioPlaySdWav reads the card from it and the SD library and its sector cache are shared:
+ * none of them may be called with the audio interrupt already off (low power idle).
+ *
+ * The file has no dependency on the rest of the firmware, arduino/sd_stream_benchmark uses it.
+ */
+
+#ifndef WAVCTRL_H
+#define WAVCTRL_H
+
+#include <Arduino.h>
+#include <Audio.h>
+#include <SD.h>
+
+#define WAV_SAMPLE_RATE 44100
+#define WAV_BUFFER_SAMPLES 8192       // per stream, 186 ms at 44.1 kHz, a power of two
+#define WAV_READ_BYTES 2048           // one read, four sectors
+#define WAV_START_SAMPLES 4096        // buffered before a stream starts
+
+// PCM data of a WAV file
+struct WavInfo {
+  int channels;           // 1 or 2
+  uint32_t dataStart;     // file position of the first sample
+  uint32_t dataEnd;       // file position after the last whole frame
+};
+
+/*
+ * helper function reading a little endian field
+ */
+uint32_t wavField(const uint8_t* bytes, int size) {
+  uint32_t value = 0;
+  for (int i = size - 1; i >= 0; i--) value = (value << 8) | bytes[i];
+  return value;
+}
+
+/**
+ * Reads the header of a WAV file, the file is left at its first sample
+ * @param file File open at its start
+ * @param info Filled with the channels and the position of the PCM data
+ * @return False if the file is not 16 bit PCM at 44.1 kHz, mono or stereo, or holds no sample
+ */
+bool wavReadHeader(File &file, WavInfo &info) {
+  uint8_t header[16];
+  bool formatOk = false;
+  info.channels = 1;
+
+  if (file.read(header, 12) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+  while (file.read(header, 8) == 8) {
+    uint32_t chunkSize = wavField(header + 4, 4);
+    if (memcmp(header, "fmt ", 4) == 0) {
+      if (chunkSize < 16 || file.read(header, 16) != 16) return false;
+      info.channels = wavField(header + 2, 2);
+      formatOk = wavField(header, 2) == 1 && (info.channels == 1 || info.channels == 2) &&
+                 wavField(header + 4, 4) == WAV_SAMPLE_RATE && wavField(header + 14, 2) == 16;
+      file.seek(file.position() + chunkSize - 16 + (chunkSize & 1));
+    } else if (memcmp(header, "data", 4) == 0) {
+      uint32_t frameBytes = 2 * info.channels;
+      info.dataStart = file.position();
+      info.dataEnd = info.dataStart + chunkSize - chunkSize % frameBytes;
+      return formatOk && info.dataEnd > info.dataStart;
+    } else {
+      file.seek(file.position() + chunkSize + (chunkSize & 1));
+    }
+  }
+  return false;
+}
+
+/**
+ * @return Frames (samples per channel) of the PCM data
+ */
+uint32_t wavFrames(const WavInfo &info) {
+  return (info.dataEnd - info.dataStart) / (2 * info.channels);
+}
+
+// Mono stream played from a ring buffer, filled from the loop, emptied by the audio interrupt
+class AudioPlaySdStream : public AudioStream {
+public:
+  AudioPlaySdStream() : AudioStream(0, NULL) {}
+
+  /**
+   * Opens a WAV file and reads up to its data, the stream starts once buffered
+   * Holds off the audio interrupt while it reads the card, not to be called with it off
+   * @param name File on the SD card
+   * @param ring Buffer of WAV_BUFFER_SAMPLES samples
+   * @param startFrame Frame to start from, wrapped to the length of the file
+   * @return False if the file is missing or not 16 bit PCM at 44.1 kHz
+   */
+  bool open(const char* name, int16_t* ring, uint32_t startFrame = 0) {
+    close();
+    WavInfo wav;
+    AudioNoInterrupts();
+    file = SD.open(name);
+    bool valid = file && wavReadHeader(file, wav);
+    if (valid && startFrame > 0) file.seek(wav.dataStart + startFrame % wavFrames(wav) * 2 * wav.channels);
+    if (file && !valid) file.close();
+    AudioInterrupts();
+    if (!valid) return false;
+
+    channels = wav.channels;
+    dataStart = wav.dataStart;
+    dataEnd = wav.dataEnd;
+    buffer = ring;
+    readCount = 0;
+    writeCount = 0;
+    lowSamples = WAV_BUFFER_SAMPLES;
+    underruns = 0;
+    loops = 0;
+    opened = true;
+    return true;
+  }
+
+  /**
+   * Stops the stream and closes its file, with the audio interrupt held off
+   */
+  void close() {
+    playing = false;
+    if (opened) {
+      AudioNoInterrupts();
+      file.close();
+      AudioInterrupts();
+    }
+    opened = false;
+  }
+
+  bool isOpen() {
+    return opened;
+  }
+
+  bool isPlaying() {
+    return playing;
+  }
+
+  /**
+   * @return Samples buffered, ready for the audio interrupt
+   */
+  uint32_t available() {
+    return writeCount - readCount;
+  }
+
+  /**
+   * @return True if a full read fits in the ring
+   */
+  bool wantsRead() {
+    return opened && WAV_BUFFER_SAMPLES - available() >= (uint32_t)(WAV_READ_BYTES / (2 * channels));
+  }
+
+  /**
+   * Reads one chunk into the ring, back to the start of the data at its end, loop only
+   * The caller holds off the audio interrupt around it
+   * @return Bytes read, -1 on a read error
+   */
+  int fill(uint8_t* scratch) {
+    uint32_t position = file.position();
+    if (position >= dataEnd) {
+      file.seek(dataStart);
+      position = dataStart;
+      loops++;
+    }
+    uint32_t bytes = min((uint32_t)WAV_READ_BYTES, dataEnd - position);
+    int got = file.read(scratch, bytes);
+    if (got <= 0) return -1;
+
+    //samples go in before the write count that hands them to the interrupt
+    const int16_t* samples = (const int16_t*)scratch;
+    int frames = got / (2 * channels);
+    uint32_t write = writeCount;
+    for (int i = 0; i < frames; i++) {
+      int16_t sample = channels == 1 ? samples[i] : (samples[2 * i] + samples[2 * i + 1]) / 2;
+      buffer[(write + i) & (WAV_BUFFER_SAMPLES - 1)] = sample;
+    }
+    writeCount = write + frames;
+
+    if (!playing && available() >= WAV_START_SAMPLES) playing = true;
+    return got;
+  }
+
+  void update(void) override {
+    if (!playing) return;
+    uint32_t read = readCount;
+    uint32_t buffered = writeCount - read;
+    if (buffered < lowSamples) lowSamples = buffered;
+    if (buffered < AUDIO_BLOCK_SAMPLES) {
+      underruns++;
+      return;
+    }
+    audio_block_t* block = allocate();
+    if (block == NULL) return;
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+      block->data[i] = buffer[(read + i) & (WAV_BUFFER_SAMPLES - 1)];
+    }
+    readCount = read + AUDIO_BLOCK_SAMPLES;
+    transmit(block);
+    release(block);
+  }
+
+  volatile uint32_t lowSamples = WAV_BUFFER_SAMPLES;  // fewest samples buffered at an audio block
+  volatile uint32_t underruns = 0;    // audio blocks played as silence
+  uint32_t loops = 0;
+
+private:
+  File file;
+  int16_t* buffer = NULL;
+  int channels = 1;
+  uint32_t dataStart = 0;
+  uint32_t dataEnd = 0;
+  bool opened = false;                // loop only
+  volatile bool playing = false;
+  volatile uint32_t readCount = 0;    // written by the audio interrupt only
+  volatile uint32_t writeCount = 0;   // written by the loop only
+};
+
+/**
+ * Tops up the stream with the least audio buffered with one read, audio interrupt held off
+ * @param streams Streams sharing the card
+ * @param count Streams in the array
+ * @param scratch Buffer of WAV_READ_BYTES, 4 byte aligned
+ * @param got Bytes read, -1 on a read error
+ * @param readUs Time the audio interrupt was held off
+ * @return Stream read, -1 if none had room for a read
+ */
+int wavFillLowest(AudioPlaySdStream* streams, int count, uint8_t* scratch, int &got, uint32_t &readUs) {
+  int lowest = -1;
+  for (int i = 0; i < count; i++) {
+    if (!streams[i].wantsRead()) continue;
+    if (lowest < 0 || streams[i].available() < streams[lowest].available()) lowest = i;
+  }
+  if (lowest < 0) return -1;
+
+  uint32_t startUs = micros();
+  AudioNoInterrupts();
+  got = streams[lowest].fill(scratch);
+  AudioInterrupts();
+  readUs = micros() - startUs;
+  return lowest;
+}
+
+#endif // WAVCTRL_H
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+mkschedule.py - builds the SCHEDULE.BIN show calendar read by the teensy_code firmware.
+
+Text format, one entry per line, '#' starts a comment:
+
+    # weekly windows: <days> <HH:MM>-<HH:MM> [show|awake]
+    mon-fri 10:00-18:00 show
+    sat,sun 11:00-13:00
+    sat,sun 14:00-17:00
+    # date exceptions replace the weekly windows of that day
+    2026-12-24 closed
+    2026-12-31 10:00-14:00 show
+
+"show" wakes the system and loops the track (default), "awake" powers the
+amp and speaker without automatic playback. End time 24:00 is allowed.
+
+    python3 tools/mkschedule.py schedule.txt -o SCHEDULE.BIN
+    python3 tools/mkschedule.py --dump SCHEDULE.BIN
+
+Copy SCHEDULE.BIN to the root of the SD card of every unit.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+MAGIC = b"SMSC"
+VERSION = 1
+MAX_WINDOWS = 16
+MAX_EXCEPTIONS = 32
+
+ACTIONS = {"closed": 0, "show": 1, "awake": 2}
+ACTION_NAMES = {v: k for k, v in ACTIONS.items()}
+DAYS = ["sun", "mon", "tue", "wed", "thu", "fri", "sat"]
+
+HEADER = struct.Struct("<4sBBBB")
+WINDOW = struct.Struct("<BBHH")
+EXCEPTION = struct.Struct("<HBBBBHH")
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, same as crc16() in the firmware."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def parse_days(text):
+    mask = 0
+    for part in text.lower().split(","):
+        if "-" in part:
+            first, last = part.split("-")
+            index = DAYS.index(first)
+            while True:
+                mask |= 1 << index
+                if DAYS[index] == last:
+                    break
+                index = (index + 1) % 7
+        elif part in ("daily", "all"):
+            mask = 0x7F
+        else:
+            mask |= 1 << DAYS.index(part)
+    return mask
+
+
+def parse_range(text):
+    match = re.fullmatch(r"(\d{1,2}):(\d{2})-(\d{1,2}):(\d{2})", text)
+    if not match:
+        raise ValueError("bad time range '%s'" % text)
+    start = int(match.group(1)) * 60 + int(match.group(2))
+    end = int(match.group(3)) * 60 + int(match.group(4))
+    if not 0 <= start < end <= 1440:
+        raise ValueError("time range '%s' must be within one day" % text)
+    return start, end
+
+
+def compile_text(lines):
+    windows = []
+    exceptions = []
+
+    for number, raw in enumerate(lines, 1):
+        line = raw.split("#")[0].strip()
+        if not line:
+            continue
+        fields = line.split()
+        try:
+            date = re.fullmatch(r"(\d{4})-(\d{2})-(\d{2})", fields[0])
+            if date:
+                year, month, day = (int(x) for x in date.groups())
+                if fields[1] == "closed":
+                    exceptions.append((year, month, day, ACTIONS["closed"], 0, 0, 0))
+                else:
+                    start, end = parse_range(fields[1])
+                    action = ACTIONS[fields[2] if len(fields) > 2 else "show"]
+                    exceptions.append((year, month, day, action, 0, start, end))
+            else:
+                start, end = parse_range(fields[1])
+                action = ACTIONS[fields[2] if len(fields) > 2 else "show"]
+                windows.append((parse_days(fields[0]), action, start, end))
+        except (ValueError, KeyError, IndexError) as error:
+            sys.exit("line %d: %s (%s)" % (number, raw.strip(), error))
+
+    if len(windows) > MAX_WINDOWS or len(exceptions) > MAX_EXCEPTIONS:
+        sys.exit("at most %d weekly windows and %d exceptions" % (MAX_WINDOWS, MAX_EXCEPTIONS))
+
+    data = HEADER.pack(MAGIC, VERSION, len(windows), len(exceptions), 0)
+    data += b"".join(WINDOW.pack(*w) for w in windows)
+    data += b"".join(EXCEPTION.pack(*e) for e in exceptions)
+    return data + struct.pack("<H", crc16(data))
+
+
+def dump(data):
+    magic, version, window_count, exception_count, _ = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or crc16(data[:-2]) != struct.unpack("<H", data[-2:])[0]:
+        sys.exit("not a valid SCHEDULE.BIN")
+
+    offset = HEADER.size
+    for _ in range(window_count):
+        mask, action, start, end = WINDOW.unpack_from(data, offset)
+        offset += WINDOW.size
+        days = ",".join(d for i, d in enumerate(DAYS) if mask & (1 << i))
+        print("%s %02d:%02d-%02d:%02d %s" % (days, start // 60, start % 60, end // 60, end % 60, ACTION_NAMES[action]))
+    for _ in range(exception_count):
+        year, month, day, action, _, start, end = EXCEPTION.unpack_from(data, offset)
+        offset += EXCEPTION.size
+        if action == ACTIONS["closed"]:
+            print("%04d-%02d-%02d closed" % (year, month, day))
+        else:
+            print("%04d-%02d-%02d %02d:%02d-%02d:%02d %s" % (year, month, day, start // 60, start % 60,
+                                                          end // 60, end % 60, ACTION_NAMES[action]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build or inspect SCHEDULE.BIN")
+    parser.add_argument("source", nargs="?", help="schedule text file (stdin if omitted)")
+    parser.add_argument("-o", "--output", default="SCHEDULE.BIN", help="output file")
+    parser.add_argument("--dump", metavar="BIN", help="print the content of an existing SCHEDULE.BIN")
+    args = parser.parse_args()
+
+    if args.dump:
+        with open(args.dump, "rb") as binary:
+            dump(binary.read())
+        return
+
+    source = open(args.source) if args.source else sys.stdin
+    data = compile_text(source)
+    with open(args.output, "wb") as binary:
+        binary.write(data)
+    print("%s written, %d bytes" % (args.output, len(data)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+trace2json.py - converts trace dumps from the teensy_code firmware into Chrome trace-event JSON.
+
+Capture the USB serial output of one or more players after sending 'T' (or ":trace"),
+then convert and open the result in https://ui.perfetto.dev or chrome://tracing:
+
+    python3 tools/trace2json.py long.log small.log -o trace.json
+
+Each player becomes its own process row (LONG, SMALL, SEASHELL). Timestamps are
+micros() values from the firmware, unwrapped across the 32-bit overflow (~71 min).
+"""
+
+import argparse
+import json
+import sys
+
+PLAYER_NAMES = {0: "LONG", 1: "SMALL", 2: "SEASHELL"}
+WRAP = 1 << 32
+
+
+def parse_dump(lines, default_player):
+    """Parses TRACE| lines, returns a list of (player, names, events) per dump found."""
+    dumps = []
+    current = None
+
+    for raw in lines:
+        line = raw.strip()
+        if not line.startswith("TRACE|"):
+            continue
+        fields = line.split("|")
+
+        if fields[1] == "player":
+            current = {"player": int(fields[2]), "names": {}, "events": []}
+            dumps.append(current)
+            continue
+        if current is None:
+            current = {"player": default_player, "names": {}, "events": []}
+            dumps.append(current)
+
+        if fields[1] == "name":
+            current["names"][int(fields[2])] = fields[3]
+        elif fields[1] == "count":
+            current["dropped"] = int(fields[4])
+        elif len(fields) >= 5:
+            current["events"].append((int(fields[1]), int(fields[2]), fields[3], int(fields[4])))
+
+    return dumps
+
+
+def to_trace_events(dump):
+    """Converts one dump to Chrome trace events, unwrapping micros() overflow."""
+    pid = dump["player"]
+    names = dump["names"]
+    events = [{
+        "name": "process_name", "ph": "M", "pid": pid, "tid": 0,
+        "args": {"name": PLAYER_NAMES.get(pid, "PLAYER %d" % pid)},
+    }]
+
+    offset = 0
+    previous = None
+    for time_us, trace_id, phase, arg in dump["events"]:
+        if previous is not None and time_us < previous:
+            offset += WRAP
+        previous = time_us
+
+        events.append({
+            "name": names.get(trace_id, "id%d" % trace_id),
+            "ph": phase,
+            "ts": time_us + offset,
+            "pid": pid,
+            "tid": 0,
+            "args": {"arg": arg},
+        })
+
+    if dump.get("dropped"):
+        events.append({
+            "name": "%d events dropped before this window" % dump["dropped"],
+            "ph": "i", "s": "p", "pid": pid, "tid": 0,
+            "ts": events[1]["ts"] if len(events) > 1 else 0,
+        })
+
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert firmware trace dumps to Chrome trace JSON")
+    parser.add_argument("logs", nargs="*", help="serial logs containing TRACE| lines (stdin if omitted)")
+    parser.add_argument("-o", "--output", help="output file (stdout if omitted)")
+    args = parser.parse_args()
+
+    dumps = []
+    if args.logs:
+        for index, path in enumerate(args.logs):
+            with open(path, errors="replace") as log:
+                dumps.extend(parse_dump(log, index))
+    else:
+        dumps.extend(parse_dump(sys.stdin, 0))
+
+    trace = {"traceEvents": [], "displayTimeUnit": "ms"}
+    for dump in dumps:
+        trace["traceEvents"].extend(to_trace_events(dump))
+
+    if args.output:
+        with open(args.output, "w") as out:
+            json.dump(trace, out)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()